@@ -40,11 +40,32 @@ public class WhisperContextParams extends Structure {
     /** DTW memory size (internal use) */
     public NativeLong dtw_mem_size;
 
+    /** Type of the self-attention and cross-attention KV caches (ggml_type, default = GGML_TYPE_F16) */
+    public int type_kv_self;
+    public int type_kv_cross;
+
+    /** Map the model file into memory instead of reading it (default = true) */
+    public CBool use_mmap;
+
+    /** Hex mask of the CPUs for the threads of the CPU backend, e.g. "0xff" (default = null - default affinity) */
+    public String cpu_mask;
+
+    /** Place each thread on its own CPU of cpu_mask (default = false) */
+    public CBool cpu_strict;
+
+    /** Polling level of the idle threads, 0 - 100 (default = 50) */
+    public int cpu_poll;
+
     /** Use GPU for inference */
     public void useGpu(boolean enable) {
         use_gpu = enable ? CBool.TRUE : CBool.FALSE;
     }
 
+    /** Map the model file into memory */
+    public void useMmap(boolean enable) {
+        use_mmap = enable ? CBool.TRUE : CBool.FALSE;
+    }
+
     /** Use flash attention */
     public void useFlashAttn(boolean enable) {
         flash_attn = enable ? CBool.TRUE : CBool.FALSE;
@@ -70,7 +91,13 @@ public class WhisperContextParams extends Structure {
             "dtw_aheads_preset",
             "dtw_n_top",
             "dtw_aheads",
-            "dtw_mem_size"
+            "dtw_mem_size",
+            "type_kv_self",
+            "type_kv_cross",
+            "use_mmap",
+            "cpu_mask",
+            "cpu_strict",
+            "cpu_poll"
         );
     }
 
@@ -329,6 +329,33 @@ public class WhisperFullParams extends Structure {
     public long i_start_rule;
     public float grammar_penalty;
 
+    /** [EXPERIMENTAL] Speculative decoding with a draft model sharing the vocabulary of the main model. */
+    public Pointer draft_ctx;
+
+    /** Max number of draft tokens verified per decoder pass. (default = 8) */
+    public int n_draft;
+
+    /** [EXPERIMENTAL] Number of fallback temperatures decoded in parallel with the current one. (default = 0) */
+    public int n_fallback_parallel;
+
+    /** [EXPERIMENTAL] Size the audio context of each window from the remaining audio when audio_ctx is 0. (default = false) */
+    public CBool audio_ctx_auto;
+
+    /** [EXPERIMENTAL] Compute the log mel spectrogram per window, normalized per window. (default = false) */
+    public CBool mel_lazy;
+
+    /** [EXPERIMENTAL] Number of threads of the log mel spectrogram, 0 - tuned count or n_threads. (default = 0) */
+    public int n_threads_mel;
+
+    /** [EXPERIMENTAL] Number of threads of the encoder, 0 - tuned count or n_threads. (default = 0) */
+    public int n_threads_encode;
+
+    /** [EXPERIMENTAL] Number of threads of the decoder, 0 - tuned count or n_threads. (default = 0) */
+    public int n_threads_decode;
+
+    /** [EXPERIMENTAL] Number of threads of the sampling, 0 - tuned count or n_threads. (default = 0) */
+    public int n_threads_sample;
+
     @Override
     protected List<String> getFieldOrder() {
         return Arrays.asList("strategy", "n_threads", "n_max_text_ctx",
@@ -347,7 +374,9 @@ public class WhisperFullParams extends Structure {
                 "encoder_begin_callback", "encoder_begin_callback_user_data",
                 "abort_callback", "abort_callback_user_data",
                 "logits_filter_callback", "logits_filter_callback_user_data",
-                "grammar_rules", "n_grammar_rules", "i_start_rule", "grammar_penalty");
+                "grammar_rules", "n_grammar_rules", "i_start_rule", "grammar_penalty",
+                "draft_ctx", "n_draft", "n_fallback_parallel", "audio_ctx_auto", "mel_lazy",
+                "n_threads_mel", "n_threads_encode", "n_threads_decode", "n_threads_sample");
     }
 
     public static class ByValue extends WhisperFullParams implements Structure.ByValue {
@@ -37,6 +37,10 @@ static void replace_all(std::string & s, const std::string & search, const std::
 struct whisper_params {
     int32_t n_threads     = std::min(4, (int32_t) std::thread::hardware_concurrency());
     int32_t n_processors  = 1;
+    int32_t n_threads_mel    = 0;
+    int32_t n_threads_encode = 0;
+    int32_t n_threads_decode = 0;
+    int32_t n_threads_sample = 0;
     int32_t offset_t_ms   = 0;
     int32_t offset_n      = 0;
     int32_t duration_ms   = 0;
@@ -46,6 +50,8 @@ struct whisper_params {
     int32_t best_of       = whisper_full_default_params(WHISPER_SAMPLING_GREEDY).greedy.best_of;
     int32_t beam_size     = whisper_full_default_params(WHISPER_SAMPLING_BEAM_SEARCH).beam_search.beam_size;
     int32_t audio_ctx     = 0;
+    int32_t n_draft       = whisper_full_default_params(WHISPER_SAMPLING_GREEDY).n_draft;
+    int32_t n_fallback_parallel = 0;
 
     float word_thold      =  0.01f;
     float entropy_thold   =  2.40f;
@@ -61,6 +67,9 @@ struct whisper_params {
     bool diarize         = false;
     bool tinydiarize     = false;
     bool split_on_word   = false;
+    bool audio_ctx_auto  = false;
+    bool mel_lazy        = false;
+    bool tune_threads    = false;
     bool no_fallback     = false;
     bool output_txt      = false;
     bool output_vtt      = false;
@@ -78,12 +87,17 @@ struct whisper_params {
     bool log_score       = false;
     bool use_gpu         = true;
     bool flash_attn      = false;
+    bool use_mmap        = true;
+    bool cpu_strict      = false;
+    int32_t cpu_poll     = 50;
     bool suppress_nst    = false;
 
     std::string language  = "en";
     std::string prompt;
+    std::string cpu_mask;
     std::string font_path = "/System/Library/Fonts/Supplemental/Courier New Bold.ttf";
     std::string model     = "models/ggml-base.en.bin";
+    std::string model_draft;
     std::string grammar;
     std::string grammar_rule;
 
@@ -97,6 +111,9 @@ struct whisper_params {
 
     std::string dtw = "";
 
+    std::string kv_type_self  = "f16";
+    std::string kv_type_cross = "f16";
+
     std::vector<std::string> fname_inp = {};
     std::vector<std::string> fname_out = {};
 
@@ -113,6 +130,18 @@ static char * whisper_param_turn_lowercase(char * in){
     return in;
 }
 
+static ggml_type whisper_param_kv_type(const std::string & name) {
+    for (int t = 0; t < GGML_TYPE_COUNT; t++) {
+        const char * type_name = ggml_type_name((ggml_type) t);
+        if (type_name && name == type_name) {
+            return (ggml_type) t;
+        }
+    }
+
+    fprintf(stderr, "error: unknown KV cache type '%s'\n", name.c_str());
+    exit(0);
+}
+
 static char * requires_value_error(const std::string & arg) {
     fprintf(stderr, "error: argument %s requires value\n", arg.c_str());
     exit(0);
@@ -139,14 +168,22 @@ static bool whisper_params_parse(int argc, char ** argv, whisper_params & params
         #define ARGV_NEXT (((i + 1) < argc) ? argv[++i] : requires_value_error(arg))
         else if (arg == "-t"    || arg == "--threads")         { params.n_threads       = std::stoi(ARGV_NEXT); }
         else if (arg == "-p"    || arg == "--processors")      { params.n_processors    = std::stoi(ARGV_NEXT); }
+        else if (arg == "-tm"   || arg == "--threads-mel")     { params.n_threads_mel    = std::stoi(ARGV_NEXT); }
+        else if (arg == "-te"   || arg == "--threads-encode")  { params.n_threads_encode = std::stoi(ARGV_NEXT); }
+        else if (arg == "-td"   || arg == "--threads-decode")  { params.n_threads_decode = std::stoi(ARGV_NEXT); }
+        else if (arg == "-ts"   || arg == "--threads-sample")  { params.n_threads_sample = std::stoi(ARGV_NEXT); }
+        else if (arg == "-tt"   || arg == "--tune-threads")    { params.tune_threads     = true; }
         else if (arg == "-ot"   || arg == "--offset-t")        { params.offset_t_ms     = std::stoi(ARGV_NEXT); }
         else if (arg == "-on"   || arg == "--offset-n")        { params.offset_n        = std::stoi(ARGV_NEXT); }
         else if (arg == "-d"    || arg == "--duration")        { params.duration_ms     = std::stoi(ARGV_NEXT); }
         else if (arg == "-mc"   || arg == "--max-context")     { params.max_context     = std::stoi(ARGV_NEXT); }
         else if (arg == "-ml"   || arg == "--max-len")         { params.max_len         = std::stoi(ARGV_NEXT); }
         else if (arg == "-bo"   || arg == "--best-of")         { params.best_of         = std::stoi(ARGV_NEXT); }
+        else if (arg == "-fbp"  || arg == "--fallback-parallel") { params.n_fallback_parallel = std::stoi(ARGV_NEXT); }
         else if (arg == "-bs"   || arg == "--beam-size")       { params.beam_size       = std::stoi(ARGV_NEXT); }
         else if (arg == "-ac"   || arg == "--audio-ctx")       { params.audio_ctx       = std::stoi(ARGV_NEXT); }
+        else if (arg == "-aca"  || arg == "--audio-ctx-auto")  { params.audio_ctx_auto  = true; }
+        else if (arg == "-mlz"  || arg == "--mel-lazy")        { params.mel_lazy        = true; }
         else if (arg == "-wt"   || arg == "--word-thold")      { params.word_thold      = std::stof(ARGV_NEXT); }
         else if (arg == "-et"   || arg == "--entropy-thold")   { params.entropy_thold   = std::stof(ARGV_NEXT); }
         else if (arg == "-lpt"  || arg == "--logprob-thold")   { params.logprob_thold   = std::stof(ARGV_NEXT); }
@@ -178,12 +215,20 @@ static bool whisper_params_parse(int argc, char ** argv, whisper_params & params
         else if (arg == "-dl"   || arg == "--detect-language") { params.detect_language = true; }
         else if (                  arg == "--prompt")          { params.prompt          = ARGV_NEXT; }
         else if (arg == "-m"    || arg == "--model")           { params.model           = ARGV_NEXT; }
+        else if (arg == "-md"   || arg == "--model-draft")     { params.model_draft     = ARGV_NEXT; }
+        else if (                  arg == "--draft")           { params.n_draft         = std::stoi(ARGV_NEXT); }
         else if (arg == "-f"    || arg == "--file")            { params.fname_inp.emplace_back(ARGV_NEXT); }
         else if (arg == "-oved" || arg == "--ov-e-device")     { params.openvino_encode_device = ARGV_NEXT; }
         else if (arg == "-dtw"  || arg == "--dtw")             { params.dtw             = ARGV_NEXT; }
         else if (arg == "-ls"   || arg == "--log-score")       { params.log_score       = true; }
         else if (arg == "-ng"   || arg == "--no-gpu")          { params.use_gpu         = false; }
         else if (arg == "-fa"   || arg == "--flash-attn")      { params.flash_attn      = true; }
+        else if (arg == "-nmm"  || arg == "--no-mmap")         { params.use_mmap        = false; }
+        else if (arg == "-C"    || arg == "--cpu-mask")        { params.cpu_mask        = ARGV_NEXT; }
+        else if (                  arg == "--cpu-strict")      { params.cpu_strict      = true; }
+        else if (                  arg == "--poll")            { params.cpu_poll        = std::stoi(ARGV_NEXT); }
+        else if (arg == "-kvs"  || arg == "--kv-self")         { params.kv_type_self    = ARGV_NEXT; }
+        else if (arg == "-kvc"  || arg == "--kv-cross")        { params.kv_type_cross   = ARGV_NEXT; }
         else if (arg == "-sns"  || arg == "--suppress-nst")    { params.suppress_nst    = true; }
         else if (                  arg == "--suppress-regex")  { params.suppress_regex  = ARGV_NEXT; }
         else if (                  arg == "--grammar")         { params.grammar         = ARGV_NEXT; }
@@ -208,6 +253,11 @@ static void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params
     fprintf(stderr, "  -h,        --help              [default] show this help message and exit\n");
     fprintf(stderr, "  -t N,      --threads N         [%-7d] number of threads to use during computation\n",    params.n_threads);
     fprintf(stderr, "  -p N,      --processors N      [%-7d] number of processors to use during computation\n", params.n_processors);
+    fprintf(stderr, "  -tm N,     --threads-mel N     [%-7d] number of threads of the log mel spectrogram (0 - tuned or -t)\n", params.n_threads_mel);
+    fprintf(stderr, "  -te N,     --threads-encode N  [%-7d] number of threads of the encoder (0 - tuned or -t)\n", params.n_threads_encode);
+    fprintf(stderr, "  -td N,     --threads-decode N  [%-7d] number of threads of the decoder (0 - tuned or -t)\n", params.n_threads_decode);
+    fprintf(stderr, "  -ts N,     --threads-sample N  [%-7d] number of threads of the sampling (0 - tuned or -t)\n", params.n_threads_sample);
+    fprintf(stderr, "  -tt,       --tune-threads      [%-7s] measure the best number of threads of each phase, up to -t\n", params.tune_threads ? "true" : "false");
     fprintf(stderr, "  -ot N,     --offset-t N        [%-7d] time offset in milliseconds\n",                    params.offset_t_ms);
     fprintf(stderr, "  -on N,     --offset-n N        [%-7d] segment index offset\n",                           params.offset_n);
     fprintf(stderr, "  -d  N,     --duration N        [%-7d] duration of audio to process in milliseconds\n",   params.duration_ms);
@@ -215,8 +265,11 @@ static void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params
     fprintf(stderr, "  -ml N,     --max-len N         [%-7d] maximum segment length in characters\n",           params.max_len);
     fprintf(stderr, "  -sow,      --split-on-word     [%-7s] split on word rather than on token\n",             params.split_on_word ? "true" : "false");
     fprintf(stderr, "  -bo N,     --best-of N         [%-7d] number of best candidates to keep\n",              params.best_of);
+    fprintf(stderr, "  -fbp N,    --fallback-parallel [%-7d] number of fallback temperatures to decode in parallel\n", params.n_fallback_parallel);
     fprintf(stderr, "  -bs N,     --beam-size N       [%-7d] beam size for beam search\n",                      params.beam_size);
     fprintf(stderr, "  -ac N,     --audio-ctx N       [%-7d] audio context size (0 - all)\n",                   params.audio_ctx);
+    fprintf(stderr, "  -aca,      --audio-ctx-auto    [%-7s] size the audio context from the remaining audio\n", params.audio_ctx_auto ? "true" : "false");
+    fprintf(stderr, "  -mlz,      --mel-lazy          [%-7s] compute the log mel spectrogram per window\n",      params.mel_lazy ? "true" : "false");
     fprintf(stderr, "  -wt N,     --word-thold N      [%-7.2f] word timestamp probability threshold\n",         params.word_thold);
     fprintf(stderr, "  -et N,     --entropy-thold N   [%-7.2f] entropy threshold for decoder fail\n",           params.entropy_thold);
     fprintf(stderr, "  -lpt N,    --logprob-thold N   [%-7.2f] log probability threshold for decoder fail\n",   params.logprob_thold);
@@ -247,12 +300,20 @@ static void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params
     fprintf(stderr, "  -dl,       --detect-language   [%-7s] exit after automatically detecting language\n",    params.detect_language ? "true" : "false");
     fprintf(stderr, "             --prompt PROMPT     [%-7s] initial prompt (max n_text_ctx/2 tokens)\n",       params.prompt.c_str());
     fprintf(stderr, "  -m FNAME,  --model FNAME       [%-7s] model path\n",                                     params.model.c_str());
+    fprintf(stderr, "  -md FNAME, --model-draft FNAME [%-7s] draft model path for speculative decoding\n",       params.model_draft.c_str());
+    fprintf(stderr, "             --draft N           [%-7d] number of tokens to draft for speculative decoding\n", params.n_draft);
     fprintf(stderr, "  -f FNAME,  --file FNAME        [%-7s] input audio file path\n",                            "");
     fprintf(stderr, "  -oved D,   --ov-e-device DNAME [%-7s] the OpenVINO device used for encode inference\n",  params.openvino_encode_device.c_str());
     fprintf(stderr, "  -dtw MODEL --dtw MODEL         [%-7s] compute token-level timestamps\n",                 params.dtw.c_str());
     fprintf(stderr, "  -ls,       --log-score         [%-7s] log best decoder scores of tokens\n",              params.log_score?"true":"false");
     fprintf(stderr, "  -ng,       --no-gpu            [%-7s] disable GPU\n",                                    params.use_gpu ? "false" : "true");
     fprintf(stderr, "  -fa,       --flash-attn        [%-7s] flash attention\n",                                params.flash_attn ? "true" : "false");
+    fprintf(stderr, "  -nmm,      --no-mmap           [%-7s] read the model instead of mapping it into memory\n", params.use_mmap ? "false" : "true");
+    fprintf(stderr, "  -C M,      --cpu-mask M        [%-7s] hex mask of the CPUs for the threads, e.g. 0xff\n",   params.cpu_mask.c_str());
+    fprintf(stderr, "             --cpu-strict        [%-7s] place each thread on its own CPU of the mask\n",     params.cpu_strict ? "true" : "false");
+    fprintf(stderr, "             --poll N            [%-7d] polling level of the idle threads (0 - 100)\n",     params.cpu_poll);
+    fprintf(stderr, "  -kvs T,    --kv-self T         [%-7s] self-attention KV cache type (f16, f32, q8_0, q4_0, ...)\n", params.kv_type_self.c_str());
+    fprintf(stderr, "  -kvc T,    --kv-cross T        [%-7s] cross-attention KV cache type (f16, f32, q8_0, q4_0, ...)\n", params.kv_type_cross.c_str());
     fprintf(stderr, "  -sns,      --suppress-nst      [%-7s] suppress non-speech tokens\n",                     params.suppress_nst ? "true" : "false");
     fprintf(stderr, "  --suppress-regex REGEX         [%-7s] regular expression matching tokens to suppress\n", params.suppress_regex.c_str());
     fprintf(stderr, "  --grammar GRAMMAR              [%-7s] GBNF grammar to guide decoding\n",                 params.grammar.c_str());
@@ -1008,6 +1069,14 @@ int main(int argc, char ** argv) {
 
     cparams.use_gpu    = params.use_gpu;
     cparams.flash_attn = params.flash_attn;
+    cparams.use_mmap   = params.use_mmap;
+
+    cparams.cpu_mask   = params.cpu_mask.empty() ? nullptr : params.cpu_mask.c_str();
+    cparams.cpu_strict = params.cpu_strict;
+    cparams.cpu_poll   = params.cpu_poll;
+
+    cparams.type_kv_self  = whisper_param_kv_type(params.kv_type_self);
+    cparams.type_kv_cross = whisper_param_kv_type(params.kv_type_cross);
 
     if (!params.dtw.empty()) {
         cparams.dtw_token_timestamps = true;
@@ -1039,6 +1108,30 @@ int main(int argc, char ** argv) {
         return 3;
     }
 
+    struct whisper_context * ctx_draft = nullptr;
+
+    if (!params.model_draft.empty()) {
+        ctx_draft = whisper_init_from_file_with_params(params.model_draft.c_str(), cparams);
+
+        if (ctx_draft == nullptr) {
+            fprintf(stderr, "error: failed to initialize the draft whisper context\n");
+            return 3;
+        }
+    }
+
+    if (params.tune_threads) {
+        if (whisper_tune_threads(ctx, params.n_threads) != 0) {
+            fprintf(stderr, "error: failed to tune the number of threads\n");
+            return 3;
+        }
+
+        // the flags that give the same counts without measuring them again
+        int n_mel, n_encode, n_decode, n_sample;
+        whisper_get_tuned_threads(ctx, &n_mel, &n_encode, &n_decode, &n_sample);
+
+        fprintf(stderr, "%s: tuned threads: -tm %d -te %d -td %d -ts %d\n", __func__, n_mel, n_encode, n_decode, n_sample);
+    }
+
     // initialize openvino encoder. this has no effect on whisper.cpp builds that don't have OpenVINO configured
     whisper_ctx_init_openvino_encoder(ctx, nullptr, params.openvino_encode_device.c_str(), nullptr);
 
@@ -1131,6 +1224,13 @@ int main(int argc, char ** argv) {
             wparams.max_len          = params.output_wts && params.max_len == 0 ? 60 : params.max_len;
             wparams.split_on_word    = params.split_on_word;
             wparams.audio_ctx        = params.audio_ctx;
+            wparams.audio_ctx_auto   = params.audio_ctx_auto;
+            wparams.mel_lazy         = params.mel_lazy;
+
+            wparams.n_threads_mel    = params.n_threads_mel;
+            wparams.n_threads_encode = params.n_threads_encode;
+            wparams.n_threads_decode = params.n_threads_decode;
+            wparams.n_threads_sample = params.n_threads_sample;
 
             wparams.debug_mode       = params.debug_mode;
 
@@ -1141,6 +1241,7 @@ int main(int argc, char ** argv) {
             wparams.initial_prompt   = params.prompt.c_str();
 
             wparams.greedy.best_of        = params.best_of;
+            wparams.n_fallback_parallel   = params.n_fallback_parallel;
             wparams.beam_search.beam_size = params.beam_size;
 
             wparams.temperature_inc  = params.no_fallback ? 0.0f : params.temperature_inc;
@@ -1170,6 +1271,9 @@ int main(int argc, char ** argv) {
                 }
             }
 
+            wparams.draft_ctx = ctx_draft;
+            wparams.n_draft   = params.n_draft;
+
             // this callback is called on each new segment
             if (!wparams.print_realtime) {
                 wparams.new_segment_callback           = whisper_print_segment_callback;
@@ -1270,6 +1374,7 @@ int main(int argc, char ** argv) {
         whisper_print_timings(ctx);
     }
     whisper_free(ctx);
+    whisper_free(ctx_draft);
 
     return 0;
 }
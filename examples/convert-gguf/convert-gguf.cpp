@@ -0,0 +1,17 @@
+#include "whisper.h"
+
+#include <cstdio>
+
+int main(int argc, char ** argv) {
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s model.bin model.gguf\n", argv[0]);
+        return 1;
+    }
+
+    if (whisper_model_convert_gguf(argv[1], argv[2]) != 0) {
+        fprintf(stderr, "%s: failed to convert '%s'\n", __func__, argv[1]);
+        return 1;
+    }
+
+    return 0;
+}
@@ -37,6 +37,7 @@ struct whisper_params {
     bool save_audio    = false; // save audio to wav file
     bool use_gpu       = true;
     bool flash_attn    = false;
+    bool mel_stream    = false; // compute the mel spectrogram incrementally
 
     std::string language  = "en";
     std::string model     = "models/ggml-base.en.bin";
@@ -74,6 +75,7 @@ static bool whisper_params_parse(int argc, char ** argv, whisper_params & params
         else if (arg == "-sa"   || arg == "--save-audio")    { params.save_audio    = true; }
         else if (arg == "-ng"   || arg == "--no-gpu")        { params.use_gpu       = false; }
         else if (arg == "-fa"   || arg == "--flash-attn")    { params.flash_attn    = true; }
+        else if (arg == "-ms"   || arg == "--mel-stream")    { params.mel_stream    = true; }
 
         else {
             fprintf(stderr, "error: unknown argument: %s\n", arg.c_str());
@@ -112,6 +114,7 @@ void whisper_print_usage(int /*argc*/, char ** argv, const whisper_params & para
     fprintf(stderr, "  -sa,      --save-audio    [%-7s] save the recorded audio to a file\n",              params.save_audio ? "true" : "false");
     fprintf(stderr, "  -ng,      --no-gpu        [%-7s] disable GPU inference\n",                          params.use_gpu ? "false" : "true");
     fprintf(stderr, "  -fa,      --flash-attn    [%-7s] flash attention during inference\n",               params.flash_attn ? "true" : "false");
+    fprintf(stderr, "  -ms,      --mel-stream    [%-7s] compute the mel spectrogram of the new audio only\n", params.mel_stream ? "true" : "false");
     fprintf(stderr, "\n");
 }
 
@@ -254,6 +257,9 @@ int main(int argc, char ** argv) {
                 if ((int) pcmf32_new.size() > 2*n_samples_step) {
                     fprintf(stderr, "\n\n%s: WARNING: cannot process audio fast enough, dropping audio ...\n\n", __func__);
                     audio.clear();
+                    if (params.mel_stream) {
+                        whisper_pcm_to_mel_stream_reset(ctx);
+                    }
                     continue;
                 }
 
@@ -281,6 +287,11 @@ int main(int argc, char ** argv) {
             memcpy(pcmf32.data() + n_samples_take, pcmf32_new.data(), n_samples_new*sizeof(float));
 
             pcmf32_old = pcmf32;
+
+            // the mel window of the stream covers the same audio as pcmf32
+            if (params.mel_stream) {
+                whisper_pcm_to_mel_stream(ctx, pcmf32_new.data(), n_samples_new, (int) ((1000LL*pcmf32.size())/WHISPER_SAMPLE_RATE), params.n_threads);
+            }
         } else {
             const auto t_now  = std::chrono::high_resolution_clock::now();
             const auto t_diff = std::chrono::duration_cast<std::chrono::milliseconds>(t_now - t_last).count();
@@ -330,7 +341,10 @@ int main(int argc, char ** argv) {
             wparams.prompt_tokens    = params.no_context ? nullptr : prompt_tokens.data();
             wparams.prompt_n_tokens  = params.no_context ? 0       : prompt_tokens.size();
 
-            if (whisper_full(ctx, wparams, pcmf32.data(), pcmf32.size()) != 0) {
+            // with the mel stream, the spectrogram has already been computed
+            const bool use_mel = !use_vad && params.mel_stream;
+
+            if (whisper_full(ctx, wparams, use_mel ? nullptr : pcmf32.data(), use_mel ? 0 : pcmf32.size()) != 0) {
                 fprintf(stderr, "%s: failed to process audio\n", argv[0]);
                 return 6;
             }
@@ -79,6 +79,8 @@ extern "C" {
 
     struct whisper_context;
     struct whisper_state;
+    struct whisper_state_pool;
+    struct whisper_decode_sched;
     struct whisper_full_params;
 
     typedef int32_t whisper_pos;
@@ -126,6 +128,22 @@ extern "C" {
         struct whisper_aheads dtw_aheads;
 
         size_t dtw_mem_size; // TODO: remove
+
+        // type of the self-attention and cross-attention KV caches (F32, F16, Q8_0, Q5_0, Q5_1, Q4_0, Q4_1)
+        // without flash_attn only the K cache is quantized, since V is stored transposed. F32 requires flash_attn off
+        enum ggml_type type_kv_self;
+        enum ggml_type type_kv_cross;
+
+        // map the model file into memory instead of reading it (only for whisper_init_from_file_with_params*)
+        // the CPU weights point directly into the read-only mapping, so that the processes that load the same
+        // file share its pages. the tensors that are not suitably aligned in the file are still copied
+        bool use_mmap;
+
+        // [EXPERIMENTAL] the threads of the CPU backend are kept by each state and wait for the next graph, instead of
+        // being started for each graph
+        const char * cpu_mask;   // hex mask of the CPUs to run the threads on, e.g. "0xff" (NULL - default affinity)
+        bool         cpu_strict; // place each thread on its own CPU of cpu_mask
+        int          cpu_poll;   // how long the idle threads poll for the next graph (0 - no polling, 100 - aggressive polling)
     };
 
     typedef struct whisper_token_data {
@@ -227,6 +245,12 @@ extern "C" {
         "use whisper_init_with_params_no_state instead"
     );
 
+    // [EXPERIMENTAL] convert a model in the legacy ggml format (see models/convert-pt-to-ggml.py) to GGUF
+    // the hparams, the mel filters and the vocab are stored as metadata and the tensor data is aligned, so that
+    // whisper_init_from_file_with_params() can map all the CPU weights. the GGUF models are loaded from a file only
+    // returns 0 on success
+    WHISPER_API int whisper_model_convert_gguf(const char * fname_inp, const char * fname_out);
+
     WHISPER_API struct whisper_state * whisper_init_state(struct whisper_context * ctx);
 
     // Given a context, enable use of OpenVINO for encode inference.
@@ -259,6 +283,23 @@ extern "C" {
     WHISPER_API void whisper_free_params(struct whisper_full_params * params);
     WHISPER_API void whisper_free_context_params(struct whisper_context_params * params);
 
+    // [EXPERIMENTAL] Reset a state for a new transcription without freeing its memory.
+    // The results, the prompt, the spectrogram, the timings and the cached encoder/decoder outputs are discarded,
+    // while the backends, the KV caches and the compute buffers are kept for reuse.
+    WHISPER_API void whisper_reset_state(struct whisper_context * ctx, struct whisper_state * state);
+
+    // [EXPERIMENTAL] Pool of states of a context, to avoid the cost of whisper_init_state() for each request.
+    // whisper_state_pool_init() creates the pool with n_states states ready for use.
+    // whisper_state_pool_acquire() returns an idle state, or initializes a new one when all of them are in use.
+    // Returns NULL if a new state cannot be initialized.
+    // whisper_state_pool_release() resets the state with whisper_reset_state() and returns it to the pool.
+    // The acquire and release functions are thread-safe. All states must be released before freeing the pool.
+    WHISPER_API struct whisper_state_pool * whisper_state_pool_init(struct whisper_context * ctx, int n_states);
+    WHISPER_API void                        whisper_state_pool_free(struct whisper_state_pool * pool);
+
+    WHISPER_API struct whisper_state * whisper_state_pool_acquire(struct whisper_state_pool * pool);
+    WHISPER_API void                   whisper_state_pool_release(struct whisper_state_pool * pool, struct whisper_state * state);
+
     // Convert RAW PCM audio to log mel spectrogram.
     // The resulting spectrogram is stored inside the default state of the provided whisper context.
     // Returns 0 on success
@@ -275,6 +316,32 @@ extern "C" {
                                int   n_samples,
                                int   n_threads);
 
+    // [EXPERIMENTAL] Incremental log mel spectrogram for live audio.
+    // Appends n_samples of new PCM audio to the stream of the state and computes only the mel frames that it completes.
+    // The spectrogram of the state becomes a rolling window with the last n_window_ms of the stream (0 - 30 s), which
+    // can be transcribed with whisper_full_with_state(ctx, state, params, NULL, 0).
+    // The window is normalized as a whole, like the output of whisper_pcm_to_mel() (clamped to max - 8 dB).
+    // Calling whisper_pcm_to_mel() or whisper_set_mel() ends the stream.
+    // Returns 0 on success
+    WHISPER_API int whisper_pcm_to_mel_stream(
+            struct whisper_context * ctx,
+                       const float * samples,
+                               int   n_samples,
+                               int   n_window_ms,
+                               int   n_threads);
+
+    WHISPER_API int whisper_pcm_to_mel_stream_with_state(
+            struct whisper_context * ctx,
+              struct whisper_state * state,
+                       const float * samples,
+                               int   n_samples,
+                               int   n_window_ms,
+                               int   n_threads);
+
+    // [EXPERIMENTAL] Start a new stream for whisper_pcm_to_mel_stream() and clear the spectrogram of the state.
+    WHISPER_API void whisper_pcm_to_mel_stream_reset(struct whisper_context * ctx);
+    WHISPER_API void whisper_pcm_to_mel_stream_reset_with_state(struct whisper_context * ctx, struct whisper_state * state);
+
     // This can be used to set a custom log mel spectrogram inside the default state of the provided whisper context.
     // Use this instead of whisper_pcm_to_mel() if you want to provide your own log mel spectrogram.
     // n_mel must be 80
@@ -307,6 +374,18 @@ extern "C" {
                                int   offset,
                                int   n_threads);
 
+    // Run the Whisper encoder on the log mel spectrograms of multiple states in a single batched evaluation.
+    // The result for each state is the same as calling whisper_encode_with_state() on it.
+    // offsets can be NULL (all windows start at frame 0) or point to n_states offsets, one per state.
+    // All states must use the same audio context. The compute buffers of states[0] are used for the batch.
+    // Returns 0 on success
+    WHISPER_API int whisper_encode_batch(
+            struct whisper_context * ctx,
+             struct whisper_state ** states,
+                               int   n_states,
+                         const int * offsets,
+                               int   n_threads);
+
     // Run the Whisper decoder to obtain the logits and probabilities for the next token.
     // Make sure to call whisper_encode() first.
     // tokens + n_tokens is the provided context for the decoder.
@@ -328,6 +407,43 @@ extern "C" {
                                int   n_past,
                                int   n_threads);
 
+    // Continuous batching of the decoder across states
+    //
+    // The scheduler merges the next decoding step of multiple independent states (e.g. different requests) into
+    // a single evaluation of the decoder, so that the model weights are read once per step for all of them.
+    // Each state keeps its own self- and cross-attention KV caches - encode it as usual before queuing tokens.
+    // States can be added and removed between steps as requests arrive and finish.
+    // The scheduler is not thread-safe and the states must not be used by other calls during a step.
+    WHISPER_API struct whisper_decode_sched * whisper_decode_sched_init(
+            struct whisper_context * ctx,
+                               int   n_states_max);
+
+    WHISPER_API void whisper_decode_sched_free(struct whisper_decode_sched * dsched);
+
+    // Admit or retire a state
+    // Returns 0 on success
+    WHISPER_API int whisper_decode_sched_add   (struct whisper_decode_sched * dsched, struct whisper_state * state);
+    WHISPER_API int whisper_decode_sched_remove(struct whisper_decode_sched * dsched, struct whisper_state * state);
+
+    // Queue tokens of an admitted state for the next step - same arguments as whisper_decode_with_state()
+    // Returns 0 on success
+    WHISPER_API int whisper_decode_sched_push(
+       struct whisper_decode_sched * dsched,
+              struct whisper_state * state,
+               const whisper_token * tokens,
+                               int   n_tokens,
+                               int   n_past);
+
+    // Evaluate the queued tokens of all states in a single pass of the decoder
+    // The logits of the last queued token of each state are stored in the last row of whisper_get_logits_from_state()
+    // States without queued tokens are skipped
+    // Returns 0 on success
+    WHISPER_API int whisper_decode_sched_step(
+       struct whisper_decode_sched * dsched,
+                               int   n_threads);
+
+    WHISPER_API int whisper_decode_sched_n_states(struct whisper_decode_sched * dsched);
+
     // Convert the provided text into tokens.
     // The tokens pointer must be large enough to hold the resulting tokens.
     // Returns the number of tokens on success, no more than n_max_tokens
@@ -507,6 +623,7 @@ extern "C" {
         bool tdrz_enable;       // enable tinydiarize speaker turn detection
 
         // A regular expression that matches tokens to suppress
+        // it is matched against the vocab once per context, an invalid expression makes whisper_full() fail
         const char * suppress_regex;
 
         // tokens to provide to the whisper decoder as initial prompt
@@ -570,6 +687,40 @@ extern "C" {
         size_t                           n_grammar_rules;
         size_t                           i_start_rule;
         float                            grammar_penalty;
+
+        // [EXPERIMENTAL] speculative decoding
+        // the draft model (e.g. tiny) proposes up to n_draft tokens, which are verified by the main model in a single pass
+        // the result is the same as without a draft, up to the floating-point differences of batched evaluation
+        // the draft model must share the vocabulary of the main model
+        // only used by the greedy decoder when there is a single decoder (i.e. temperature 0.0)
+        struct whisper_context * draft_ctx;
+        int                      n_draft;
+
+        // [EXPERIMENTAL] parallel temperature fallback
+        // decode up to n_fallback_parallel of the next fallback temperatures together with the current one, as extra
+        // decoders in the same batch, and keep the first result that passes the thresholds (0 - sequential fallback)
+        // only used by the greedy decoder, limited by the max number of decoders and to temperatures with the same prompt
+        int n_fallback_parallel;
+
+        // [EXPERIMENTAL] automatic audio context
+        // when audio_ctx is 0, size the encoder context of each window from the remaining audio, rounded up to a
+        // multiple of 256 frames (i.e. 5.12 s). the encoder compute buffer of each size is allocated on first use
+        // saves most of the encoder time for short clips, at the cost of a small change in the transcription
+        bool audio_ctx_auto;
+
+        // [EXPERIMENTAL] lazy log mel spectrogram
+        // compute the log mel spectrogram of each window when it is encoded, and the next window in a background thread,
+        // instead of the whole audio before the first window. the memory is bounded to ~2 windows for any audio length
+        // compatibility: the clamp to (max - 8) uses the max of each window instead of the max of the whole audio, so
+        // the result can differ from the default for audio longer than 30 s. false keeps the reference behavior
+        bool mel_lazy;
+
+        // [EXPERIMENTAL] number of threads of each phase: log mel spectrogram, encoder, decoder and sampling
+        // 0 uses the count measured by whisper_tune_threads() up to n_threads, or n_threads if the context is not tuned
+        int n_threads_mel;
+        int n_threads_encode;
+        int n_threads_decode;
+        int n_threads_sample;
     };
 
     // NOTE: this function allocates memory, and it is the responsibility of the caller to free the pointer - see whisper_free_context_params & whisper_free_params()
@@ -661,6 +812,19 @@ extern "C" {
     WHISPER_API int          whisper_bench_ggml_mul_mat    (int n_threads);
     WHISPER_API const char * whisper_bench_ggml_mul_mat_str(int n_threads);
 
+    // [EXPERIMENTAL] measure the phases of whisper_full() on the loaded model with 1 .. n_threads_max threads and store
+    // the fastest count of each phase in the context (see whisper_full_params.n_threads_mel, etc.)
+    // a count is only increased when it saves more than 2% of the time of the phase
+    // do not call it while the context is used by whisper_full()
+    // returns 0 on success
+    WHISPER_API int whisper_tune_threads(struct whisper_context * ctx, int n_threads_max);
+
+    // [EXPERIMENTAL] the thread counts of the phases stored in the context, 0 - not tuned
+    // the counts measured by whisper_tune_threads() depend on the model and the host. they can be saved with
+    // whisper_get_tuned_threads() and restored with whisper_set_tuned_threads() to avoid measuring them again
+    WHISPER_API void whisper_get_tuned_threads(struct whisper_context * ctx, int * n_mel, int * n_encode, int * n_decode, int * n_sample);
+    WHISPER_API void whisper_set_tuned_threads(struct whisper_context * ctx, int   n_mel, int   n_encode, int   n_decode, int   n_sample);
+
     // Control logging output; default behavior is to print to stderr
 
     WHISPER_API void whisper_log_set(ggml_log_callback log_callback, void * user_data);
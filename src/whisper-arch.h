@@ -139,3 +139,46 @@ static const std::map<asr_tensor, ggml_op> ASR_TENSOR_INFO = {
     {ASR_TENSOR_ATTN_OUT_WEIGHT,       GGML_OP_MUL_MAT},
     {ASR_TENSOR_ATTN_OUT_BIAS,         GGML_OP_ADD},
 };
+
+// GGUF metadata of the whisper models (see whisper_model_convert_gguf)
+enum asr_kv {
+    ASR_KV_GENERAL_ARCHITECTURE,
+    ASR_KV_N_VOCAB,
+    ASR_KV_N_AUDIO_CTX,
+    ASR_KV_N_AUDIO_STATE,
+    ASR_KV_N_AUDIO_HEAD,
+    ASR_KV_N_AUDIO_LAYER,
+    ASR_KV_N_TEXT_CTX,
+    ASR_KV_N_TEXT_STATE,
+    ASR_KV_N_TEXT_HEAD,
+    ASR_KV_N_TEXT_LAYER,
+    ASR_KV_N_MELS,
+    ASR_KV_FTYPE,
+    ASR_KV_MEL_FILTERS_N_MEL,
+    ASR_KV_MEL_FILTERS_N_FFT,
+    ASR_KV_MEL_FILTERS_DATA,
+    ASR_KV_VOCAB_LEN,
+    ASR_KV_VOCAB_DATA,
+};
+
+// the tokens are raw bytes, which can contain '\0', so the vocab is stored as the token lengths (u32) and their
+// concatenated bytes (u8) instead of an array of strings
+static const std::map<asr_kv, const char *> ASR_KV_NAMES = {
+    {ASR_KV_GENERAL_ARCHITECTURE, "general.architecture"},
+    {ASR_KV_N_VOCAB,              "whisper.n_vocab"},
+    {ASR_KV_N_AUDIO_CTX,          "whisper.n_audio_ctx"},
+    {ASR_KV_N_AUDIO_STATE,        "whisper.n_audio_state"},
+    {ASR_KV_N_AUDIO_HEAD,         "whisper.n_audio_head"},
+    {ASR_KV_N_AUDIO_LAYER,        "whisper.n_audio_layer"},
+    {ASR_KV_N_TEXT_CTX,           "whisper.n_text_ctx"},
+    {ASR_KV_N_TEXT_STATE,         "whisper.n_text_state"},
+    {ASR_KV_N_TEXT_HEAD,          "whisper.n_text_head"},
+    {ASR_KV_N_TEXT_LAYER,         "whisper.n_text_layer"},
+    {ASR_KV_N_MELS,               "whisper.n_mels"},
+    {ASR_KV_FTYPE,                "whisper.ftype"},
+    {ASR_KV_MEL_FILTERS_N_MEL,    "whisper.mel_filters.n_mel"},
+    {ASR_KV_MEL_FILTERS_N_FFT,    "whisper.mel_filters.n_fft"},
+    {ASR_KV_MEL_FILTERS_DATA,     "whisper.mel_filters.data"},
+    {ASR_KV_VOCAB_LEN,            "whisper.vocab.len"},
+    {ASR_KV_VOCAB_DATA,           "whisper.vocab.data"},
+};
@@ -0,0 +1,244 @@
+#pragma once
+
+#include "ggml.h"
+
+#include <cmath>
+#include <utility>
+#include <vector>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+// real-input FFT of size WHISPER_N_FFT (400) for the log mel spectrogram
+//
+// the N real samples are packed into N/2 complex values z[n] = x[2n] + i*x[2n + 1], which are transformed with a
+// mixed-radix Stockham FFT (N/2 = 200 = 4*2*5*5). a final split step recovers the N/2 + 1 bins of the real
+// transform. the data is kept in separate re/im arrays and all twiddles are precomputed, so that the inner
+// loops are free of trigonometry and vectorize
+#define WHISPER_RFFT_N 400
+#define WHISPER_RFFT_M (WHISPER_RFFT_N/2)
+
+struct whisper_rfft_stage {
+    int radix;
+    int m; // length of the sub-transforms after this stage (n/radix)
+    int s; // stride
+
+    // W_n^(j*p) for p in [0, m) and j in [1, radix)
+    std::vector<float> w_re;
+    std::vector<float> w_im;
+};
+
+struct whisper_rfft_plan {
+    std::vector<whisper_rfft_stage> stages;
+
+    // W_N^k for the split step, k in [0, N/2]
+    std::vector<float> w_re;
+    std::vector<float> w_im;
+
+    whisper_rfft_plan() {
+        const int radices[] = { 4, 2, 5, 5 };
+
+        int n = WHISPER_RFFT_M;
+        int s = 1;
+
+        for (int radix : radices) {
+            whisper_rfft_stage stage;
+
+            stage.radix = radix;
+            stage.m     = n/radix;
+            stage.s     = s;
+
+            for (int p = 0; p < stage.m; ++p) {
+                for (int j = 1; j < radix; ++j) {
+                    const double theta = -2.0*M_PI*j*p/n;
+                    stage.w_re.push_back(cos(theta));
+                    stage.w_im.push_back(sin(theta));
+                }
+            }
+
+            stages.push_back(std::move(stage));
+
+            n /= radix;
+            s *= radix;
+        }
+
+        GGML_ASSERT(n == 1);
+
+        for (int k = 0; k <= WHISPER_RFFT_M; ++k) {
+            const double theta = -2.0*M_PI*k/WHISPER_RFFT_N;
+            w_re.push_back(cos(theta));
+            w_im.push_back(sin(theta));
+        }
+    }
+};
+
+// one pass of the Stockham FFT: x -> y
+// y[q + s*(radix*p + j)] = W_n^(j*p) * sum_k x[q + s*(p + k*m)] * W_radix^(j*k)
+static void whisper_rfft_stage_run(const whisper_rfft_stage & st, const float * xr, const float * xi, float * yr, float * yi) {
+    const int m = st.m;
+    const int s = st.s;
+
+    switch (st.radix) {
+        case 2:
+            {
+                for (int p = 0; p < m; ++p) {
+                    const float w1r = st.w_re[p], w1i = st.w_im[p];
+
+                    const float * x0r = xr + s*(p + 0*m); const float * x0i = xi + s*(p + 0*m);
+                    const float * x1r = xr + s*(p + 1*m); const float * x1i = xi + s*(p + 1*m);
+
+                    float * y0r = yr + s*(2*p + 0); float * y0i = yi + s*(2*p + 0);
+                    float * y1r = yr + s*(2*p + 1); float * y1i = yi + s*(2*p + 1);
+
+                    for (int q = 0; q < s; ++q) {
+                        const float b1r = x0r[q] - x1r[q];
+                        const float b1i = x0i[q] - x1i[q];
+
+                        y0r[q] = x0r[q] + x1r[q];
+                        y0i[q] = x0i[q] + x1i[q];
+                        y1r[q] = b1r*w1r - b1i*w1i;
+                        y1i[q] = b1r*w1i + b1i*w1r;
+                    }
+                }
+            } break;
+        case 4:
+            {
+                for (int p = 0; p < m; ++p) {
+                    const float * w_re = st.w_re.data() + 3*p;
+                    const float * w_im = st.w_im.data() + 3*p;
+
+                    const float * x0r = xr + s*(p + 0*m); const float * x0i = xi + s*(p + 0*m);
+                    const float * x1r = xr + s*(p + 1*m); const float * x1i = xi + s*(p + 1*m);
+                    const float * x2r = xr + s*(p + 2*m); const float * x2i = xi + s*(p + 2*m);
+                    const float * x3r = xr + s*(p + 3*m); const float * x3i = xi + s*(p + 3*m);
+
+                    float * y0r = yr + s*(4*p + 0); float * y0i = yi + s*(4*p + 0);
+                    float * y1r = yr + s*(4*p + 1); float * y1i = yi + s*(4*p + 1);
+                    float * y2r = yr + s*(4*p + 2); float * y2i = yi + s*(4*p + 2);
+                    float * y3r = yr + s*(4*p + 3); float * y3i = yi + s*(4*p + 3);
+
+                    for (int q = 0; q < s; ++q) {
+                        const float t0r = x0r[q] + x2r[q], t0i = x0i[q] + x2i[q];
+                        const float t1r = x0r[q] - x2r[q], t1i = x0i[q] - x2i[q];
+                        const float t2r = x1r[q] + x3r[q], t2i = x1i[q] + x3i[q];
+                        // (x1 - x3)*(-i)
+                        const float t3r = x1i[q] - x3i[q], t3i = x3r[q] - x1r[q];
+
+                        const float b1r = t1r + t3r, b1i = t1i + t3i;
+                        const float b2r = t0r - t2r, b2i = t0i - t2i;
+                        const float b3r = t1r - t3r, b3i = t1i - t3i;
+
+                        y0r[q] = t0r + t2r;
+                        y0i[q] = t0i + t2i;
+                        y1r[q] = b1r*w_re[0] - b1i*w_im[0];
+                        y1i[q] = b1r*w_im[0] + b1i*w_re[0];
+                        y2r[q] = b2r*w_re[1] - b2i*w_im[1];
+                        y2i[q] = b2r*w_im[1] + b2i*w_re[1];
+                        y3r[q] = b3r*w_re[2] - b3i*w_im[2];
+                        y3i[q] = b3r*w_im[2] + b3i*w_re[2];
+                    }
+                }
+            } break;
+        case 5:
+            {
+                const float c1 =  0.309016994374947f; // cos(2*pi/5)
+                const float c2 = -0.809016994374947f; // cos(4*pi/5)
+                const float s1 =  0.951056516295154f; // sin(2*pi/5)
+                const float s2 =  0.587785252292473f; // sin(4*pi/5)
+
+                for (int p = 0; p < m; ++p) {
+                    const float * w_re = st.w_re.data() + 4*p;
+                    const float * w_im = st.w_im.data() + 4*p;
+
+                    const float * x0r = xr + s*(p + 0*m); const float * x0i = xi + s*(p + 0*m);
+                    const float * x1r = xr + s*(p + 1*m); const float * x1i = xi + s*(p + 1*m);
+                    const float * x2r = xr + s*(p + 2*m); const float * x2i = xi + s*(p + 2*m);
+                    const float * x3r = xr + s*(p + 3*m); const float * x3i = xi + s*(p + 3*m);
+                    const float * x4r = xr + s*(p + 4*m); const float * x4i = xi + s*(p + 4*m);
+
+                    float * y0r = yr + s*(5*p + 0); float * y0i = yi + s*(5*p + 0);
+                    float * y1r = yr + s*(5*p + 1); float * y1i = yi + s*(5*p + 1);
+                    float * y2r = yr + s*(5*p + 2); float * y2i = yi + s*(5*p + 2);
+                    float * y3r = yr + s*(5*p + 3); float * y3i = yi + s*(5*p + 3);
+                    float * y4r = yr + s*(5*p + 4); float * y4i = yi + s*(5*p + 4);
+
+                    for (int q = 0; q < s; ++q) {
+                        const float s14r = x1r[q] + x4r[q], s14i = x1i[q] + x4i[q];
+                        const float d14r = x1r[q] - x4r[q], d14i = x1i[q] - x4i[q];
+                        const float s23r = x2r[q] + x3r[q], s23i = x2i[q] + x3i[q];
+                        const float d23r = x2r[q] - x3r[q], d23i = x2i[q] - x3i[q];
+
+                        const float a1r = x0r[q] + c1*s14r + c2*s23r, a1i = x0i[q] + c1*s14i + c2*s23i;
+                        const float a2r = x0r[q] + c2*s14r + c1*s23r, a2i = x0i[q] + c2*s14i + c1*s23i;
+
+                        // -i*(s1*d14 + s2*d23) and -i*(s2*d14 - s1*d23)
+                        const float e1r =  s1*d14i + s2*d23i, e1i = -s1*d14r - s2*d23r;
+                        const float e2r =  s2*d14i - s1*d23i, e2i = -s2*d14r + s1*d23r;
+
+                        const float b1r = a1r + e1r, b1i = a1i + e1i;
+                        const float b4r = a1r - e1r, b4i = a1i - e1i;
+                        const float b2r = a2r + e2r, b2i = a2i + e2i;
+                        const float b3r = a2r - e2r, b3i = a2i - e2i;
+
+                        y0r[q] = x0r[q] + s14r + s23r;
+                        y0i[q] = x0i[q] + s14i + s23i;
+                        y1r[q] = b1r*w_re[0] - b1i*w_im[0];
+                        y1i[q] = b1r*w_im[0] + b1i*w_re[0];
+                        y2r[q] = b2r*w_re[1] - b2i*w_im[1];
+                        y2i[q] = b2r*w_im[1] + b2i*w_re[1];
+                        y3r[q] = b3r*w_re[2] - b3i*w_im[2];
+                        y3i[q] = b3r*w_im[2] + b3i*w_re[2];
+                        y4r[q] = b4r*w_re[3] - b4i*w_im[3];
+                        y4i[q] = b4r*w_im[3] + b4i*w_re[3];
+                    }
+                }
+            } break;
+        default:
+            GGML_ABORT("unsupported radix");
+    }
+}
+
+// power spectrum of the WHISPER_RFFT_N real samples in: out[k] = |X[k]|^2, k in [0, N/2]
+// work must have room for 4*(N/2) floats
+static void whisper_rfft_power(const whisper_rfft_plan & plan, const float * in, float * out, float * work) {
+    const int M = WHISPER_RFFT_M;
+
+    float * xr = work + 0*M;
+    float * xi = work + 1*M;
+    float * yr = work + 2*M;
+    float * yi = work + 3*M;
+
+    for (int n = 0; n < M; ++n) {
+        xr[n] = in[2*n + 0];
+        xi[n] = in[2*n + 1];
+    }
+
+    for (const auto & stage : plan.stages) {
+        whisper_rfft_stage_run(stage, xr, xi, yr, yi);
+
+        std::swap(xr, yr);
+        std::swap(xi, yi);
+    }
+
+    // split: X[k] = (Z[k] + conj(Z[M - k]))/2 - i*W_N^k*(Z[k] - conj(Z[M - k]))/2
+    for (int k = 0; k <= M; ++k) {
+        const int k0 = k % M;
+        const int k1 = (M - k) % M;
+
+        const float zr = xr[k0], zi =  xi[k0];
+        const float cr = xr[k1], ci = -xi[k1];
+
+        const float er = 0.5f*(zr + cr), ei = 0.5f*(zi + ci);
+        const float dr = 0.5f*(zr - cr), di = 0.5f*(zi - ci);
+
+        // -i*W*d
+        const float wdr = plan.w_re[k]*dr - plan.w_im[k]*di;
+        const float wdi = plan.w_re[k]*di + plan.w_im[k]*dr;
+
+        const float re = er + wdi;
+        const float im = ei - wdr;
+
+        out[k] = re*re + im*im;
+    }
+}
@@ -0,0 +1,67 @@
+#pragma once
+
+#include "ggml.h"
+
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// store the K and V of a batch of n_tokens in layer il of the KV cache tensors k and v, with n_ctx cells per layer
+//
+//   - Kcur: [n_state, n_tokens]
+//   - Vcur: [n_state, n_tokens]
+//
+// the tokens are written to the runs of [first cell, number of tokens], in order
+//
+// without flash attention, v is stored transposed ([n_ctx, n_state] per layer). the tokens of a run are sliced
+// from Vcur before it is transposed, so that the slices keep the strides of the rows
+static void whisper_kv_cache_store_runs(
+        struct ggml_context * ctx0,
+        struct ggml_cgraph  * gf,
+        struct ggml_tensor  * k,
+        struct ggml_tensor  * v,
+                        int   n_ctx,
+        struct ggml_tensor  * Kcur,
+        struct ggml_tensor  * Vcur,
+                        int   il,
+                        int   n_tokens,
+    const std::vector<std::pair<uint32_t, uint32_t>> & runs,
+                       bool   flash_attn) {
+    const int n_state = Kcur->ne[0];
+
+    Vcur = ggml_reshape_2d(ctx0, Vcur, n_state, n_tokens);
+
+    for (uint32_t ir = 0, i0 = 0; ir < runs.size(); ++ir) {
+        const uint32_t cell = runs[ir].first;
+        const uint32_t n    = runs[ir].second;
+
+        struct ggml_tensor * Kcur_r = Kcur;
+        struct ggml_tensor * Vcur_r = Vcur;
+
+        if (runs.size() > 1) {
+            Kcur_r = ggml_view_2d(ctx0, Kcur, n_state, n, Kcur->nb[1], i0*Kcur->nb[1]);
+            Vcur_r = ggml_view_2d(ctx0, Vcur, n_state, n, Vcur->nb[1], i0*Vcur->nb[1]);
+        }
+
+        struct ggml_tensor * k_r = ggml_view_1d(ctx0, k, n*n_state,
+                ggml_row_size(k->type, n_state)*(il*n_ctx + cell));
+
+        struct ggml_tensor * v_r;
+
+        if (flash_attn) {
+            v_r = ggml_view_1d(ctx0, v, n*n_state,
+                    ggml_row_size(v->type, n_state)*(il*n_ctx + cell));
+        } else {
+            Vcur_r = ggml_transpose(ctx0, Vcur_r);
+
+            v_r = ggml_view_2d(ctx0, v, n, n_state,
+                    (   n_ctx)*ggml_element_size(v),
+                    (il*n_ctx)*ggml_element_size(v)*n_state + cell*ggml_element_size(v));
+        }
+
+        ggml_build_forward_expand(gf, ggml_cpy(ctx0, Kcur_r, k_r));
+        ggml_build_forward_expand(gf, ggml_cpy(ctx0, Vcur_r, v_r));
+
+        i0 += n;
+    }
+}
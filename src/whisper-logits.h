@@ -0,0 +1,193 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+
+// fused passes over the n_vocab logits of a decoder step (see whisper_process_logits)
+//
+// the loops vectorize without -ffast-math: the sums keep WHISPER_LOGITS_W partial results, one per lane, the max
+// is an integer reduction, the exponential is a polynomial, and the comparisons and selects are done on the bits
+// of the floats (with the default -ftrapping-math, the compilers do not if-convert float comparisons)
+//
+// the log softmax of the logits x is computed with
+//
+//   pass 1: the max of the text tokens [0, n_text) and of the timestamp tokens [n_text, n)
+//   pass 2: e[i] = exp(x[i] - max), and the sums of e over both ranges
+//   pass 3: logprobs[i] = x[i] - lse, probs[i] = e[i]/sum
+//
+// the timestamp rule of whisper_process_logits() only needs the results of pass 2
+#define WHISPER_LOGITS_W 16
+
+static inline int32_t whisper_logits_bits(float x) {
+    int32_t res;
+    memcpy(&res, &x, sizeof(res));
+    return res;
+}
+
+static inline float whisper_logits_float(int32_t bits) {
+    float res;
+    memcpy(&res, &bits, sizeof(res));
+    return res;
+}
+
+// c ? a : b
+static inline float whisper_logits_select(bool c, float a, float b) {
+    const int32_t m = -(int32_t) c;
+
+    return whisper_logits_float((whisper_logits_bits(a) & m) | (whisper_logits_bits(b) & ~m));
+}
+
+// an integer with the order of the floats
+static inline int32_t whisper_logits_key(float x) {
+    const int32_t i = whisper_logits_bits(x);
+    return i ^ ((i >> 31) & 0x7fffffff);
+}
+
+static inline bool whisper_logits_is_valid(float x) {
+    return whisper_logits_bits(x) != whisper_logits_bits(-INFINITY);
+}
+
+// exp(x) for x <= 0, 0 below -87 (where expf() would return a denormal), within 2 ulp of expf()
+// ref: Cephes expf
+static inline float whisper_logits_exp(float x) {
+    const float magic = 12582912.0f; // 1.5*2^23, adding it rounds to an integer in the low bits of the mantissa
+
+    const bool under = whisper_logits_key(x) < whisper_logits_key(-87.0f);
+
+    const float xc = whisper_logits_select(under, -87.0f, x);
+
+    const float t = xc*1.44269504088896341f + magic;
+    const float n = t - magic;
+
+    const float r = (xc - n*0.693359375f) + n*2.12194440e-4f;
+
+    float p = 1.9875691500e-4f;
+    p = p*r + 1.3981999507e-3f;
+    p = p*r + 8.3334519073e-3f;
+    p = p*r + 4.1665795894e-2f;
+    p = p*r + 1.6666665459e-1f;
+    p = p*r + 5.0000001201e-1f;
+    p = p*r*r + r + 1.0f;
+
+    // 2^n from the low bits of t
+    const float scale = whisper_logits_float((whisper_logits_bits(t) - whisper_logits_bits(magic) + 127) << 23);
+
+    return whisper_logits_select(under, 0.0f, p*scale);
+}
+
+// dst = src/temperature (if temperature > 0), with the tokens in mask (if not null) set to -INFINITY
+static void whisper_logits_prep(float * dst, const float * src, int n, float temperature, const uint8_t * mask) {
+    const float t = temperature > 0.0f ? temperature : 1.0f;
+
+    if (mask) {
+        for (int i = 0; i < n; ++i) {
+            dst[i] = whisper_logits_select(mask[i], -INFINITY, src[i]/t);
+        }
+    } else {
+        for (int i = 0; i < n; ++i) {
+            dst[i] = src[i]/t;
+        }
+    }
+}
+
+// dst[i] = -INFINITY for the tokens in mask
+static void whisper_logits_mask(float * dst, int n, const uint8_t * mask) {
+    for (int i = 0; i < n; ++i) {
+        dst[i] = whisper_logits_select(mask[i], -INFINITY, dst[i]);
+    }
+}
+
+static float whisper_logits_max(const float * x, int n) {
+    int32_t m = whisper_logits_key(-INFINITY);
+
+    for (int i = 0; i < n; ++i) {
+        const int32_t k = whisper_logits_key(x[i]);
+        m = k > m ? k : m;
+    }
+
+    // the key is its own inverse
+    return whisper_logits_float(whisper_logits_key(whisper_logits_float(m)));
+}
+
+// e[i] = exp(x[i] - x_max) and returns the sum of e
+static float whisper_logits_exp_sum(const float * x, int n, float x_max, float * e) {
+    float s[WHISPER_LOGITS_W] = { 0.0f };
+
+    int i = 0;
+    for (; i + WHISPER_LOGITS_W <= n; i += WHISPER_LOGITS_W) {
+        for (int j = 0; j < WHISPER_LOGITS_W; ++j) {
+            e[i + j] = whisper_logits_exp(x[i + j] - x_max);
+            s[j] += e[i + j];
+        }
+    }
+    for (; i < n; ++i) {
+        e[i] = whisper_logits_exp(x[i] - x_max);
+        s[0] += e[i];
+    }
+
+    float sum = 0.0f;
+    for (int j = 0; j < WHISPER_LOGITS_W; ++j) {
+        sum += s[j];
+    }
+
+    return sum;
+}
+
+struct whisper_logits_stats {
+    float max      = -INFINITY; // max of all the logits
+    float max_text = -INFINITY; // max of the logits [0, n_text)
+    float sum_text = 0.0f;      // sum of exp(x - max) over [0, n_text)
+    float sum_ts   = 0.0f;      // sum of exp(x - max) over [n_text, n)
+
+    // log(sum(exp(x)))
+    float lse() const {
+        return logf(sum_text + sum_ts) + max;
+    }
+};
+
+// passes 1 and 2, e[i] = exp(x[i] - max)
+static whisper_logits_stats whisper_logits_softmax_begin(const float * x, int n, int n_text, float * e) {
+    whisper_logits_stats res;
+
+    res.max_text = whisper_logits_max(x, n_text);
+    res.max      = std::max(res.max_text, whisper_logits_max(x + n_text, n - n_text));
+
+    if (res.max == -INFINITY) {
+        std::fill(e, e + n, 0.0f);
+        return res;
+    }
+
+    res.sum_text = whisper_logits_exp_sum(x,          n_text,     res.max, e);
+    res.sum_ts   = whisper_logits_exp_sum(x + n_text, n - n_text, res.max, e + n_text);
+
+    return res;
+}
+
+// pass 3, the log softmax of x into logprobs and the softmax into probs, which holds e from pass 2
+// the tokens with x[i] = -INFINITY get logprobs[i] = -INFINITY and probs[i] = 0
+static void whisper_logits_softmax_end(const float * x, int n, const whisper_logits_stats & stats, float * logprobs, float * probs) {
+    const float lse     = stats.lse();
+    const float inv_sum = 1.0f/(stats.sum_text + stats.sum_ts);
+
+    for (int i = 0; i < n; ++i) {
+        const bool valid = whisper_logits_is_valid(x[i]);
+
+        logprobs[i] = whisper_logits_select(valid, x[i] - lse,       -INFINITY);
+        probs[i]    = whisper_logits_select(valid, probs[i]*inv_sum, 0.0f);
+    }
+}
+
+// the index of the first max of x
+static int whisper_logits_argmax(const float * x, int n) {
+    const float x_max = whisper_logits_max(x, n);
+
+    for (int i = 0; i < n; ++i) {
+        if (x[i] == x_max) {
+            return i;
+        }
+    }
+
+    return 0;
+}
@@ -1,5 +1,8 @@
 #include "whisper.h"
 #include "whisper-arch.h"
+#include "whisper-fft.h"
+#include "whisper-kv.h"
+#include "whisper-logits.h"
 
 #include "ggml.h"
 #include "ggml-cpp.h"
@@ -17,16 +20,20 @@
 #include <atomic>
 #include <algorithm>
 #include <cassert>
+#include <cerrno>
 #define _USE_MATH_DEFINES
 #include <cmath>
 #include <climits>
 #include <codecvt>
+#include <condition_variable>
 #include <cstdarg>
 #include <cstdio>
 #include <cstring>
+#include <deque>
 #include <fstream>
 #include <functional>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <random>
 #include <regex>
@@ -35,6 +42,13 @@
 #include <thread>
 #include <vector>
 
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 // dummy
 
 #if defined(_MSC_VER)
@@ -144,6 +158,8 @@ static void whisper_log_callback_default(ggml_log_level level, const char * text
 
 #define WHISPER_MAX_DECODERS 8
 #define WHISPER_MAX_NODES 4096
+#define WHISPER_AUDIO_CTX_BUCKET 256
+#define WHISPER_SUPPRESS_MASKS_MAX 8
 
 static std::string format(const char * fmt, ...) {
     va_list ap;
@@ -164,33 +180,119 @@ static std::string format(const char * fmt, ...) {
 // ggml helpers
 //
 
-static bool ggml_graph_compute_helper(
-          struct ggml_cgraph * graph,
-                         int   n_threads,
-         ggml_abort_callback   abort_callback,
-                        void * abort_callback_data) {
+// [EXPERIMENTAL] persistent threadpool of the CPU backend (see whisper_context_params.cpu_mask)
+//
+// without it, the CPU backend starts the threads of each graph. the threadpool is created for the first graph and
+// re-created when a graph needs more threads, the graphs with fewer threads use a part of it
+struct whisper_threadpool {
+    ggml_backend_t    backend = nullptr; // the CPU backend, not owned
+    ggml_threadpool_t pool    = nullptr;
 
-    ggml_backend_ptr backend { ggml_backend_init_by_type(GGML_BACKEND_DEVICE_TYPE_CPU, nullptr) };
+    int n_threads = 0;
+
+    ggml_threadpool_params params;
+
+    ggml_threadpool_t (*fn_new) (ggml_threadpool_params * params)                = nullptr;
+    void              (*fn_free)(ggml_threadpool_t pool)                         = nullptr;
+    void              (*fn_set) (ggml_backend_t backend, ggml_threadpool_t pool) = nullptr;
+
+    whisper_threadpool() = default;
+    whisper_threadpool(const whisper_threadpool &) = delete;
+    whisper_threadpool & operator=(const whisper_threadpool &) = delete;
+
+    ~whisper_threadpool() {
+        if (pool) {
+            fn_free(pool);
+        }
+    }
+};
+
+// find the CPU backend among the backends and set the affinity and the polling of its threadpool
+// cpu_mask is the parsed whisper_context_params.cpu_mask, by CPU (empty - default affinity)
+static void whisper_threadpool_init(
+                 whisper_threadpool & tp,
+  const std::vector<ggml_backend_t> & backends,
+            const std::vector<bool> & cpu_mask,
+                               bool   cpu_strict,
+                                int   cpu_poll) {
+    for (ggml_backend_t backend : backends) {
+        ggml_backend_dev_t dev = ggml_backend_get_device(backend);
+        if (!dev || ggml_backend_dev_type(dev) != GGML_BACKEND_DEVICE_TYPE_CPU) {
+            continue;
+        }
+
+        ggml_backend_reg_t reg = ggml_backend_dev_backend_reg(dev);
+
+        tp.fn_new  = (decltype(tp.fn_new))  ggml_backend_reg_get_proc_address(reg, "ggml_threadpool_new");
+        tp.fn_free = (decltype(tp.fn_free)) ggml_backend_reg_get_proc_address(reg, "ggml_threadpool_free");
+        tp.fn_set  = (decltype(tp.fn_set))  ggml_backend_reg_get_proc_address(reg, "ggml_backend_cpu_set_threadpool");
+
+        if (tp.fn_new && tp.fn_free && tp.fn_set) {
+            tp.backend = backend;
+        }
+
+        break;
+    }
+
+    tp.params = ggml_threadpool_params_default(1);
+
+    for (size_t i = 0; i < cpu_mask.size() && i < GGML_MAX_N_THREADS; ++i) {
+        tp.params.cpumask[i] = cpu_mask[i];
+    }
+
+    tp.params.strict_cpu = cpu_strict;
+    tp.params.poll       = std::min(std::max(cpu_poll, 0), 100);
+}
+
+// make sure that the threadpool has at least n_threads threads
+static void whisper_threadpool_reserve(whisper_threadpool & tp, int n_threads) {
+    n_threads = std::min(n_threads, GGML_MAX_N_THREADS);
+
+    if (!tp.backend || n_threads <= tp.n_threads) {
+        return;
+    }
+
+    ggml_threadpool_params params = tp.params;
+    params.n_threads = n_threads;
 
-    auto * reg = ggml_backend_dev_backend_reg(ggml_backend_get_device(backend.get()));
+    ggml_threadpool_t pool = tp.fn_new(&params);
+    if (!pool) {
+        WHISPER_LOG_WARN("%s: failed to create a threadpool with %d threads\n", __func__, n_threads);
+        return;
+    }
 
-    auto * set_abort_callback_fn = (ggml_backend_set_abort_callback_t) ggml_backend_reg_get_proc_address(reg, "ggml_backend_set_abort_callback");
-    if (set_abort_callback_fn) {
-        set_abort_callback_fn(backend.get(), abort_callback, abort_callback_data);
+    // the previous threadpool is paused by the backend before it is freed
+    tp.fn_set(tp.backend, pool);
+
+    if (tp.pool) {
+        tp.fn_free(tp.pool);
     }
 
+    tp.pool      = pool;
+    tp.n_threads = n_threads;
+}
+
+static bool ggml_graph_compute_helper(
+          ggml_backend_t   backend,
+      struct ggml_cgraph * graph,
+                     int   n_threads) {
+    auto * reg = ggml_backend_dev_backend_reg(ggml_backend_get_device(backend));
+
     auto ggml_backend_set_n_threads_fn = (ggml_backend_set_n_threads_t) ggml_backend_reg_get_proc_address(reg, "ggml_backend_set_n_threads");
     if (ggml_backend_set_n_threads_fn) {
-        ggml_backend_set_n_threads_fn(backend.get(), n_threads);
+        ggml_backend_set_n_threads_fn(backend, n_threads);
     }
 
-    return ggml_backend_graph_compute(backend.get(), graph) == GGML_STATUS_SUCCESS;
+    return ggml_backend_graph_compute(backend, graph) == GGML_STATUS_SUCCESS;
 }
 
+// the CPU backend runs the graph on the threadpool - setting the number of threads only changes how much of it is used
 static bool ggml_graph_compute_helper(
       ggml_backend_sched_t   sched,
         struct ggml_cgraph * graph,
-                       int   n_threads) {
+                       int   n_threads,
+        whisper_threadpool & threadpool) {
+    whisper_threadpool_reserve(threadpool, n_threads);
 
     for (int i = 0; i < ggml_backend_sched_get_n_backends(sched); ++i) {
         ggml_backend_t backend = ggml_backend_sched_get_backend(sched, i);
@@ -454,6 +556,7 @@ static const std::map<whisper_alignment_heads_preset, whisper_aheads> g_aheads {
 };
 
 static std::vector<uint32_t> get_alignment_heads_by_layer(const whisper_context_params & cparams, int il, int32_t n_text_layer, int32_t n_head);
+static void whisper_mel_lazy_window(whisper_context & wctx, whisper_state & wstate, int i0, int n, int n_threads);
 
 struct whisper_mel {
     int n_len;
@@ -461,15 +564,144 @@ struct whisper_mel {
     int n_mel;
 
     std::vector<float> data;
+
+    // [EXPERIMENTAL] rolling window of the streaming API (see whisper_pcm_to_mel_stream_with_state) or window of the
+    // lazy spectrogram (see whisper_mel_lazy_window)
+    // only the frames [i_first, i_first + n_held) are held. frame i of band j is at data[j*n_stride + i_beg + i - i_first]
+    // and holds the raw log10 energy, which is clamped to norm_max - 8 and scaled when it is read by whisper_mel_copy()
+    bool  stream   = false;
+    bool  lazy     = false;
+    int   n_stride = 0;
+    int   i_beg    = 0;
+    int   i_first  = 0;
+    int   n_held   = 0;
+    float norm_max = 0.0f;
+};
+
+// [EXPERIMENTAL] state of the incremental log mel spectrogram (see whisper_pcm_to_mel_stream_with_state)
+struct whisper_mel_stream {
+    // the padded samples, starting at the first sample of the next frame
+    // before the first frame, the samples received so far (the reflective padding needs WHISPER_N_FFT/2 + 1 of them)
+    std::vector<float> pcm;
+
+    bool    started  = false; // the reflective padding at the start has been applied
+    int64_t n_frames = 0;     // number of frames computed since the reset
+
+    // sliding window maximum of the frames in the window: (frame, max over the bands), decreasing
+    std::deque<std::pair<int64_t, float>> max;
+
+    // the new frames of the current call, [n_new][n_mel]
+    std::vector<float> frames;
+};
+
+// [EXPERIMENTAL] state of the lazy log mel spectrogram (see whisper_full_params.mel_lazy)
+struct whisper_mel_lazy {
+    // the audio of the current whisper_full() call, not owned
+    const float * samples   = nullptr;
+    int           n_samples = 0;
+
+    // the raw log10 energies of the frames [f_beg, f_end), [n][n_mel]
+    int f_beg = 0;
+    int f_end = 0;
+
+    std::vector<float> frames;
+
+    // the frames [f_end, f_end + n_next) computed by the background thread, [n_next][n_mel]
+    std::thread        worker;
+    std::vector<float> next;
+
+    int     n_next    = 0;
+    int64_t t_next_us = 0;
+
+    // the threads of the frames that the background thread did not get to, 0 - the threads of the encoder
+    int n_threads = 0;
+
+    ~whisper_mel_lazy() {
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
 };
 
+// copy the frames [i0, i0 + n) of the mel spectrogram into dst, which has n_mel rows of n values
+// the frames past the end of the spectrogram are zero, or silence for the streamed and the lazy spectrograms
+static void whisper_mel_copy(const whisper_mel & mel, int i0, int n, float * dst) {
+    const int i1 = std::min(i0 + n, mel.n_len);
+
+    i0 = std::min(i0, mel.n_len);
+
+    if (!mel.stream && !mel.lazy) {
+        memset(dst, 0, (size_t) mel.n_mel*n*sizeof(float));
+
+        for (int j = 0; j < mel.n_mel; ++j) {
+            for (int i = i0; i < i1; ++i) {
+                dst[j*n + (i - i0)] = mel.data[j*mel.n_len + i];
+            }
+        }
+
+        return;
+    }
+
+    const float vmin = mel.norm_max - 8.0f;
+    const float vpad = (std::max(-10.0f, vmin) + 4.0f)/4.0f; // log10(1e-10) for the zero padding
+
+    // the frames that are not held are silence
+    const int h0 = std::min(std::max(i0, mel.i_first), i1);
+    const int h1 = std::max(std::min(i1, mel.i_first + mel.n_held), h0);
+
+    for (int j = 0; j < mel.n_mel; ++j) {
+        const float * src = mel.data.data() + j*mel.n_stride + mel.i_beg - mel.i_first;
+
+        for (int i = 0; i < h0 - i0; ++i) {
+            dst[j*n + i] = vpad;
+        }
+        for (int i = h0; i < h1; ++i) {
+            dst[j*n + (i - i0)] = (std::max(src[i], vmin) + 4.0f)/4.0f;
+        }
+        for (int i = h1 - i0; i < n; ++i) {
+            dst[j*n + i] = vpad;
+        }
+    }
+}
+
 struct whisper_filters {
     int32_t n_mel;
     int32_t n_fft;
 
     std::vector<float> data;
+
+    // sparse form of data, built at load time by whisper_filters_init_sparse()
+    // the nonzero weights of mel band j are sparse[off[j] + i] for the bins beg[j] + i, i in [0, len[j])
+    std::vector<int32_t> beg;
+    std::vector<int32_t> len;
+    std::vector<int32_t> off;
+    std::vector<float>   sparse;
 };
 
+// each triangular mel filter covers only a few FFT bins, so keep just the span between its first and last nonzero weight
+static void whisper_filters_init_sparse(whisper_filters & filters) {
+    filters.beg.assign(filters.n_mel, 0);
+    filters.len.assign(filters.n_mel, 0);
+    filters.off.assign(filters.n_mel, 0);
+    filters.sparse.clear();
+
+    for (int j = 0; j < filters.n_mel; ++j) {
+        const float * row = filters.data.data() + j*filters.n_fft;
+
+        int k0 = 0;
+        int k1 = filters.n_fft;
+
+        while (k0 < k1 && row[k0]     == 0.0f) { k0++; }
+        while (k1 > k0 && row[k1 - 1] == 0.0f) { k1--; }
+
+        filters.beg[j] = k0;
+        filters.len[j] = k1 - k0;
+        filters.off[j] = filters.sparse.size();
+
+        filters.sparse.insert(filters.sparse.end(), row + k0, row + k1);
+    }
+}
+
 struct whisper_vocab {
     using id    = int32_t;
     using token = std::string;
@@ -594,14 +826,18 @@ static size_t whisper_sched_size(struct whisper_sched & allocr) {
     return size;
 }
 
+// create the scheduler and the meta buffer, without allocating the compute buffers
+static void whisper_sched_init(struct whisper_sched & allocr, std::vector<ggml_backend_t> & backends) {
+    allocr.sched = ggml_backend_sched_new(backends.data(), nullptr, backends.size(), WHISPER_MAX_NODES, false);
+
+    allocr.meta.resize(ggml_tensor_overhead()*WHISPER_MAX_NODES + ggml_graph_overhead());
+}
+
 // measure the memory usage of a graph and prepare the allocr's internal data buffer
 static bool whisper_sched_graph_init(struct whisper_sched & allocr, std::vector<ggml_backend_t> backends, std::function<struct ggml_cgraph *()> && get_graph) {
     auto & sched = allocr.sched;
-    auto & meta  = allocr.meta;
-
-    sched = ggml_backend_sched_new(backends.data(), nullptr, backends.size(), WHISPER_MAX_NODES, false);
 
-    meta.resize(ggml_tensor_overhead()*WHISPER_MAX_NODES + ggml_graph_overhead());
+    whisper_sched_init(allocr, backends);
 
     // since there are dependencies between the different graphs,
     // we need to allocate them instead of only reserving to get the correct compute buffer size
@@ -616,6 +852,106 @@ static bool whisper_sched_graph_init(struct whisper_sched & allocr, std::vector<
     return true;
 }
 
+// pool of long-lived threads for the small host-side parallel work (e.g. sampling the decoders, log mel)
+//
+// the calling thread takes part in each job as thread 0. after a job, the workers spin for a short while
+// waiting for the next one and then park on a condition variable, so that back-to-back jobs are
+// dispatched with low latency without burning a core while the graphs are being computed
+struct whisper_worker_pool {
+    std::vector<std::thread> workers;
+
+    std::mutex              mutex;
+    std::condition_variable cv;
+
+    std::atomic<int> n_job     {0}; // incremented for each job
+    std::atomic<int> n_pending {0}; // number of workers that have not finished the current job
+
+    bool stop = false; // protected by mutex
+
+    // the current job
+    const std::function<void(int)> * fn = nullptr;
+    int n_threads = 0;
+
+    whisper_worker_pool() = default;
+    whisper_worker_pool(const whisper_worker_pool &) = delete;
+    whisper_worker_pool & operator=(const whisper_worker_pool &) = delete;
+
+    ~whisper_worker_pool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stop = true;
+        }
+        cv.notify_all();
+
+        for (auto & worker : workers) {
+            worker.join();
+        }
+    }
+};
+
+static void whisper_worker_pool_loop(whisper_worker_pool & pool, int iw, int n_job_last) {
+    const int n_spin = 1 << 14;
+
+    while (true) {
+        int n_job = pool.n_job.load();
+
+        for (int i = 0; i < n_spin && n_job == n_job_last; ++i) {
+            n_job = pool.n_job.load();
+        }
+
+        if (n_job == n_job_last) {
+            std::unique_lock<std::mutex> lock(pool.mutex);
+            pool.cv.wait(lock, [&]() { return pool.stop || pool.n_job.load() != n_job_last; });
+
+            if (pool.stop) {
+                return;
+            }
+
+            n_job = pool.n_job.load();
+        }
+
+        n_job_last = n_job;
+
+        // worker iw is thread iw + 1 of the job
+        if (iw + 1 < pool.n_threads) {
+            (*pool.fn)(iw + 1);
+        }
+
+        pool.n_pending.fetch_sub(1);
+    }
+}
+
+// run fn(ith) for ith in [0, n_threads) and wait for all of them to finish
+// the workers are started on first use and kept until the pool is destroyed
+static void whisper_worker_pool_run(whisper_worker_pool & pool, int n_threads, const std::function<void(int)> & fn) {
+    if (n_threads <= 1) {
+        fn(0);
+        return;
+    }
+
+    while ((int) pool.workers.size() < n_threads - 1) {
+        pool.workers.emplace_back(whisper_worker_pool_loop, std::ref(pool), (int) pool.workers.size(), pool.n_job.load());
+    }
+
+    pool.fn        = &fn;
+    pool.n_threads = n_threads;
+    pool.n_pending.store((int) pool.workers.size());
+
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        pool.n_job.fetch_add(1);
+    }
+    pool.cv.notify_all();
+
+    fn(0);
+
+    while (pool.n_pending.load() > 0) {
+        std::this_thread::yield();
+    }
+
+    pool.fn = nullptr;
+}
+
 // medium
 // hparams: {
 // 'n_mels': 80,
@@ -752,6 +1088,10 @@ struct whisper_kv_cache {
 
     std::vector<whisper_kv_cell> cells;
 
+    // the cells of the last batch, as runs of [first cell, number of tokens]
+    // empty when the batch is stored contiguously starting at head
+    std::vector<std::pair<uint32_t, uint32_t>> runs;
+
     struct ggml_tensor * k;
     struct ggml_tensor * v;
 
@@ -810,9 +1150,11 @@ struct whisper_partial_utf8 {
     int      n_remain; // num bytes remaining; -1 indicates invalid sequence
 };
 
+// the rules and the stacks are immutable and shared between the copies of a grammar (e.g. the beams), so that a copy
+// does not allocate. the stacks point into the rules, and accepting a token replaces them
 struct whisper_grammar {
-    /*const*/ std::vector<std::vector<whisper_grammar_element>> rules;
-    std::vector<std::vector<const whisper_grammar_element *>>   stacks;
+    std::shared_ptr<const std::vector<std::vector<whisper_grammar_element>>>        rules;
+    std::shared_ptr<const std::vector<std::vector<const whisper_grammar_element *>>> stacks;
 
     // buffer for partially generated UTF-8 sequence from accepted tokens
     whisper_partial_utf8 partial_utf8;
@@ -889,6 +1231,14 @@ struct whisper_state {
     // number of decoders for which we have constructed the KV cache
     int32_t kv_self_n_dec = 0;
 
+    // the tokens stored in sequence 0 of kv_self, starting from position 0 (empty - none)
+    // only valid while kv_cross does not change, since the self-attention KV depends on the encoder output
+    std::vector<whisper_token> kv_self_prompt;
+
+    // [EXPERIMENTAL] speculative decoding - the state of the draft model (see whisper_full_params.draft_ctx)
+    whisper_context * draft_ctx   = nullptr;
+    whisper_state   * draft_state = nullptr;
+
     // unified self-attention KV cache for all decoders
     whisper_kv_cache kv_self;
 
@@ -900,6 +1250,8 @@ struct whisper_state {
     whisper_kv_cache kv_pad;
 
     whisper_mel mel;
+    whisper_mel_stream mel_stream;
+    whisper_mel_lazy   mel_lazy;
 
     whisper_batch batch;
 
@@ -907,19 +1259,34 @@ struct whisper_state {
 
     std::vector<ggml_backend_t> backends;
 
+    // [EXPERIMENTAL] the threads of the CPU backend
+    whisper_threadpool threadpool;
+
     // - stores meta info about the intermediate tensors into the `meta` buffers
     whisper_sched sched_conv;
     whisper_sched sched_encode;
     whisper_sched sched_cross;
     whisper_sched sched_decode;
 
+    // host-side parallel work (sampling, log mel)
+    whisper_worker_pool workers;
+
+    // [EXPERIMENTAL] encoder schedulers for the automatic audio context, by audio context size
+    std::map<int32_t, whisper_sched> sched_encode_auto;
+
     // result of the encoder
     struct ggml_tensor * embd_conv = nullptr;
     struct ggml_tensor * embd_enc  = nullptr;
 
+    // the mel offset and audio context for which kv_cross was last computed (-1 - not computed)
+    // used to avoid encoding the same window twice (e.g. after the language detection)
+    int32_t enc_mel_offset  = -1;
+    int32_t enc_n_audio_ctx = 0;
+
     // helpers for GPU offloading
     std::vector<float> inp_mel;
     std::vector<float> inp_mask;
+    std::vector<int32_t> inp_out_ids;
 
     // decode output (2-dimensional array: [n_tokens][n_vocab])
     std::vector<float> logits;
@@ -955,6 +1322,112 @@ struct whisper_state {
 
     // [EXPERIMENTAL] speed-up techniques
     int32_t exp_n_audio_ctx = 0; // 0 - use default
+    bool    exp_n_audio_ctx_auto = false; // exp_n_audio_ctx was chosen by whisper_audio_ctx_auto()
+
+    // the tokens suppressed by the params of the current whisper_full(), shared with the context, nullptr - none
+    std::shared_ptr<const std::vector<uint8_t>> suppress_mask;
+};
+
+// open the model file for reading, the path is UTF-8
+static void whisper_model_file_open(std::ifstream & fin, const std::string & path, std::ios::openmode mode) {
+#ifdef _MSC_VER
+    // Convert UTF-8 path to wide string (UTF-16) for Windows, resolving character encoding issues.
+    std::wstring_convert<std::codecvt_utf8<wchar_t>> converter;
+    fin.open(converter.from_bytes(path), mode);
+#else
+    fin.open(path, mode);
+#endif
+}
+
+// read-only mapping of the model file (see whisper_context_params.use_mmap)
+// it is also the context of the model loader, reading from pos
+struct whisper_mmap {
+    void * addr = nullptr;
+    size_t size = 0;
+    size_t pos  = 0;
+
+#if defined(_POSIX_MAPPED_FILES) && !defined(WHISPER_BIG_ENDIAN)
+    static constexpr bool SUPPORTED = true;
+
+    ~whisper_mmap() {
+        if (addr != nullptr) {
+            munmap(addr, size);
+        }
+    }
+#else
+    static constexpr bool SUPPORTED = false;
+#endif
+};
+
+static bool whisper_mmap_open(whisper_mmap & mapping, const char * path) {
+#if defined(_POSIX_MAPPED_FILES) && !defined(WHISPER_BIG_ENDIAN)
+    const int fd = open(path, O_RDONLY);
+    if (fd == -1) {
+        WHISPER_LOG_ERROR("%s: failed to open '%s': %s\n", __func__, path, strerror(errno));
+        return false;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size <= 0) {
+        WHISPER_LOG_ERROR("%s: failed to stat '%s'\n", __func__, path);
+        close(fd);
+        return false;
+    }
+
+    void * addr = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+
+    // the mapping stays valid after the file is closed
+    close(fd);
+
+    if (addr == MAP_FAILED) {
+        WHISPER_LOG_ERROR("%s: failed to mmap '%s': %s\n", __func__, path, strerror(errno));
+        return false;
+    }
+
+    // start reading the whole file in the background, the weights are used right after the load
+    if (posix_madvise(addr, st.st_size, POSIX_MADV_WILLNEED) != 0) {
+        WHISPER_LOG_WARN("%s: posix_madvise(.., POSIX_MADV_WILLNEED) failed: %s\n", __func__, strerror(errno));
+    }
+
+    mapping.addr = addr;
+    mapping.size = st.st_size;
+    mapping.pos  = 0;
+
+    return true;
+#else
+    GGML_UNUSED(mapping);
+    GGML_UNUSED(path);
+
+    return false;
+#endif
+}
+
+// compute buffer sizes of the graphs of a state, by graph name and whether the state has an external encoder
+// they depend only on the model and the context params, so they are the same for all the states of a context
+struct whisper_sched_sizes {
+    std::mutex mutex;
+
+    std::map<std::pair<std::string, bool>, size_t> size;
+};
+
+// vocab-length masks of the tokens suppressed by params.suppress_regex and params.suppress_nst, by (regex, nst)
+// they are compiled on the first whisper_full() with the params. only the WHISPER_SUPPRESS_MASKS_MAX most recently
+// used masks are kept, the states hold a reference to the mask they use, so it can be evicted while they run
+struct whisper_suppress_masks {
+    using key_t = std::pair<std::string, bool>;
+
+    std::mutex mutex;
+
+    // most recently used first
+    std::deque<std::pair<key_t, std::shared_ptr<const std::vector<uint8_t>>>> mask;
+};
+
+// [EXPERIMENTAL] the number of threads of each phase of whisper_full()
+struct whisper_threads {
+    int mel    = 0;
+    int encode = 0;
+    int decode = 0;
+    int sample = 0;
 };
 
 struct whisper_context {
@@ -971,7 +1444,25 @@ struct whisper_context {
 
     whisper_state * state = nullptr;
 
+    // compute buffer sizes measured by the first state (see whisper_sched_graph_init_cached)
+    whisper_sched_sizes sched_sizes;
+
+    // the logit suppression masks of whisper_full() (see whisper_suppress_mask_get)
+    whisper_suppress_masks suppress_masks;
+
+    // the states of whisper_full_parallel(), created on first use
+    whisper_state_pool * state_pool = nullptr;
+
     std::string path_model; // populated by whisper_init_from_file_with_params()
+
+    // the parsed params.cpu_mask, by CPU (empty - default affinity)
+    std::vector<bool> cpu_mask;
+
+    // the thread counts measured by whisper_tune_threads(), 0 - not tuned
+    whisper_threads threads_tuned;
+
+    // the mapped model file, when the weights point into it. freed after the model buffers
+    std::unique_ptr<whisper_mmap> mapping;
 };
 
 struct whisper_global {
@@ -988,10 +1479,89 @@ static void read_safe(whisper_model_loader * loader, T & dest) {
     BYTESWAP_VALUE(dest);
 }
 
+// open the GGUF header of the model file wctx.path_model, with the tensor infos in meta
+static bool whisper_gguf_open(const whisper_context & wctx, gguf_context_ptr & gguf, ggml_context_ptr & meta) {
+#if defined(WHISPER_BIG_ENDIAN)
+    WHISPER_LOG_ERROR("%s: GGUF models are not supported on big-endian hosts\n", __func__);
+    return false;
+#endif
+
+    if (wctx.path_model.empty()) {
+        WHISPER_LOG_ERROR("%s: GGUF models can only be loaded from a file\n", __func__);
+        return false;
+    }
+
+    ggml_context * ctx = nullptr;
+
+    gguf_init_params params = {
+        /*.no_alloc =*/ true,
+        /*.ctx      =*/ &ctx,
+    };
+
+    gguf.reset(gguf_init_from_file(wctx.path_model.c_str(), params));
+    meta.reset(ctx);
+
+    if (!gguf) {
+        WHISPER_LOG_ERROR("%s: failed to read the GGUF header of '%s'\n", __func__, wctx.path_model.c_str());
+        return false;
+    }
+
+    const int64_t kid = gguf_find_key(gguf.get(), ASR_KV_NAMES.at(ASR_KV_GENERAL_ARCHITECTURE));
+    if (kid < 0 || gguf_get_kv_type(gguf.get(), kid) != GGUF_TYPE_STRING || strcmp(gguf_get_val_str(gguf.get(), kid), "whisper") != 0) {
+        WHISPER_LOG_ERROR("%s: '%s' is not a whisper model\n", __func__, wctx.path_model.c_str());
+        return false;
+    }
+
+    WHISPER_LOG_INFO("%s: GGUF v%d, %d tensors, alignment %zu\n", __func__,
+            (int) gguf_get_version(gguf.get()), (int) gguf_get_n_tensors(gguf.get()), gguf_get_alignment(gguf.get()));
+
+    return true;
+}
+
+static bool whisper_gguf_get_i32(const gguf_context * gguf, asr_kv key, int32_t & dst) {
+    const int64_t kid = gguf_find_key(gguf, ASR_KV_NAMES.at(key));
+    if (kid < 0) {
+        WHISPER_LOG_ERROR("%s: key '%s' not found in the GGUF model\n", __func__, ASR_KV_NAMES.at(key));
+        return false;
+    }
+
+    switch (gguf_get_kv_type(gguf, kid)) {
+        case GGUF_TYPE_INT32:  dst = gguf_get_val_i32(gguf, kid); break;
+        case GGUF_TYPE_UINT32: dst = gguf_get_val_u32(gguf, kid); break;
+        default:
+            WHISPER_LOG_ERROR("%s: key '%s' has type %s, expected an int32\n", __func__, ASR_KV_NAMES.at(key), gguf_type_name(gguf_get_kv_type(gguf, kid)));
+            return false;
+    }
+
+    return true;
+}
+
+// copy the array of n elements of the given type into dst
+template<typename T>
+static bool whisper_gguf_get_arr(const gguf_context * gguf, asr_kv key, gguf_type type, T * dst, size_t n) {
+    const int64_t kid = gguf_find_key(gguf, ASR_KV_NAMES.at(key));
+    if (kid < 0) {
+        WHISPER_LOG_ERROR("%s: key '%s' not found in the GGUF model\n", __func__, ASR_KV_NAMES.at(key));
+        return false;
+    }
+
+    if (gguf_get_kv_type(gguf, kid) != GGUF_TYPE_ARRAY || gguf_get_arr_type(gguf, kid) != type || gguf_get_arr_n(gguf, kid) != n) {
+        WHISPER_LOG_ERROR("%s: key '%s' is not an array of %zu %s\n", __func__, ASR_KV_NAMES.at(key), n, gguf_type_name(type));
+        return false;
+    }
+
+    if (n > 0) {
+        memcpy(dst, gguf_get_arr_data(gguf, kid), n*sizeof(T));
+    }
+
+    return true;
+}
+
 static bool whisper_kv_cache_init(
              struct whisper_kv_cache & cache,
                       ggml_backend_t   backend,
-                           ggml_type   wtype,
+                           ggml_type   type_k,
+                           ggml_type   type_v,
                              int64_t   n_text_state,
                              int64_t   n_text_layer,
                                  int   n_ctx) {
@@ -1019,8 +1589,8 @@ static bool whisper_kv_cache_init(
         return false;
     }
 
-    cache.k = ggml_new_tensor_1d(ctx, wtype, n_elements);
-    cache.v = ggml_new_tensor_1d(ctx, wtype, n_elements);
+    cache.k = ggml_new_tensor_1d(ctx, type_k, n_elements);
+    cache.v = ggml_new_tensor_1d(ctx, type_v, n_elements);
 
     cache.buffer = ggml_backend_alloc_ctx_tensors(ctx, backend);
     if (!cache.buffer) {
@@ -1035,6 +1605,50 @@ static bool whisper_kv_cache_init(
     return true;
 }
 
+// the K and V types of a KV cache with the requested type
+// without flash attention V is stored transposed and a token cannot be written in quantized blocks, so V stays F16
+static bool whisper_kv_cache_types(
+        const struct whisper_context & wctx,
+                           ggml_type   type,
+                           ggml_type & type_k,
+                           ggml_type & type_v) {
+    const auto & hparams = wctx.model.hparams;
+
+    switch (type) {
+        case GGML_TYPE_F32:
+        case GGML_TYPE_F16:
+        case GGML_TYPE_Q4_0:
+        case GGML_TYPE_Q4_1:
+        case GGML_TYPE_Q5_0:
+        case GGML_TYPE_Q5_1:
+        case GGML_TYPE_Q8_0:
+            break;
+        default:
+            WHISPER_LOG_ERROR("%s: unsupported KV cache type %d\n", __func__, type);
+            return false;
+    }
+
+    if (type == GGML_TYPE_F32 && wctx.params.flash_attn) {
+        WHISPER_LOG_ERROR("%s: F32 KV cache is not supported with flash attention\n", __func__);
+        return false;
+    }
+
+    if ((hparams.n_text_state/hparams.n_text_head) % ggml_blck_size(type) != 0) {
+        WHISPER_LOG_ERROR("%s: the head size %d is not a multiple of the %s block size\n", __func__,
+                hparams.n_text_state/hparams.n_text_head, ggml_type_name(type));
+        return false;
+    }
+
+    type_k = type;
+    type_v = type;
+
+    if (ggml_is_quantized(type) && !wctx.params.flash_attn) {
+        type_v = GGML_TYPE_F16;
+    }
+
+    return true;
+}
+
 static void whisper_kv_cache_free(struct whisper_kv_cache & cache) {
     ggml_backend_buffer_free(cache.buffer);
 }
@@ -1074,21 +1688,61 @@ static bool whisper_kv_cache_find_slot(
         }
 
         if (n_tested >= n_ctx) {
-            //WHISPER_LOG_ERROR("%s: failed to find a slot for %d tokens\n", __func__, n_tokens);
-            return false;
+            break;
         }
     }
 
-    for (uint32_t i = 0; i < n_tokens; i++) {
-        cache.cells[cache.head + i].pos = batch.pos[i];
+    cache.runs.clear();
 
-        for (int32_t j = 0; j < batch.n_seq_id[i]; j++) {
-            cache.cells[cache.head + i].seq_id.insert(batch.seq_id[i][j]);
-        }
-    }
+    // no contiguous slot - scatter the batch over the free cells
+    // the number of runs is limited, since each run adds a copy to the graph for every layer
+    if (n_tested >= n_ctx) {
+        uint32_t n_found = 0;
 
-    return true;
-}
+        for (uint32_t i = 0; i < n_ctx && n_found < n_tokens; ++i) {
+            if (cache.cells[i].pos >= 0) {
+                continue;
+            }
+
+            if (!cache.runs.empty() && cache.runs.back().first + cache.runs.back().second == i) {
+                cache.runs.back().second++;
+            } else {
+                cache.runs.emplace_back(i, 1);
+            }
+
+            n_found++;
+        }
+
+        if (n_found < n_tokens || cache.runs.size() > WHISPER_MAX_DECODERS) {
+            //WHISPER_LOG_ERROR("%s: failed to find a slot for %d tokens\n", __func__, n_tokens);
+            cache.runs.clear();
+            return false;
+        }
+
+        cache.head = cache.runs[0].first;
+    }
+
+    for (uint32_t i = 0, ir = 0, ic = 0; i < n_tokens; i++) {
+        uint32_t cell = cache.head + i;
+
+        if (!cache.runs.empty()) {
+            if (ic == cache.runs[ir].second) {
+                ir++;
+                ic = 0;
+            }
+
+            cell = cache.runs[ir].first + ic++;
+        }
+
+        cache.cells[cell].pos = batch.pos[i];
+
+        for (int32_t j = 0; j < batch.n_seq_id[i]; j++) {
+            cache.cells[cell].seq_id.insert(batch.seq_id[i][j]);
+        }
+    }
+
+    return true;
+}
 
 // find how many cells are currently in use
 static int32_t whisper_kv_cache_cell_max(const struct whisper_kv_cache & cache) {
@@ -1141,6 +1795,21 @@ static void whisper_kv_cache_seq_rm(
     if (new_head != cache.size) cache.head = new_head;
 }
 
+// keep only the cells with pos < n_past and assign them to seq_id
+static void whisper_kv_cache_seq_keep_prefix(
+        struct whisper_kv_cache & cache,
+                 whisper_seq_id   seq_id,
+                    whisper_pos   n_past) {
+    whisper_kv_cache_seq_rm(cache, -1, n_past, -1);
+
+    for (uint32_t i = 0; i < cache.size; ++i) {
+        if (cache.cells[i].pos >= 0) {
+            cache.cells[i].seq_id.clear();
+            cache.cells[i].seq_id.insert(seq_id);
+        }
+    }
+}
+
 static void whisper_kv_cache_seq_cp(
         struct whisper_kv_cache & cache,
                  whisper_seq_id   seq_id_src,
@@ -1484,6 +2153,319 @@ static ggml_backend_buffer_type_t select_weight_buft(const whisper_hparams & hpa
     return nullptr;
 }
 
+// wraps a model loader and counts the bytes read through it, so that the tensor data can be located in the model file
+struct whisper_model_loader_pos {
+    whisper_model_loader * loader;
+    size_t pos;
+};
+
+static whisper_model_loader whisper_model_loader_counting(whisper_model_loader_pos & lpos) {
+    whisper_model_loader loader = {};
+
+    loader.context = &lpos;
+
+    loader.read = [](void * ctx, void * output, size_t read_size) {
+        whisper_model_loader_pos * lpos = (whisper_model_loader_pos *) ctx;
+
+        const size_t n = lpos->loader->read(lpos->loader->context, output, read_size);
+        lpos->pos += n;
+
+        return n;
+    };
+
+    loader.eof = [](void * ctx) {
+        whisper_model_loader_pos * lpos = (whisper_model_loader_pos *) ctx;
+        return lpos->loader->eof(lpos->loader->context);
+    };
+
+    loader.close = [](void * ctx) {
+        whisper_model_loader_pos * lpos = (whisper_model_loader_pos *) ctx;
+        lpos->loader->close(lpos->loader->context);
+    };
+
+    return loader;
+}
+
+// the location of the data of a model tensor in the model file
+struct whisper_tensor_loc {
+    ggml_tensor * tensor;
+    size_t        offs;
+};
+
+// index the tensor data of the model file wctx.path_model before loading it
+// GGUF models have the offsets in the tensor infos, legacy models have a header before each tensor, starting at offs
+static bool whisper_model_index(
+        const whisper_context & wctx,
+         const gguf_context * gguf,
+               ggml_context * gguf_meta,
+                       size_t   offs,
+  std::vector<whisper_tensor_loc> & index) {
+    const auto & model = wctx.model;
+
+    const whisper_mmap * mapping = wctx.mapping.get();
+
+    std::ifstream fin;
+
+    size_t size = 0;
+
+    if (mapping) {
+        size = mapping->size;
+    } else {
+        whisper_model_file_open(fin, wctx.path_model, std::ios::binary | std::ios::ate);
+        if (!fin) {
+            WHISPER_LOG_ERROR("%s: failed to open '%s'\n", __func__, wctx.path_model.c_str());
+            return false;
+        }
+
+        size = fin.tellg();
+    }
+
+    auto find_tensor = [&](const std::string & name) -> ggml_tensor * {
+        auto it = model.tensors.find(name);
+        if (it == model.tensors.end()) {
+            WHISPER_LOG_ERROR("%s: unknown tensor '%s' in model file\n", __func__, name.c_str());
+            return nullptr;
+        }
+
+        return it->second;
+    };
+
+    if (gguf) {
+        for (int64_t i = 0; i < gguf_get_n_tensors(gguf); ++i) {
+            const char * name = gguf_get_tensor_name(gguf, i);
+
+            ggml_tensor * tensor = find_tensor(name);
+            if (!tensor) {
+                return false;
+            }
+
+            const ggml_tensor * meta = ggml_get_tensor(gguf_meta, name);
+
+            if (meta->type != tensor->type || !ggml_are_same_shape(meta, tensor)) {
+                WHISPER_LOG_ERROR("%s: tensor '%s' has wrong type or shape in model file: got %s [%d, %d, %d], expected %s [%d, %d, %d]\n",
+                        __func__, name, ggml_type_name(meta->type), (int) meta->ne[0], (int) meta->ne[1], (int) meta->ne[2],
+                        ggml_type_name(tensor->type), (int) tensor->ne[0], (int) tensor->ne[1], (int) tensor->ne[2]);
+                return false;
+            }
+
+            const size_t offs_data = gguf_get_data_offset(gguf) + gguf_get_tensor_offset(gguf, i);
+
+            if (offs_data + ggml_nbytes(tensor) > size) {
+                WHISPER_LOG_ERROR("%s: tensor '%s' is truncated in model file\n", __func__, name);
+                return false;
+            }
+
+            index.push_back({ tensor, offs_data });
+        }
+
+        return true;
+    }
+
+    // read n bytes at offs from the mapping or the file
+    auto read = [&](void * dst, size_t n) {
+        if (offs + n > size) {
+            return false;
+        }
+
+        if (mapping) {
+            memcpy(dst, (const char *) mapping->addr + offs, n);
+        } else {
+            fin.seekg(offs);
+            fin.read((char *) dst, n);
+        }
+
+        offs += n;
+
+        return mapping || !!fin;
+    };
+
+    while (offs < size) {
+        int32_t hdr[3]; // n_dims, length, ttype
+
+        if (!read(hdr, sizeof(hdr))) {
+            break;
+        }
+
+        BYTESWAP_VALUE(hdr[0]);
+        BYTESWAP_VALUE(hdr[1]);
+        BYTESWAP_VALUE(hdr[2]);
+
+        const int32_t n_dims = hdr[0];
+        const int32_t length = hdr[1];
+        const int32_t ttype  = hdr[2];
+
+        if (n_dims < 0 || n_dims > 4 || length < 0 || ttype < 0 || ttype >= GGML_TYPE_COUNT) {
+            WHISPER_LOG_ERROR("%s: invalid tensor header in model file\n", __func__);
+            return false;
+        }
+
+        int32_t nelements = 1;
+        int32_t ne[4] = { 1, 1, 1, 1 };
+
+        std::string name(length, 0);
+
+        if (!read(ne, n_dims*sizeof(int32_t)) || !read(&name[0], length)) {
+            WHISPER_LOG_ERROR("%s: invalid tensor header in model file\n", __func__);
+            return false;
+        }
+
+        for (int i = 0; i < n_dims; ++i) {
+            BYTESWAP_VALUE(ne[i]);
+            nelements *= ne[i];
+        }
+
+        ggml_tensor * tensor = find_tensor(name);
+        if (!tensor) {
+            return false;
+        }
+
+        if (ggml_nelements(tensor) != nelements) {
+            WHISPER_LOG_ERROR("%s: tensor '%s' has wrong size in model file\n", __func__, name.data());
+            WHISPER_LOG_ERROR("%s: shape: [%d, %d, %d], expected: [%d, %d, %d]\n",
+                    __func__, ne[0], ne[1], ne[2], (int) tensor->ne[0], (int) tensor->ne[1], (int) tensor->ne[2]);
+            return false;
+        }
+
+        if (tensor->ne[0] != ne[0] || tensor->ne[1] != ne[1] || tensor->ne[2] != ne[2]) {
+            WHISPER_LOG_ERROR("%s: tensor '%s' has wrong shape in model file: got [%d, %d, %d], expected [%d, %d, %d]\n",
+                    __func__, name.data(), (int) tensor->ne[0], (int) tensor->ne[1], (int) tensor->ne[2], ne[0], ne[1], ne[2]);
+            return false;
+        }
+
+        const size_t bpe = ggml_type_size(ggml_type(ttype));
+
+        if ((nelements*bpe)/ggml_blck_size(tensor->type) != ggml_nbytes(tensor)) {
+            WHISPER_LOG_ERROR("%s: tensor '%s' has wrong size in model file: got %zu, expected %zu\n",
+                    __func__, name.data(), ggml_nbytes(tensor), nelements*bpe);
+            return false;
+        }
+
+        if (offs + ggml_nbytes(tensor) > size) {
+            WHISPER_LOG_ERROR("%s: tensor '%s' is truncated in model file\n", __func__, name.data());
+            return false;
+        }
+
+        index.push_back({ tensor, offs });
+
+        offs += ggml_nbytes(tensor);
+    }
+
+    return true;
+}
+
+// load the indexed tensors from the model file with up to n_threads threads
+// each thread reads whole tensors through its own file handle: the host tensors are read in place, the others are staged
+// and copied with ggml_backend_tensor_set - the copies to a device are serialized, so the other threads keep reading meanwhile
+static bool whisper_model_load_tensors(const whisper_context & wctx, const std::vector<whisper_tensor_loc> & index, bool swap, int n_threads) {
+    const whisper_mmap * mapping = wctx.mapping.get();
+
+    // the largest tensors first, so that the threads finish at about the same time
+    std::vector<size_t> order(index.size());
+    for (size_t i = 0; i < order.size(); ++i) {
+        order[i] = i;
+    }
+
+    std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+        return ggml_nbytes(index[a].tensor) > ggml_nbytes(index[b].tensor);
+    });
+
+    std::atomic<size_t> next(0);
+    std::atomic<bool>   failed(false);
+
+    std::mutex mutex_dev;
+
+    auto worker = [&]() {
+        std::ifstream fin;
+
+        if (!mapping) {
+            whisper_model_file_open(fin, wctx.path_model, std::ios::binary);
+            if (!fin) {
+                WHISPER_LOG_ERROR("%s: failed to open '%s'\n", __func__, wctx.path_model.c_str());
+                failed = true;
+                return;
+            }
+        }
+
+        std::vector<char> read_buf;
+
+        while (!failed) {
+            const size_t i = next++;
+            if (i >= order.size()) {
+                break;
+            }
+
+            ggml_tensor * tensor = index[order[i]].tensor;
+
+            const size_t offs   = index[order[i]].offs;
+            const size_t nbytes = ggml_nbytes(tensor);
+
+            const bool is_host = ggml_backend_buffer_is_host(tensor->buffer);
+
+            // the buffers of the extra CPU buffer types (e.g. repacked weights) can be set from several threads
+            ggml_backend_dev_t dev = ggml_backend_buft_get_device(ggml_backend_buffer_get_type(tensor->buffer));
+            const bool is_cpu = dev && ggml_backend_dev_type(dev) == GGML_BACKEND_DEVICE_TYPE_CPU;
+
+            const char * src = nullptr;
+
+            if (mapping) {
+                src = (const char *) mapping->addr + offs;
+
+                if (tensor->data == src) {
+                    // the tensor points into the mapped file
+                    continue;
+                }
+
+                if (is_host) {
+                    memcpy(tensor->data, src, nbytes);
+                }
+            } else {
+                if (!is_host) {
+                    read_buf.resize(nbytes);
+                }
+
+                char * dst = is_host ? (char *) tensor->data : read_buf.data();
+
+                fin.seekg(offs);
+                fin.read(dst, nbytes);
+
+                src = dst;
+
+                if (!fin) {
+                    WHISPER_LOG_ERROR("%s: tensor '%s' is truncated in model file\n", __func__, ggml_get_name(tensor));
+                    failed = true;
+                    break;
+                }
+            }
+
+            if (is_host) {
+                if (swap) {
+                    BYTESWAP_TENSOR(tensor);
+                }
+            } else if (is_cpu) {
+                ggml_backend_tensor_set(tensor, src, 0, nbytes);
+            } else {
+                std::lock_guard<std::mutex> lock(mutex_dev);
+                ggml_backend_tensor_set(tensor, src, 0, nbytes);
+            }
+        }
+    };
+
+    n_threads = std::max(1, std::min(n_threads, (int) index.size()));
+
+    std::vector<std::thread> workers;
+    for (int i = 1; i < n_threads; ++i) {
+        workers.emplace_back(worker);
+    }
+
+    worker();
+
+    for (auto & w : workers) {
+        w.join();
+    }
+
+    return !failed;
+}
+
 // load the model from a ggml file
 //
 // file format:
@@ -1498,6 +2480,11 @@ static ggml_backend_buffer_type_t select_weight_buft(const whisper_hparams & hpa
 static bool whisper_model_load(struct whisper_model_loader * loader, whisper_context & wctx) {
     WHISPER_LOG_INFO("%s: loading model\n", __func__);
 
+    whisper_model_loader_pos lpos = { loader, 0 };
+    whisper_model_loader loader_counting = whisper_model_loader_counting(lpos);
+
+    loader = &loader_counting;
+
     const int64_t t_start_us = ggml_time_us();
 
     wctx.t_start_us = t_start_us;
@@ -1505,18 +2492,43 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
     auto & model = wctx.model;
     auto & vocab = wctx.vocab;
 
+    // the GGUF header and the tensor infos, when the model is in the GGUF format
+    gguf_context_ptr gguf;
+    ggml_context_ptr gguf_meta;
+
     // verify magic
     {
         uint32_t magic;
         read_safe(loader, magic);
-        if (magic != GGML_FILE_MAGIC) {
+        if (memcmp(&magic, GGUF_MAGIC, sizeof(magic)) == 0) {
+            if (!whisper_gguf_open(wctx, gguf, gguf_meta)) {
+                return false;
+            }
+        } else if (magic != GGML_FILE_MAGIC) {
             WHISPER_LOG_ERROR("%s: invalid model data (bad magic)\n", __func__);
             return false;
         }
     }
 
     //load hparams
-    {
+    if (gguf) {
+        auto & hparams = model.hparams;
+
+        const asr_kv keys[] = {
+            ASR_KV_N_VOCAB, ASR_KV_N_AUDIO_CTX, ASR_KV_N_AUDIO_STATE, ASR_KV_N_AUDIO_HEAD, ASR_KV_N_AUDIO_LAYER,
+            ASR_KV_N_TEXT_CTX, ASR_KV_N_TEXT_STATE, ASR_KV_N_TEXT_HEAD, ASR_KV_N_TEXT_LAYER, ASR_KV_N_MELS, ASR_KV_FTYPE,
+        };
+        int32_t * dsts[] = {
+            &hparams.n_vocab, &hparams.n_audio_ctx, &hparams.n_audio_state, &hparams.n_audio_head, &hparams.n_audio_layer,
+            &hparams.n_text_ctx, &hparams.n_text_state, &hparams.n_text_head, &hparams.n_text_layer, &hparams.n_mels, &hparams.ftype,
+        };
+
+        for (size_t i = 0; i < sizeof(keys)/sizeof(keys[0]); ++i) {
+            if (!whisper_gguf_get_i32(gguf.get(), keys[i], *dsts[i])) {
+                return false;
+            }
+        }
+    } else {
         auto & hparams = model.hparams;
 
         read_safe(loader, hparams.n_vocab);
@@ -1530,6 +2542,10 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
         read_safe(loader, hparams.n_text_layer);
         read_safe(loader, hparams.n_mels);
         read_safe(loader, hparams.ftype);
+    }
+
+    {
+        auto & hparams = model.hparams;
 
         assert(hparams.n_text_state == hparams.n_audio_state);
 
@@ -1590,18 +2606,68 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
     {
         auto & filters = wctx.model.filters;
 
-        read_safe(loader, filters.n_mel);
-        read_safe(loader, filters.n_fft);
+        if (gguf) {
+            if (!whisper_gguf_get_i32(gguf.get(), ASR_KV_MEL_FILTERS_N_MEL, filters.n_mel) ||
+                !whisper_gguf_get_i32(gguf.get(), ASR_KV_MEL_FILTERS_N_FFT, filters.n_fft)) {
+                return false;
+            }
+
+            filters.data.resize(filters.n_mel * filters.n_fft);
+            if (!whisper_gguf_get_arr(gguf.get(), ASR_KV_MEL_FILTERS_DATA, GGUF_TYPE_FLOAT32, filters.data.data(), filters.data.size())) {
+                return false;
+            }
+        } else {
+            read_safe(loader, filters.n_mel);
+            read_safe(loader, filters.n_fft);
+
+            filters.data.resize(filters.n_mel * filters.n_fft);
+            loader->read(loader->context, filters.data.data(), filters.data.size() * sizeof(float));
+            BYTESWAP_FILTERS(filters);
+        }
+
+        whisper_filters_init_sparse(filters);
 
-        filters.data.resize(filters.n_mel * filters.n_fft);
-        loader->read(loader->context, filters.data.data(), filters.data.size() * sizeof(float));
-        BYTESWAP_FILTERS(filters);
+        WHISPER_LOG_DEBUG("%s: mel filters: %d x %d, %zu nonzero\n", __func__, filters.n_mel, filters.n_fft, filters.sparse.size());
     }
 
     // load vocab
     {
         int32_t n_vocab = 0;
-        read_safe(loader, n_vocab);
+
+        // the token lengths and bytes of the GGUF vocab
+        std::vector<uint32_t> gguf_len;
+        std::vector<char>     gguf_data;
+        size_t                gguf_off = 0;
+
+        if (gguf) {
+            const int64_t kid_len  = gguf_find_key(gguf.get(), ASR_KV_NAMES.at(ASR_KV_VOCAB_LEN));
+            const int64_t kid_data = gguf_find_key(gguf.get(), ASR_KV_NAMES.at(ASR_KV_VOCAB_DATA));
+            if (kid_len < 0 || kid_data < 0) {
+                WHISPER_LOG_ERROR("%s: the vocab is missing in the GGUF model\n", __func__);
+                return false;
+            }
+
+            gguf_len.resize(gguf_get_arr_n(gguf.get(), kid_len));
+            gguf_data.resize(gguf_get_arr_n(gguf.get(), kid_data));
+
+            if (!whisper_gguf_get_arr(gguf.get(), ASR_KV_VOCAB_LEN,  GGUF_TYPE_UINT32, gguf_len.data(),  gguf_len.size()) ||
+                !whisper_gguf_get_arr(gguf.get(), ASR_KV_VOCAB_DATA, GGUF_TYPE_UINT8,  gguf_data.data(), gguf_data.size())) {
+                return false;
+            }
+
+            size_t n_bytes = 0;
+            for (uint32_t len : gguf_len) {
+                n_bytes += len;
+            }
+            if (n_bytes != gguf_data.size()) {
+                WHISPER_LOG_ERROR("%s: invalid vocab in the GGUF model (%zu bytes, expected %zu)\n", __func__, gguf_data.size(), n_bytes);
+                return false;
+            }
+
+            n_vocab = gguf_len.size();
+        } else {
+            read_safe(loader, n_vocab);
+        }
 
         //if (n_vocab != model.hparams.n_vocab) {
         //    WHISPER_LOG_ERROR("%s: invalid model file '%s' (bad vocab size %d != %d)\n",
@@ -1615,6 +2681,15 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
         tmp.reserve(128);
 
         for (int i = 0; i < n_vocab; i++) {
+            if (gguf) {
+                word.assign(gguf_data.data() + gguf_off, gguf_len[i]);
+                gguf_off += gguf_len[i];
+
+                vocab.token_to_id[word] = i;
+                vocab.id_to_token[i] = word;
+                continue;
+            }
+
             uint32_t len;
             read_safe(loader, len);
 
@@ -1858,95 +2933,168 @@ static bool whisper_model_load(struct whisper_model_loader * loader, whisper_con
         ggml_free(ctx);
     }
 
-    // allocate tensors in the backend buffers
-    for (auto & p : ctx_map) {
-        ggml_backend_buffer_type_t buft = p.first;
-        ggml_context * ctx = p.second;
-        ggml_backend_buffer_t buf = ggml_backend_alloc_ctx_tensors_from_buft(ctx, buft);
-        if (buf) {
-            model.buffers.emplace_back(buf);
-
-            size_t size_main = ggml_backend_buffer_get_size(buf);
-            WHISPER_LOG_INFO("%s: %12s total size = %8.2f MB\n", __func__, ggml_backend_buffer_name(buf), size_main / 1e6);
-        }
-    }
+    whisper_mmap * mapping = wctx.mapping.get();
 
-    // load weights
-    {
-        size_t total_size = 0;
+    // when loading from a file, index the tensor data first and load the tensors in parallel below
+    // models from a buffer or a custom loader are read sequentially
+    const bool indexed = !wctx.path_model.empty();
 
-        model.n_loaded = 0;
+    std::vector<whisper_tensor_loc> index;
 
-        std::vector<char> read_buf;
+    if (indexed && !whisper_model_index(wctx, gguf.get(), gguf_meta.get(), lpos.pos, index)) {
+        return false;
+    }
 
-        while (true) {
-            int32_t n_dims;
-            int32_t length;
-            int32_t ttype;
+    // the tensors that can point directly into the mapped file: F32 needs 4 byte alignment, F16 and the quantized blocks need 2
+    std::map<ggml_tensor *, size_t> mapped_offs;
 
-            read_safe(loader, n_dims);
-            read_safe(loader, length);
-            read_safe(loader, ttype);
+    if (mapping) {
+        for (const auto & loc : index) {
+            const size_t align = ggml_type_size(loc.tensor->type) % 4 == 0 ? 4 : 2;
 
-            if (loader->eof(loader->context)) {
-                break;
+            if (loc.offs % align == 0) {
+                mapped_offs[loc.tensor] = loc.offs;
             }
+        }
+    }
 
-            int32_t nelements = 1;
-            int32_t ne[4] = { 1, 1, 1, 1 };
-            for (int i = 0; i < n_dims; ++i) {
-                read_safe(loader, ne[i]);
-                nelements *= ne[i];
+    // allocate tensors in the backend buffers
+    for (auto & p : ctx_map) {
+        ggml_backend_buffer_type_t buft = p.first;
+        ggml_context * ctx = p.second;
+
+        // the CPU weights point directly into the mapped file, the rest is allocated below
+        if (mapping && buft == ggml_backend_cpu_buffer_type()) {
+            ggml_backend_buffer_t buf = ggml_backend_cpu_buffer_from_ptr(mapping->addr, mapping->size);
+
+            int    n_mapped    = 0;
+            size_t size_mapped = 0;
+
+            for (ggml_tensor * t = ggml_get_first_tensor(ctx); t != nullptr; t = ggml_get_next_tensor(ctx, t)) {
+                auto it = mapped_offs.find(t);
+                if (it == mapped_offs.end()) {
+                    continue;
+                }
+
+                if (ggml_backend_tensor_alloc(buf, t, (char *) mapping->addr + it->second) != GGML_STATUS_SUCCESS) {
+                    WHISPER_LOG_ERROR("%s: failed to map tensor\n", __func__);
+                    ggml_backend_buffer_free(buf);
+                    return false;
+                }
+
+                n_mapped++;
+                size_mapped += ggml_nbytes(t);
             }
 
-            std::string name;
-            std::vector<char> tmp(length); // create a buffer
-            loader->read(loader->context, &tmp[0], tmp.size()); // read to buffer
-            name.assign(&tmp[0], tmp.size());
+            if (n_mapped > 0) {
+                model.buffers.emplace_back(buf);
 
-            if (model.tensors.find(name) == model.tensors.end()) {
-                WHISPER_LOG_ERROR("%s: unknown tensor '%s' in model file\n", __func__, name.data());
-                return false;
+                WHISPER_LOG_INFO("%s: %12s mapped size = %8.2f MB (%d tensors)\n", __func__, ggml_backend_buffer_name(buf), size_mapped / 1e6, n_mapped);
+            } else {
+                ggml_backend_buffer_free(buf);
             }
+        }
+
+        ggml_backend_buffer_t buf = ggml_backend_alloc_ctx_tensors_from_buft(ctx, buft);
+        if (buf) {
+            model.buffers.emplace_back(buf);
+
+            size_t size_main = ggml_backend_buffer_get_size(buf);
+            WHISPER_LOG_INFO("%s: %12s total size = %8.2f MB\n", __func__, ggml_backend_buffer_name(buf), size_main / 1e6);
+        }
+    }
+
+    // load weights
+    {
+        size_t total_size = 0;
+
+        model.n_loaded = 0;
 
-            auto tensor = model.tensors[name.data()];
+        if (indexed) {
+            // more threads than this do not help with the disk bandwidth
+            const int n_threads = std::min(8, (int) std::thread::hardware_concurrency());
 
-            if (ggml_nelements(tensor) != nelements) {
-                WHISPER_LOG_ERROR("%s: tensor '%s' has wrong size in model file\n", __func__, name.data());
-                WHISPER_LOG_ERROR("%s: shape: [%d, %d, %d], expected: [%d, %d, %d]\n",
-                        __func__, ne[0], ne[1], ne[2], (int) tensor->ne[0], (int) tensor->ne[1], (int) tensor->ne[2]);
+            if (!whisper_model_load_tensors(wctx, index, !gguf, n_threads)) {
                 return false;
             }
 
-            if (tensor->ne[0] != ne[0] || tensor->ne[1] != ne[1] || tensor->ne[2] != ne[2]) {
-                WHISPER_LOG_ERROR("%s: tensor '%s' has wrong shape in model file: got [%d, %d, %d], expected [%d, %d, %d]\n",
-                        __func__, name.data(), (int) tensor->ne[0], (int) tensor->ne[1], (int) tensor->ne[2], ne[0], ne[1], ne[2]);
-                return false;
+            for (const auto & loc : index) {
+                total_size += ggml_nbytes(loc.tensor);
             }
 
-            const size_t bpe = ggml_type_size(ggml_type(ttype));
+            model.n_loaded = index.size();
+        } else {
+            std::vector<char> read_buf;
 
-            if ((nelements*bpe)/ggml_blck_size(tensor->type) != ggml_nbytes(tensor)) {
-                WHISPER_LOG_ERROR("%s: tensor '%s' has wrong size in model file: got %zu, expected %zu\n",
-                        __func__, name.data(), ggml_nbytes(tensor), nelements*bpe);
-                return false;
-            }
+            while (true) {
+                int32_t n_dims;
+                int32_t length;
+                int32_t ttype;
 
-            if (ggml_backend_buffer_is_host(tensor->buffer)) {
-                // for the CPU and Metal backend, we can read directly into the tensor
-                loader->read(loader->context, tensor->data, ggml_nbytes(tensor));
-                BYTESWAP_TENSOR(tensor);
-            } else {
-                // read into a temporary buffer first, then copy to device memory
-                read_buf.resize(ggml_nbytes(tensor));
+                read_safe(loader, n_dims);
+                read_safe(loader, length);
+                read_safe(loader, ttype);
+
+                if (loader->eof(loader->context)) {
+                    break;
+                }
 
-                loader->read(loader->context, read_buf.data(), read_buf.size());
+                int32_t nelements = 1;
+                int32_t ne[4] = { 1, 1, 1, 1 };
+                for (int i = 0; i < n_dims; ++i) {
+                    read_safe(loader, ne[i]);
+                    nelements *= ne[i];
+                }
 
-                ggml_backend_tensor_set(tensor, read_buf.data(), 0, ggml_nbytes(tensor));
-            }
+                std::string name;
+                std::vector<char> tmp(length); // create a buffer
+                loader->read(loader->context, &tmp[0], tmp.size()); // read to buffer
+                name.assign(&tmp[0], tmp.size());
+
+                if (model.tensors.find(name) == model.tensors.end()) {
+                    WHISPER_LOG_ERROR("%s: unknown tensor '%s' in model file\n", __func__, name.data());
+                    return false;
+                }
+
+                auto tensor = model.tensors[name.data()];
+
+                if (ggml_nelements(tensor) != nelements) {
+                    WHISPER_LOG_ERROR("%s: tensor '%s' has wrong size in model file\n", __func__, name.data());
+                    WHISPER_LOG_ERROR("%s: shape: [%d, %d, %d], expected: [%d, %d, %d]\n",
+                            __func__, ne[0], ne[1], ne[2], (int) tensor->ne[0], (int) tensor->ne[1], (int) tensor->ne[2]);
+                    return false;
+                }
+
+                if (tensor->ne[0] != ne[0] || tensor->ne[1] != ne[1] || tensor->ne[2] != ne[2]) {
+                    WHISPER_LOG_ERROR("%s: tensor '%s' has wrong shape in model file: got [%d, %d, %d], expected [%d, %d, %d]\n",
+                            __func__, name.data(), (int) tensor->ne[0], (int) tensor->ne[1], (int) tensor->ne[2], ne[0], ne[1], ne[2]);
+                    return false;
+                }
+
+                const size_t bpe = ggml_type_size(ggml_type(ttype));
 
-            total_size += ggml_nbytes(tensor);
-            model.n_loaded++;
+                if ((nelements*bpe)/ggml_blck_size(tensor->type) != ggml_nbytes(tensor)) {
+                    WHISPER_LOG_ERROR("%s: tensor '%s' has wrong size in model file: got %zu, expected %zu\n",
+                            __func__, name.data(), ggml_nbytes(tensor), nelements*bpe);
+                    return false;
+                }
+
+                if (ggml_backend_buffer_is_host(tensor->buffer)) {
+                    // for the CPU and Metal backend, we can read directly into the tensor
+                    loader->read(loader->context, tensor->data, ggml_nbytes(tensor));
+                    BYTESWAP_TENSOR(tensor);
+                } else {
+                    // read into a temporary buffer first, then copy to device memory
+                    read_buf.resize(ggml_nbytes(tensor));
+
+                    loader->read(loader->context, read_buf.data(), read_buf.size());
+
+                    ggml_backend_tensor_set(tensor, read_buf.data(), 0, ggml_nbytes(tensor));
+                }
+
+                total_size += ggml_nbytes(tensor);
+                model.n_loaded++;
+            }
         }
 
         WHISPER_LOG_INFO("%s: model size    = %7.2f MB\n", __func__, total_size/1e6);
@@ -1986,9 +3134,11 @@ static bool whisper_encode_external(const whisper_state & wstate) {
     return use_coreml || use_openvino;
 }
 
+// with n_batch > 1, the mel spectrograms of n_batch windows are convolved at once (see whisper_encode_batch)
 static struct ggml_cgraph * whisper_build_graph_conv(
         whisper_context & wctx,
-          whisper_state & wstate) {
+          whisper_state & wstate,
+              const int   n_batch = 1) {
     const auto & model   = wctx.model;
     const auto & hparams = model.hparams;
 
@@ -2007,21 +3157,30 @@ static struct ggml_cgraph * whisper_build_graph_conv(
 
     ggml_cgraph * gf = ggml_new_graph(ctx0);
 
-    struct ggml_tensor * mel = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, 2*n_ctx, n_mels);
+    struct ggml_tensor * mel = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, 2*n_ctx, n_mels, n_batch);
     ggml_set_name(mel, "mel");
     ggml_set_input(mel);
 
     struct ggml_tensor * cur = nullptr;
 
     if (!whisper_encode_external(wstate)) {
+        // ggml_conv_1d returns the output of a batched input as [n_len, n_batch, n_state] - reorder it to [n_len, n_state, n_batch]
+        auto conv_batch = [&](struct ggml_tensor * x) {
+            if (n_batch == 1) {
+                return x;
+            }
+
+            return ggml_cont(ctx0, ggml_permute(ctx0, ggml_reshape_3d(ctx0, x, x->ne[0], n_batch, x->ne[1]), 0, 2, 1, 3));
+        };
+
         // convolution + gelu
         {
-            cur = ggml_conv_1d_ph(ctx0, model.e_conv_1_w, mel, 1, 1);
+            cur = conv_batch(ggml_conv_1d_ph(ctx0, model.e_conv_1_w, mel, 1, 1));
             cur = ggml_add(ctx0, cur, model.e_conv_1_b);
 
             cur = ggml_gelu(ctx0, cur);
 
-            cur = ggml_conv_1d_ph(ctx0, model.e_conv_2_w, cur, 2, 1);
+            cur = conv_batch(ggml_conv_1d_ph(ctx0, model.e_conv_2_w, cur, 2, 1));
             cur = ggml_add(ctx0, cur, model.e_conv_2_b);
 
             cur = ggml_gelu(ctx0, cur);
@@ -2050,7 +3209,8 @@ static struct ggml_cgraph * whisper_build_graph_conv(
 
 static struct ggml_cgraph * whisper_build_graph_encoder(
         whisper_context & wctx,
-          whisper_state & wstate) {
+          whisper_state & wstate,
+              const int   n_batch = 1) {
     const auto & model   = wctx.model;
     const auto & hparams = model.hparams;
 
@@ -2099,7 +3259,13 @@ static struct ggml_cgraph * whisper_build_graph_encoder(
     const size_t e_pe_offset = model.e_pe->ne[0]*ggml_element_size(model.e_pe)*n_ctx*iter;
 
     struct ggml_tensor * e_pe = ggml_view_2d(ctx0, model.e_pe, model.e_pe->ne[0], n_ctx, e_pe_stride, e_pe_offset);
-    cur = ggml_add(ctx0, e_pe, ggml_cont(ctx0, ggml_transpose(ctx0, cur)));
+    if (n_batch == 1) {
+        cur = ggml_add(ctx0, e_pe, ggml_cont(ctx0, ggml_transpose(ctx0, cur)));
+    } else {
+        // the windows are stacked along the rows, so that all linear layers run as a single matrix multiplication
+        cur = ggml_add(ctx0, ggml_cont(ctx0, ggml_transpose(ctx0, cur)), e_pe);
+        cur = ggml_reshape_2d(ctx0, cur, n_state, n_ctx*n_batch);
+    }
 
     // ===================================================================
 
@@ -2148,25 +3314,54 @@ static struct ggml_cgraph * whisper_build_graph_encoder(
 
             struct ggml_tensor * Q =
                 ggml_permute(ctx0,
-                        ggml_reshape_3d(ctx0, Qcur, n_state_head, n_head, n_ctx),
+                        ggml_reshape_4d(ctx0, Qcur, n_state_head, n_head, n_ctx, n_batch),
                         0, 2, 1, 3);
 
-            if (wctx.params.flash_attn) {
+            if (wctx.params.flash_attn && n_batch > 1) {
+                // kv_pad only fits a single window - pad the batched K and V in the graph instead
+                struct ggml_tensor * K =
+                    ggml_cast(ctx0,
+                            ggml_pad(ctx0, ggml_reshape_3d(ctx0, Kcur, n_state, n_ctx, n_batch), 0, n_ctx_pad - n_ctx, 0, 0),
+                            wctx.itype);
+
+                struct ggml_tensor * V =
+                    ggml_cast(ctx0,
+                            ggml_pad(ctx0, ggml_reshape_3d(ctx0, Vcur, n_state, n_ctx, n_batch), 0, n_ctx_pad - n_ctx, 0, 0),
+                            wctx.itype);
+
+                K = ggml_view_4d(ctx0, K,
+                        n_state_head, n_ctx_pad, n_head, n_batch,
+                        ggml_element_size(K)*n_state,
+                        ggml_element_size(K)*n_state_head,
+                        ggml_element_size(K)*n_state*n_ctx_pad,
+                        0);
+
+                V = ggml_view_4d(ctx0, V,
+                        n_state_head, n_ctx_pad, n_head, n_batch,
+                        ggml_element_size(V)*n_state,
+                        ggml_element_size(V)*n_state_head,
+                        ggml_element_size(V)*n_state*n_ctx_pad,
+                        0);
+
+                cur = ggml_flash_attn_ext(ctx0, Q, K, V, nullptr, KQscale, 0.0f, 0.0f);
+
+                cur = ggml_reshape_2d(ctx0, cur, n_state, n_ctx*n_batch);
+            } else if (wctx.params.flash_attn) {
                 ggml_build_forward_expand(gf, ggml_cpy(ctx0, Kcur, ggml_view_1d(ctx0, kv_pad.k, n_ctx*n_state, 0)));
                 ggml_build_forward_expand(gf, ggml_cpy(ctx0, Vcur, ggml_view_1d(ctx0, kv_pad.v, n_ctx*n_state, 0)));
 
                 struct ggml_tensor * K =
                     ggml_view_3d(ctx0, kv_pad.k,
                             n_state_head, n_ctx_pad, n_head,
-                            ggml_element_size(kv_pad.k)*n_state,
-                            ggml_element_size(kv_pad.k)*n_state_head,
+                            ggml_row_size(kv_pad.k->type, n_state),
+                            ggml_row_size(kv_pad.k->type, n_state_head),
                             0);
 
                 struct ggml_tensor * V =
                     ggml_view_3d(ctx0, kv_pad.v,
                             n_state_head, n_ctx_pad, n_head,
-                            ggml_element_size(kv_pad.v)*n_state,
-                            ggml_element_size(kv_pad.v)*n_state_head,
+                            ggml_row_size(kv_pad.v->type, n_state),
+                            ggml_row_size(kv_pad.v->type, n_state_head),
                             0);
 
                 cur = ggml_flash_attn_ext(ctx0, Q, K, V, nullptr, KQscale, 0.0f, 0.0f);
@@ -2176,7 +3371,7 @@ static struct ggml_cgraph * whisper_build_graph_encoder(
                 struct ggml_tensor * K =
                     ggml_permute(ctx0,
                             ggml_cast(ctx0,
-                                ggml_reshape_3d(ctx0, Kcur, n_state_head, n_head, n_ctx),
+                                ggml_reshape_4d(ctx0, Kcur, n_state_head, n_head, n_ctx, n_batch),
                                 wctx.itype),
                             0, 2, 1, 3);
 
@@ -2188,9 +3383,9 @@ static struct ggml_cgraph * whisper_build_graph_encoder(
                 struct ggml_tensor * V =
                     ggml_cast(ctx0,
                             ggml_permute(ctx0,
-                                ggml_reshape_3d(ctx0,
+                                ggml_reshape_4d(ctx0,
                                     Vcur,
-                                    n_state_head, n_head, n_ctx),
+                                    n_state_head, n_head, n_ctx, n_batch),
                                 1, 2, 0, 3),
                             wctx.itype);
 
@@ -2198,7 +3393,7 @@ static struct ggml_cgraph * whisper_build_graph_encoder(
 
                 struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
 
-                cur = ggml_cont_2d(ctx0, KQV_merged, n_state, n_ctx);
+                cur = ggml_cont_2d(ctx0, KQV_merged, n_state, n_ctx*n_batch);
             }
         }
 
@@ -2282,9 +3477,14 @@ static struct ggml_cgraph * whisper_build_graph_encoder(
 }
 
 // pre-compute cross-attention memory
+//
+// with n_batch > 1, the embd_enc of wstate holds n_batch encoded windows and the
+// cross-attention memory of the i-th window is stored in the kv_cross of wstates[i]
 static struct ggml_cgraph * whisper_build_graph_cross(
         whisper_context & wctx,
-          whisper_state & wstate) {
+          whisper_state & wstate,
+         whisper_state ** wstates = nullptr,
+              const int   n_batch = 1) {
     const auto & model   = wctx.model;
     const auto & hparams = model.hparams;
 
@@ -2304,7 +3504,7 @@ static struct ggml_cgraph * whisper_build_graph_cross(
 
     struct ggml_context * ctx0 = ggml_init(params);
 
-    ggml_cgraph * gf = ggml_new_graph(ctx0);
+    ggml_cgraph * gf = ggml_new_graph_custom(ctx0, WHISPER_MAX_NODES, false);
 
     struct ggml_tensor * cur = ggml_view_tensor(ctx0, wstate.embd_enc);
 
@@ -2327,28 +3527,40 @@ static struct ggml_cgraph * whisper_build_graph_cross(
                     Vcross,
                     layer.cross_attn_v_b);
 
-        struct ggml_tensor * k;
-        struct ggml_tensor * v;
+        for (int ib = 0; ib < n_batch; ++ib) {
+            auto & kv_cross = wstates ? wstates[ib]->kv_cross : wstate.kv_cross;
 
-        if (wctx.params.flash_attn) {
-            k = ggml_view_1d(ctx0, wstate.kv_cross.k, n_state*n_ctx,
-                    (ggml_element_size(wstate.kv_cross.k)*n_state)*(il*n_ctx_pad));
+            struct ggml_tensor * Kcur = Kcross;
+            struct ggml_tensor * Vcur = Vcross;
 
-            v = ggml_view_1d(ctx0, wstate.kv_cross.v, n_state*n_ctx,
-                    (ggml_element_size(wstate.kv_cross.v)*n_state)*(il*n_ctx_pad));
-        } else {
-            Vcross = ggml_transpose(ctx0, ggml_reshape_2d(ctx0, Vcross, n_state, n_ctx));
+            if (n_batch > 1) {
+                Kcur = ggml_view_2d(ctx0, Kcross, n_state, n_ctx, Kcross->nb[1], ib*n_ctx*Kcross->nb[1]);
+                Vcur = ggml_view_2d(ctx0, Vcross, n_state, n_ctx, Vcross->nb[1], ib*n_ctx*Vcross->nb[1]);
+            }
 
-            k = ggml_view_1d(ctx0, wstate.kv_cross.k, n_state*n_ctx,
-                    (ggml_element_size(wstate.kv_cross.k)*n_state)*(il*n_ctx));
+            struct ggml_tensor * k;
+            struct ggml_tensor * v;
 
-            v = ggml_view_2d(ctx0, wstate.kv_cross.v, n_ctx, n_state,
-                    (   n_ctx)*ggml_element_size(wstate.kv_cross.v),
-                    (il*n_ctx)*ggml_element_size(wstate.kv_cross.v)*n_state);
-        }
+            if (wctx.params.flash_attn) {
+                k = ggml_view_1d(ctx0, kv_cross.k, n_state*n_ctx,
+                        ggml_row_size(kv_cross.k->type, n_state)*(il*n_ctx_pad));
+
+                v = ggml_view_1d(ctx0, kv_cross.v, n_state*n_ctx,
+                        ggml_row_size(kv_cross.v->type, n_state)*(il*n_ctx_pad));
+            } else {
+                Vcur = ggml_transpose(ctx0, ggml_reshape_2d(ctx0, Vcur, n_state, n_ctx));
 
-        ggml_build_forward_expand(gf, ggml_cpy(ctx0, Kcross, k));
-        ggml_build_forward_expand(gf, ggml_cpy(ctx0, Vcross, v));
+                k = ggml_view_1d(ctx0, kv_cross.k, n_state*n_ctx,
+                        ggml_row_size(kv_cross.k->type, n_state)*(il*n_ctx));
+
+                v = ggml_view_2d(ctx0, kv_cross.v, n_ctx, n_state,
+                        (   n_ctx)*ggml_element_size(kv_cross.v),
+                        (il*n_ctx)*ggml_element_size(kv_cross.v)*n_state);
+            }
+
+            ggml_build_forward_expand(gf, ggml_cpy(ctx0, Kcur, k));
+            ggml_build_forward_expand(gf, ggml_cpy(ctx0, Vcur, v));
+        }
     }
 
     //ggml_graph_print(gf);
@@ -2358,6 +3570,53 @@ static struct ggml_cgraph * whisper_build_graph_cross(
     return gf;
 }
 
+// [EXPERIMENTAL] the encoder scheduler for the current audio context
+//
+// the sizes chosen by the automatic audio context get their own compute buffer, allocated the first time they
+// are used, so that alternating between them does not re-plan the allocation of the default one
+// must be called after the conv graph has been evaluated, since the encoder graph depends on its output
+static whisper_sched * whisper_sched_encode_get(whisper_context & wctx, whisper_state & wstate) {
+    if (!wstate.exp_n_audio_ctx_auto || wstate.exp_n_audio_ctx <= 0) {
+        return &wstate.sched_encode;
+    }
+
+    auto it = wstate.sched_encode_auto.find(wstate.exp_n_audio_ctx);
+    if (it != wstate.sched_encode_auto.end()) {
+        return &it->second;
+    }
+
+    auto & allocr = wstate.sched_encode_auto[wstate.exp_n_audio_ctx];
+
+    const bool ok = whisper_sched_graph_init(allocr, wstate.backends,
+            [&]() {
+                return whisper_build_graph_encoder(wctx, wstate);
+            });
+
+    // the graphs are always built in the meta buffer of sched_encode
+    allocr.meta.clear();
+    allocr.meta.shrink_to_fit();
+
+    if (!ok) {
+        WHISPER_LOG_ERROR("%s: failed to init encoder allocator for audio_ctx = %d\n", __func__, wstate.exp_n_audio_ctx);
+        ggml_backend_sched_free(allocr.sched);
+        wstate.sched_encode_auto.erase(wstate.exp_n_audio_ctx);
+        return nullptr;
+    }
+
+    WHISPER_LOG_DEBUG("%s: compute buffer (encode, audio_ctx = %d) = %7.2f MB\n", __func__, wstate.exp_n_audio_ctx, whisper_sched_size(allocr) / 1e6);
+
+    return &allocr;
+}
+
+// [EXPERIMENTAL] the audio context for a window with n_frames mel frames left
+// rounded up to a multiple of WHISPER_AUDIO_CTX_BUCKET, 0 means the full audio context of the model
+static int whisper_audio_ctx_auto(const whisper_context & wctx, int n_frames) {
+    const int n_audio_ctx = wctx.model.hparams.n_audio_ctx;
+    const int n_ctx       = GGML_PAD(std::max(1, (n_frames + 1)/2), WHISPER_AUDIO_CTX_BUCKET);
+
+    return n_ctx < n_audio_ctx ? n_ctx : 0;
+}
+
 // evaluate the encoder with the given state
 //
 // given audio recording (more specifically, its log mel spectrogram), runs forward pass of the encoder
@@ -2377,6 +3636,9 @@ static bool whisper_encode_internal(
                    void * abort_callback_data) {
     const int64_t t_start_us = ggml_time_us();
 
+    wstate.enc_mel_offset = -1;
+    wstate.kv_self_prompt.clear();
+
     // conv
     {
         auto & sched = wstate.sched_conv.sched;
@@ -2400,23 +3662,15 @@ static bool whisper_encode_internal(
 
             wstate.inp_mel.resize(ggml_nelements(mel));
 
-            float * dst = wstate.inp_mel.data();
-            memset(dst, 0, ggml_nbytes(mel));
-
-            const int i0 = std::min(mel_offset,           mel_inp.n_len);
-            const int i1 = std::min(mel_offset + 2*n_ctx, mel_inp.n_len);
+            whisper_mel_lazy_window(wctx, wstate, mel_offset, 2*n_ctx, n_threads);
 
-            for (int j = 0; j < mel_inp.n_mel; ++j) {
-                for (int i = i0; i < i1; ++i) {
-                    dst[j*2*n_ctx + (i - i0)] = mel_inp.data[j*mel_inp.n_len + i];
-                }
-            }
+            whisper_mel_copy(mel_inp, mel_offset, 2*n_ctx, wstate.inp_mel.data());
 
             ggml_backend_tensor_set(mel, wstate.inp_mel.data(), 0, ggml_nelements(mel)*sizeof(float));
         }
 
         if (!whisper_encode_external(wstate)) {
-            if (!ggml_graph_compute_helper(sched, gf, n_threads)) {
+            if (!ggml_graph_compute_helper(sched, gf, n_threads, wstate.threadpool)) {
                 return false;
             }
         } else {
@@ -2430,7 +3684,12 @@ static bool whisper_encode_internal(
 
     // encoder
     if (!whisper_encode_external(wstate)) {
-        auto & sched = wstate.sched_encode.sched;
+        whisper_sched * allocr = whisper_sched_encode_get(wctx, wstate);
+        if (allocr == nullptr) {
+            return false;
+        }
+
+        auto & sched = allocr->sched;
 
         ggml_cgraph * gf = whisper_build_graph_encoder(wctx, wstate);
 
@@ -2439,7 +3698,7 @@ static bool whisper_encode_internal(
             return false;
         }
 
-        if (!ggml_graph_compute_helper(sched, gf, n_threads)) {
+        if (!ggml_graph_compute_helper(sched, gf, n_threads, wstate.threadpool)) {
             return false;
         }
     }
@@ -2455,7 +3714,7 @@ static bool whisper_encode_internal(
             return false;
         }
 
-        if (!ggml_graph_compute_helper(sched, gf, n_threads)) {
+        if (!ggml_graph_compute_helper(sched, gf, n_threads, wstate.threadpool)) {
             return false;
         }
     }
@@ -2463,9 +3722,167 @@ static bool whisper_encode_internal(
     wstate.t_encode_us += ggml_time_us() - t_start_us;
     wstate.n_encode++;
 
+    wstate.enc_mel_offset  = mel_offset;
+    wstate.enc_n_audio_ctx = wstate.exp_n_audio_ctx;
+
     return !(abort_callback && abort_callback(abort_callback_data));
 }
 
+// evaluate the encoder for multiple states at once
+//
+// the windows are stacked along an extra batch dimension of the conv, encoder and cross graphs, so
+// that the weights are read once per batch. the compute buffers of the first state are used for the
+// graphs and the cross-attention memory is stored in the kv_cross of each state
+//
+//   - wctx:       the model
+//   - wstates:    the states to encode - must all use the same audio context
+//   - mel_offset: offset in the mel spectrogram of each state
+//   - n_batch:    number of states
+//   - n_threads:  number of threads to use
+//
+static bool whisper_encode_batch_internal(
+        whisper_context & wctx,
+         whisper_state ** wstates,
+              const int * mel_offset,
+              const int   n_batch,
+              const int   n_threads) {
+    const int64_t t_start_us = ggml_time_us();
+
+    auto & wstate = *wstates[0];
+
+    for (int ib = 0; ib < n_batch; ++ib) {
+        wstates[ib]->enc_mel_offset = -1;
+        wstates[ib]->kv_self_prompt.clear();
+    }
+
+    // conv
+    {
+        auto & sched = wstate.sched_conv.sched;
+
+        ggml_cgraph * gf = whisper_build_graph_conv(wctx, wstate, n_batch);
+
+        if (!ggml_backend_sched_alloc_graph(sched, gf)) {
+            return false;
+        }
+
+        struct ggml_tensor * mel = ggml_graph_get_tensor(gf, "mel");
+
+        // set the input
+        {
+            const int n_ctx = wstate.exp_n_audio_ctx > 0 ? wstate.exp_n_audio_ctx : wctx.model.hparams.n_audio_ctx;
+
+            assert(mel->type == GGML_TYPE_F32);
+
+            wstate.inp_mel.resize(ggml_nelements(mel));
+
+            float * dst = wstate.inp_mel.data();
+
+            for (int ib = 0; ib < n_batch; ++ib) {
+                const auto & mel_inp = wstates[ib]->mel;
+
+                assert(mel_inp.n_mel == wctx.model.hparams.n_mels);
+
+                whisper_mel_lazy_window(wctx, *wstates[ib], mel_offset[ib], 2*n_ctx, n_threads);
+
+                whisper_mel_copy(mel_inp, mel_offset[ib], 2*n_ctx, dst + ib*mel_inp.n_mel*2*n_ctx);
+            }
+
+            ggml_backend_tensor_set(mel, wstate.inp_mel.data(), 0, ggml_nelements(mel)*sizeof(float));
+        }
+
+        if (!ggml_graph_compute_helper(sched, gf, n_threads, wstate.threadpool)) {
+            return false;
+        }
+    }
+
+    // encoder
+    {
+        auto & sched = wstate.sched_encode.sched;
+
+        ggml_cgraph * gf = whisper_build_graph_encoder(wctx, wstate, n_batch);
+
+        if (!ggml_backend_sched_alloc_graph(sched, gf)) {
+            return false;
+        }
+
+        if (!ggml_graph_compute_helper(sched, gf, n_threads, wstate.threadpool)) {
+            return false;
+        }
+    }
+
+    // cross
+    {
+        auto & sched = wstate.sched_cross.sched;
+
+        ggml_cgraph * gf = whisper_build_graph_cross(wctx, wstate, wstates, n_batch);
+
+        if (!ggml_backend_sched_alloc_graph(sched, gf)) {
+            return false;
+        }
+
+        if (!ggml_graph_compute_helper(sched, gf, n_threads, wstate.threadpool)) {
+            return false;
+        }
+    }
+
+    // split the time evenly between the states
+    const int64_t t_encode_us = (ggml_time_us() - t_start_us)/n_batch;
+
+    for (int ib = 0; ib < n_batch; ++ib) {
+        wstates[ib]->t_encode_us += t_encode_us;
+        wstates[ib]->n_encode++;
+
+        wstates[ib]->enc_mel_offset  = mel_offset[ib];
+        wstates[ib]->enc_n_audio_ctx = wstates[ib]->exp_n_audio_ctx;
+    }
+
+    return true;
+}
+
+// store the K and V of the batch in the cells reserved by whisper_kv_cache_find_slot
+//
+//   - Kcur: [n_state, n_tokens]
+//   - Vcur: [n_state, n_tokens]
+//
+// the cells are contiguous starting at kv_head, unless the batch was scattered over several runs of free cells
+//
+static void whisper_kv_cache_store(
+        struct ggml_context * ctx0,
+        struct ggml_cgraph  * gf,
+    const whisper_kv_cache  & kv,
+        struct ggml_tensor  * Kcur,
+        struct ggml_tensor  * Vcur,
+                        int   il,
+                        int   n_tokens,
+                    int32_t   kv_head,
+                       bool   scattered,
+                       bool   flash_attn) {
+    std::vector<std::pair<uint32_t, uint32_t>> runs;
+    if (scattered && !kv.runs.empty()) {
+        runs = kv.runs;
+    } else {
+        runs.emplace_back(kv_head, n_tokens);
+    }
+
+    whisper_kv_cache_store_runs(ctx0, gf, kv.k, kv.v, kv.size, Kcur, Vcur, il, n_tokens, runs, flash_attn);
+}
+
+// the rows of the batch for which logits are computed (see batch.logits)
+// if no row is flagged, the last one is used so that the graph has an output
+static void whisper_batch_out_ids(const whisper_batch & batch, std::vector<int32_t> & out_ids) {
+    out_ids.clear();
+
+    for (int i = 0; i < batch.n_tokens; ++i) {
+        if (batch.logits[i]) {
+            out_ids.push_back(i);
+        }
+    }
+
+    if (out_ids.empty()) {
+        out_ids.push_back(batch.n_tokens - 1);
+    }
+}
+
 static struct ggml_cgraph * whisper_build_graph_decoder(
          whisper_context & wctx,
          whisper_state   & wstate,
@@ -2577,28 +3994,7 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
                             Vcur,
                             layer.attn_v_b);
 
-                struct ggml_tensor * k;
-                struct ggml_tensor * v;
-
-                if (wctx.params.flash_attn) {
-                    k = ggml_view_1d(ctx0, kv_self.k, n_tokens*n_state,
-                            (ggml_element_size(kv_self.k)*n_state)*(il*n_ctx + kv_head));
-
-                    v = ggml_view_1d(ctx0, kv_self.v, n_tokens*n_state,
-                            (ggml_element_size(kv_self.v)*n_state)*(il*n_ctx + kv_head));
-                } else {
-                    Vcur = ggml_transpose(ctx0, ggml_reshape_2d(ctx0, Vcur, n_state, n_tokens));
-
-                    k = ggml_view_1d(ctx0, kv_self.k, n_tokens*n_state,
-                            (ggml_element_size(kv_self.k)*n_state)*(il*n_ctx + kv_head));
-
-                    v = ggml_view_2d(ctx0, kv_self.v, n_tokens, n_state,
-                            (   n_ctx)*ggml_element_size(kv_self.v),
-                            (il*n_ctx)*ggml_element_size(kv_self.v)*n_state + kv_head*ggml_element_size(kv_self.v));
-                }
-
-                ggml_build_forward_expand(gf, ggml_cpy(ctx0, Kcur, k));
-                ggml_build_forward_expand(gf, ggml_cpy(ctx0, Vcur, v));
+                whisper_kv_cache_store(ctx0, gf, kv_self, Kcur, Vcur, il, n_tokens, kv_head, !worst_case, wctx.params.flash_attn);
             }
 
             // ------
@@ -2611,17 +4007,17 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
             struct ggml_tensor * K =
                 ggml_view_3d(ctx0, kv_self.k,
                         n_state_head, n_kv, n_head,
-                        ggml_element_size(kv_self.k)*n_state,
-                        ggml_element_size(kv_self.k)*n_state_head,
-                        ggml_element_size(kv_self.k)*n_state*n_ctx*il);
+                        ggml_row_size(kv_self.k->type, n_state),
+                        ggml_row_size(kv_self.k->type, n_state_head),
+                        ggml_row_size(kv_self.k->type, n_state)*n_ctx*il);
 
             if (wctx.params.flash_attn) {
                 struct ggml_tensor * V =
                     ggml_view_3d(ctx0, kv_self.v,
                             n_state_head, n_kv, n_head,
-                            ggml_element_size(kv_self.v)*n_state,
-                            ggml_element_size(kv_self.v)*n_state_head,
-                            ggml_element_size(kv_self.v)*n_state*n_ctx*il);
+                            ggml_row_size(kv_self.v->type, n_state),
+                            ggml_row_size(kv_self.v->type, n_state_head),
+                            ggml_row_size(kv_self.v->type, n_state)*n_ctx*il);
 
                 cur = ggml_flash_attn_ext(ctx0, Q, K, V, KQ_mask_f16, 1.0f, 0.0f, 0.0f);
 
@@ -2692,16 +4088,16 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
                 struct ggml_tensor * Kcross =
                     ggml_view_3d(ctx0, wstate.kv_cross.k,
                             n_state_head, n_audio_ctx_pad, n_head,
-                            ggml_element_size(wstate.kv_cross.k)*n_state,
-                            ggml_element_size(wstate.kv_cross.k)*n_state_head,
-                            ggml_element_size(wstate.kv_cross.k)*n_state*n_audio_ctx_pad*il);
+                            ggml_row_size(wstate.kv_cross.k->type, n_state),
+                            ggml_row_size(wstate.kv_cross.k->type, n_state_head),
+                            ggml_row_size(wstate.kv_cross.k->type, n_state)*n_audio_ctx_pad*il);
 
                 struct ggml_tensor * Vcross =
                     ggml_view_3d(ctx0, wstate.kv_cross.v,
                             n_state_head, n_audio_ctx_pad, n_head,
-                            ggml_element_size(wstate.kv_cross.v)*n_state,
-                            ggml_element_size(wstate.kv_cross.v)*n_state_head,
-                            ggml_element_size(wstate.kv_cross.v)*n_state*n_audio_ctx_pad*il);
+                            ggml_row_size(wstate.kv_cross.v->type, n_state),
+                            ggml_row_size(wstate.kv_cross.v->type, n_state_head),
+                            ggml_row_size(wstate.kv_cross.v->type, n_state)*n_audio_ctx_pad*il);
 
                 cur = ggml_flash_attn_ext(ctx0, Q, Kcross, Vcross, nullptr, KQscale, 0.0f, 0.0f);
 
@@ -2710,9 +4106,9 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
                 struct ggml_tensor * Kcross =
                     ggml_view_3d(ctx0, wstate.kv_cross.k,
                             n_state_head, n_audio_ctx, n_head,
-                            ggml_element_size(wstate.kv_cross.k)*n_state,
-                            ggml_element_size(wstate.kv_cross.k)*n_state_head,
-                            ggml_element_size(wstate.kv_cross.k)*n_state*n_audio_ctx*il);
+                            ggml_row_size(wstate.kv_cross.k->type, n_state),
+                            ggml_row_size(wstate.kv_cross.k->type, n_state_head),
+                            ggml_row_size(wstate.kv_cross.k->type, n_state)*n_audio_ctx*il);
 
                 struct ggml_tensor * Vcross =
                     ggml_view_3d(ctx0, wstate.kv_cross.v,
@@ -2811,6 +4207,20 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
 
     cur = inpL;
 
+    // compute logits only for the rows that are used (see batch.logits)
+    // the worst case computes the logits for all n_tokens
+    if (!worst_case) {
+        whisper_batch_out_ids(batch, wstate.inp_out_ids);
+
+        if ((int) wstate.inp_out_ids.size() < n_tokens) {
+            struct ggml_tensor * out_ids = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, wstate.inp_out_ids.size());
+            ggml_set_name(out_ids, "out_ids");
+            ggml_set_input(out_ids);
+
+            cur = ggml_get_rows(ctx0, cur, out_ids);
+        }
+    }
+
     // norm
     {
         cur = ggml_norm(ctx0, cur, hparams.eps);
@@ -2822,11 +4232,6 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
                 model.d_ln_b);
     }
 
-    // compute logits only for the last token
-    // comment this line to compute logits for all n_tokens
-    // might be useful in the future
-    //cur = ggml_view_2d(ctx0, cur, cur->ne[0], 1, cur->nb[1], (cur->ne[1] - 1)*cur->nb[1]);
-
     struct ggml_tensor * logits = ggml_mul_mat(ctx0, model.d_te, cur);
 
     // [EXPERIMENTAL] Token-level timestamps with DTW
@@ -2846,6 +4251,34 @@ static struct ggml_cgraph * whisper_build_graph_decoder(
     return gf;
 }
 
+// fill the KQ mask for the tokens of a batch - each token attends to the cells of its sequence up to its position
+// the mask has n_kv columns and the rows are padded to GGML_KQ_MASK_PAD
+static void whisper_kv_cache_fill_mask(const whisper_kv_cache & kv_self, const whisper_batch & batch, float * data) {
+    const int32_t n_kv     = kv_self.n;
+    const int32_t n_tokens = batch.n_tokens;
+
+    memset(data, 0, GGML_PAD(n_tokens, GGML_KQ_MASK_PAD)*n_kv*sizeof(float));
+
+    for (int h = 0; h < 1; ++h) {
+        for (int j = 0; j < n_tokens; ++j) {
+            const whisper_pos    pos    = batch.pos[j];
+            const whisper_seq_id seq_id = batch.seq_id[j][0];
+
+            for (int i = 0; i < n_kv; ++i) {
+                if (!kv_self.cells[i].has_seq_id(seq_id) || kv_self.cells[i].pos > pos) {
+                    data[h*(n_kv*n_tokens) + j*n_kv + i] = -INFINITY;
+                }
+            }
+        }
+
+        for (int i = n_tokens; i < GGML_PAD(n_tokens, GGML_KQ_MASK_PAD); ++i) {
+            for (int j = 0; j < n_kv; ++j) {
+                data[h*(n_kv*n_tokens) + i*n_kv + j] = -INFINITY;
+            }
+        }
+    }
+}
+
 // evaluate the decoder
 //
 // given text prompt + audio features -> computes the logits for the next token
@@ -2919,50 +4352,37 @@ static bool whisper_decode_internal(
         {
             struct ggml_tensor * KQ_mask = ggml_graph_get_tensor(gf, "KQ_mask");
 
-            auto & kv_self = wstate.kv_self;
-
-            const int32_t n_kv = kv_self.n;
-
             wstate.inp_mask.resize(ggml_nelements(KQ_mask));
 
-            float * data = wstate.inp_mask.data();
-            memset(data, 0, ggml_nbytes(KQ_mask));
-
-            for (int h = 0; h < 1; ++h) {
-                for (int j = 0; j < n_tokens; ++j) {
-                    const whisper_pos    pos    = batch.pos[j];
-                    const whisper_seq_id seq_id = batch.seq_id[j][0];
+            whisper_kv_cache_fill_mask(wstate.kv_self, batch, wstate.inp_mask.data());
 
-                    for (int i = 0; i < n_kv; ++i) {
-                        if (!kv_self.cells[i].has_seq_id(seq_id) || kv_self.cells[i].pos > pos) {
-                            data[h*(n_kv*n_tokens) + j*n_kv + i] = -INFINITY;
-                        }
-                    }
-                }
+            ggml_backend_tensor_set(KQ_mask, wstate.inp_mask.data(), 0, ggml_nelements(KQ_mask)*sizeof(float));
+        }
 
-                for (int i = n_tokens; i < GGML_PAD(n_tokens, GGML_KQ_MASK_PAD); ++i) {
-                    for (int j = 0; j < n_kv; ++j) {
-                        data[h*(n_kv*n_tokens) + i*n_kv + j] = -INFINITY;
-                    }
-                }
+        {
+            struct ggml_tensor * out_ids = ggml_graph_get_tensor(gf, "out_ids");
+            if (out_ids) {
+                ggml_backend_tensor_set(out_ids, wstate.inp_out_ids.data(), 0, ggml_nbytes(out_ids));
             }
-
-            ggml_backend_tensor_set(KQ_mask, wstate.inp_mask.data(), 0, ggml_nelements(KQ_mask)*sizeof(float));
         }
 
         logits = ggml_graph_node(gf, -1);
 
-        if (!ggml_graph_compute_helper(sched, gf, n_threads)) {
+        if (!ggml_graph_compute_helper(sched, gf, n_threads, wstate.threadpool)) {
             return false;
         }
     }
 
+    // with the gather in the graph, the k-th row of the logits belongs to the token inp_out_ids[k]
+    const bool gathered = (int) wstate.inp_out_ids.size() < n_tokens;
+
     logits_out.resize(n_tokens*n_vocab);
-    for (int i = 0; i < n_tokens; i++) {
+    for (int k = 0; k < (int) wstate.inp_out_ids.size(); ++k) {
+        const int i = wstate.inp_out_ids[k];
         if (batch.logits[i] == 0) {
             continue;
         }
-        ggml_backend_tensor_get(logits, logits_out.data() + (n_vocab*i), sizeof(float)*(n_vocab*i), sizeof(float)*n_vocab);
+        ggml_backend_tensor_get(logits, logits_out.data() + (n_vocab*i), sizeof(float)*(n_vocab*(gathered ? k : i)), sizeof(float)*n_vocab);
     }
 
     if (batch.n_tokens > 1) {
@@ -2988,976 +4408,2351 @@ static bool whisper_decode_internal(
     return !(abort_callback && abort_callback(abort_callback_data));
 }
 
-//  500 -> 00:05.000
-// 6000 -> 01:00.000
-static std::string to_timestamp(int64_t t, bool comma = false) {
-    int64_t msec = t * 10;
-    int64_t hr = msec / (1000 * 60 * 60);
-    msec = msec - hr * (1000 * 60 * 60);
-    int64_t min = msec / (1000 * 60);
+// continuous batching of the decoder across states (see whisper_decode_sched_init)
+struct whisper_decode_sched {
+    whisper_context * ctx = nullptr;
+
+    int n_states_max = 0;
+    int graph_size   = 0;
+
+    std::vector<ggml_backend_t> backends;
+
+    whisper_threadpool threadpool;
+
+    whisper_sched sched;
+
+    // admitted states and the states with queued tokens for the next step
+    std::vector<whisper_state *> states;
+    std::vector<whisper_state *> queued;
+
+    // helpers for GPU offloading
+    std::vector<whisper_token> inp_embd;
+    std::vector<int32_t>       inp_pos;
+    std::vector<int32_t>       inp_out_ids;
+    std::vector<float>         inp_mask;
+};
+
+// build a single decoder graph for the queued tokens of multiple states
+//
+// the batches of the states are stacked along the rows, so that the linear layers and the MLP read the
+// model weights once for all states. the self- and cross-attention are evaluated separately for each state,
+// using its own KV caches. only the logits of the last token of each state are computed
+static struct ggml_cgraph * whisper_build_graph_decoder_multi(
+            whisper_context & wctx,
+       whisper_decode_sched & dsched) {
+    const auto & model   = wctx.model;
+    const auto & hparams = model.hparams;
+
+    const auto & wstates = dsched.queued;
+
+    const int n_state = hparams.n_text_state;
+    const int n_head  = hparams.n_text_head;
+    const int n_layer = hparams.n_text_layer;
+
+    const int n_state_head = n_state/n_head;
+
+    const int n_seq = wstates.size();
+
+    // offsets of the tokens of each state in the stacked batch
+    std::vector<int> i_tok(n_seq + 1, 0);
+    for (int s = 0; s < n_seq; ++s) {
+        i_tok[s + 1] = i_tok[s] + wstates[s]->batch.n_tokens;
+    }
+
+    const int n_tokens = i_tok[n_seq];
+
+    struct ggml_init_params params = {
+        /*.mem_size   =*/ dsched.sched.meta.size(),
+        /*.mem_buffer =*/ dsched.sched.meta.data(),
+        /*.no_alloc   =*/ true,
+    };
+
+    struct ggml_context * ctx0 = ggml_init(params);
+
+    ggml_cgraph * gf = ggml_new_graph_custom(ctx0, dsched.graph_size, false);
+
+    struct ggml_tensor * embd = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
+    ggml_set_name(embd, "embd");
+    ggml_set_input(embd);
+
+    struct ggml_tensor * position = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_tokens);
+    ggml_set_name(position, "position");
+    ggml_set_input(position);
+
+    struct ggml_tensor * out_ids = ggml_new_tensor_1d(ctx0, GGML_TYPE_I32, n_seq);
+    ggml_set_name(out_ids, "out_ids");
+    ggml_set_input(out_ids);
+
+    std::vector<struct ggml_tensor *> KQ_mask(n_seq);
+
+    for (int s = 0; s < n_seq; ++s) {
+        KQ_mask[s] = ggml_new_tensor_3d(ctx0, GGML_TYPE_F32, wstates[s]->kv_self.n, GGML_PAD(i_tok[s + 1] - i_tok[s], GGML_KQ_MASK_PAD), 1);
+        ggml_format_name(KQ_mask[s], "KQ_mask_%d", s);
+        ggml_set_input(KQ_mask[s]);
+
+        if (wctx.params.flash_attn) {
+            KQ_mask[s] = ggml_cast(ctx0, KQ_mask[s], GGML_TYPE_F16);
+        }
+    }
+
+    // the rows of the stacked batch that belong to state s
+    auto rows = [&](struct ggml_tensor * t, int s) {
+        return ggml_view_2d(ctx0, t, t->ne[0], i_tok[s + 1] - i_tok[s], t->nb[1], i_tok[s]*t->nb[1]);
+    };
+
+    // stack the per-state results back into a single batch
+    auto stack = [&](std::vector<struct ggml_tensor *> cur_s) {
+        while (cur_s.size() > 1) {
+            std::vector<struct ggml_tensor *> next;
+            for (size_t i = 0; i < cur_s.size(); i += 2) {
+                next.push_back(i + 1 < cur_s.size() ? ggml_concat(ctx0, cur_s[i], cur_s[i + 1], 1) : cur_s[i]);
+            }
+            cur_s.swap(next);
+        }
+
+        return cur_s[0];
+    };
+
+    const float KQscale = pow(float(n_state_head), -0.25);
+
+    // token encoding + position encoding
+    struct ggml_tensor * cur =
+        ggml_add(ctx0,
+                ggml_get_rows(ctx0, model.d_te, embd),
+                ggml_get_rows(ctx0, model.d_pe, position));
+
+    struct ggml_tensor * inpL = cur;
+
+    std::vector<struct ggml_tensor *> cur_s(n_seq);
+
+    for (int il = 0; il < n_layer; ++il) {
+        const auto & layer = model.layers_decoder[il];
+
+        // norm
+        {
+            cur = ggml_norm(ctx0, inpL, hparams.eps);
+
+            // cur = ln_0_w*cur + ln_0_b
+            cur = ggml_add(ctx0,
+                    ggml_mul(ctx0,
+                        cur,
+                        layer.attn_ln_0_w),
+                    layer.attn_ln_0_b);
+        }
+
+        // self-attention
+        {
+            struct ggml_tensor * Qcur = ggml_mul_mat(ctx0,
+                    layer.attn_q_w,
+                    cur);
+
+            Qcur = ggml_add(ctx0,
+                        Qcur,
+                        layer.attn_q_b);
+
+            Qcur = ggml_scale(ctx0, Qcur, KQscale);
+
+            // note: no bias for Key
+            struct ggml_tensor * Kcur = ggml_mul_mat(ctx0,
+                    layer.attn_k_w,
+                    cur);
+
+            Kcur = ggml_scale(ctx0, Kcur, KQscale);
+
+            struct ggml_tensor * Vcur = ggml_mul_mat(ctx0,
+                    layer.attn_v_w,
+                    cur);
+
+            Vcur = ggml_add(ctx0,
+                        Vcur,
+                        layer.attn_v_b);
+
+            for (int s = 0; s < n_seq; ++s) {
+                const auto & kv_self = wstates[s]->kv_self;
+
+                const int n_ctx      = kv_self.size;
+                const int n_kv       = kv_self.n;
+                const int kv_head    = kv_self.head;
+                const int n_tokens_s = i_tok[s + 1] - i_tok[s];
+
+                // store key and value to memory
+                whisper_kv_cache_store(ctx0, gf, kv_self, rows(Kcur, s), rows(Vcur, s), il, n_tokens_s, kv_head, true, wctx.params.flash_attn);
+
+                struct ggml_tensor * Q =
+                    ggml_permute(ctx0,
+                            ggml_reshape_3d(ctx0, rows(Qcur, s), n_state_head, n_head, n_tokens_s),
+                            0, 2, 1, 3);
+
+                struct ggml_tensor * K =
+                    ggml_view_3d(ctx0, kv_self.k,
+                            n_state_head, n_kv, n_head,
+                            ggml_row_size(kv_self.k->type, n_state),
+                            ggml_row_size(kv_self.k->type, n_state_head),
+                            ggml_row_size(kv_self.k->type, n_state)*n_ctx*il);
+
+                if (wctx.params.flash_attn) {
+                    struct ggml_tensor * V =
+                        ggml_view_3d(ctx0, kv_self.v,
+                                n_state_head, n_kv, n_head,
+                                ggml_row_size(kv_self.v->type, n_state),
+                                ggml_row_size(kv_self.v->type, n_state_head),
+                                ggml_row_size(kv_self.v->type, n_state)*n_ctx*il);
+
+                    cur_s[s] = ggml_flash_attn_ext(ctx0, Q, K, V, KQ_mask[s], 1.0f, 0.0f, 0.0f);
+
+                    cur_s[s] = ggml_reshape_2d(ctx0, cur_s[s], n_state, n_tokens_s);
+                } else {
+                    // K * Q
+                    struct ggml_tensor * KQ = ggml_mul_mat(ctx0, K, Q);
+
+                    struct ggml_tensor * KQ_soft_max = ggml_soft_max_ext(ctx0, KQ, KQ_mask[s], 1.0f, 0.0f);
+
+                    struct ggml_tensor * V =
+                        ggml_view_3d(ctx0, kv_self.v,
+                                n_kv, n_state_head, n_head,
+                                n_ctx*ggml_element_size(kv_self.v),
+                                n_ctx*ggml_element_size(kv_self.v)*n_state_head,
+                                n_ctx*ggml_element_size(kv_self.v)*n_state*il);
+
+                    struct ggml_tensor * KQV = ggml_mul_mat(ctx0, V, KQ_soft_max);
+
+                    struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+
+                    cur_s[s] = ggml_cont_2d(ctx0, KQV_merged, n_state, n_tokens_s);
+                }
+            }
+
+            cur = stack(cur_s);
+        }
+
+        // projection
+        {
+            cur = ggml_mul_mat(ctx0,
+                    layer.attn_ln_1_w,
+                    cur);
+
+            cur = ggml_add(ctx0,
+                    cur,
+                    layer.attn_ln_1_b);
+        }
+
+        // add the input
+        struct ggml_tensor * inpCA = ggml_add(ctx0, cur, inpL);
+
+        // norm
+        {
+            cur = ggml_norm(ctx0, inpCA, hparams.eps); // note: we use inpCA here
+
+            // cur = ln_0_w*cur + ln_0_b
+            cur = ggml_add(ctx0,
+                    ggml_mul(ctx0,
+                        cur,
+                        layer.cross_attn_ln_0_w),
+                    layer.cross_attn_ln_0_b);
+        }
+
+        // cross-attention
+        {
+            struct ggml_tensor * Qcur = ggml_mul_mat(ctx0,
+                    layer.cross_attn_q_w,
+                    cur);
+
+            Qcur = ggml_add(ctx0,
+                        Qcur,
+                        layer.cross_attn_q_b);
+
+            for (int s = 0; s < n_seq; ++s) {
+                const auto & kv_cross = wstates[s]->kv_cross;
+
+                const int n_audio_ctx     = wstates[s]->exp_n_audio_ctx > 0 ? wstates[s]->exp_n_audio_ctx : hparams.n_audio_ctx;
+                const int n_audio_ctx_pad = GGML_PAD(n_audio_ctx, 256);
+                const int n_tokens_s      = i_tok[s + 1] - i_tok[s];
+
+                struct ggml_tensor * Q =
+                    ggml_permute(ctx0,
+                            ggml_reshape_3d(ctx0, rows(Qcur, s), n_state_head, n_head, n_tokens_s),
+                            0, 2, 1, 3);
+
+                if (wctx.params.flash_attn) {
+                    struct ggml_tensor * Kcross =
+                        ggml_view_3d(ctx0, kv_cross.k,
+                                n_state_head, n_audio_ctx_pad, n_head,
+                                ggml_row_size(kv_cross.k->type, n_state),
+                                ggml_row_size(kv_cross.k->type, n_state_head),
+                                ggml_row_size(kv_cross.k->type, n_state)*n_audio_ctx_pad*il);
+
+                    struct ggml_tensor * Vcross =
+                        ggml_view_3d(ctx0, kv_cross.v,
+                                n_state_head, n_audio_ctx_pad, n_head,
+                                ggml_row_size(kv_cross.v->type, n_state),
+                                ggml_row_size(kv_cross.v->type, n_state_head),
+                                ggml_row_size(kv_cross.v->type, n_state)*n_audio_ctx_pad*il);
+
+                    cur_s[s] = ggml_flash_attn_ext(ctx0, Q, Kcross, Vcross, nullptr, KQscale, 0.0f, 0.0f);
+
+                    cur_s[s] = ggml_reshape_2d(ctx0, cur_s[s], n_state, n_tokens_s);
+                } else {
+                    struct ggml_tensor * Kcross =
+                        ggml_view_3d(ctx0, kv_cross.k,
+                                n_state_head, n_audio_ctx, n_head,
+                                ggml_row_size(kv_cross.k->type, n_state),
+                                ggml_row_size(kv_cross.k->type, n_state_head),
+                                ggml_row_size(kv_cross.k->type, n_state)*n_audio_ctx*il);
+
+                    struct ggml_tensor * Vcross =
+                        ggml_view_3d(ctx0, kv_cross.v,
+                                n_audio_ctx, n_state_head, n_head,
+                                n_audio_ctx*ggml_element_size(kv_cross.v),
+                                n_audio_ctx*ggml_element_size(kv_cross.v)*n_state_head,
+                                n_audio_ctx*ggml_element_size(kv_cross.v)*n_state*il);
+
+                    // K * Q
+                    struct ggml_tensor * KQ = ggml_mul_mat(ctx0, Kcross, Q);
+
+                    struct ggml_tensor * KQ_soft_max = ggml_soft_max_ext(ctx0, KQ, nullptr, KQscale, 0.0f);
+
+                    struct ggml_tensor * KQV = ggml_mul_mat(ctx0, Vcross, KQ_soft_max);
+
+                    struct ggml_tensor * KQV_merged = ggml_permute(ctx0, KQV, 0, 2, 1, 3);
+
+                    cur_s[s] = ggml_cont_2d(ctx0, KQV_merged, n_state, n_tokens_s);
+                }
+            }
+
+            cur = stack(cur_s);
+        }
+
+        // projection
+        {
+            cur = ggml_mul_mat(ctx0,
+                    layer.cross_attn_ln_1_w,
+                    cur);
+
+            cur = ggml_add(ctx0,
+                    cur,
+                    layer.cross_attn_ln_1_b);
+        }
+
+        // add the input
+        cur = ggml_add(ctx0, cur, inpCA);
+
+        struct ggml_tensor * inpFF = cur;
+
+        // feed-forward network
+        {
+            // norm
+            {
+                cur = ggml_norm(ctx0, inpFF, hparams.eps);
+
+                // cur = mlp_ln_w*cur + mlp_ln_b
+                cur = ggml_add(ctx0,
+                        ggml_mul(ctx0,
+                            cur,
+                            layer.mlp_ln_w),
+                        layer.mlp_ln_b);
+            }
+
+            // fully connected
+            cur = ggml_mul_mat(ctx0,
+                    layer.mlp_0_w,
+                    cur);
+
+            cur = ggml_add(ctx0,
+                    cur,
+                    layer.mlp_0_b);
+
+            // GELU activation
+            cur = ggml_gelu(ctx0, cur);
+
+            // projection
+            cur = ggml_mul_mat(ctx0,
+                    layer.mlp_1_w,
+                    cur);
+
+            cur = ggml_add(ctx0,
+                    cur,
+                    layer.mlp_1_b);
+        }
+
+        inpL = ggml_add(ctx0, cur, inpFF);
+    }
+
+    // keep only the last token of each state
+    cur = ggml_get_rows(ctx0, inpL, out_ids);
+
+    // norm
+    {
+        cur = ggml_norm(ctx0, cur, hparams.eps);
+
+        cur = ggml_add(ctx0,
+                ggml_mul(ctx0,
+                    cur,
+                    model.d_ln_w),
+                model.d_ln_b);
+    }
+
+    struct ggml_tensor * logits = ggml_mul_mat(ctx0, model.d_te, cur);
+
+    ggml_build_forward_expand(gf, logits);
+
+    ggml_free(ctx0);
+
+    return gf;
+}
+
+// evaluate the queued tokens of all states in a single decoder pass
+static bool whisper_decode_sched_eval(
+     whisper_decode_sched & dsched,
+                const int   n_threads) {
+    const int64_t t_start_us = ggml_time_us();
+
+    auto & wctx = *dsched.ctx;
+
+    const auto & wstates = dsched.queued;
+
+    const int n_vocab = wctx.model.hparams.n_vocab;
+    const int n_seq   = wstates.size();
+
+    // find KV slot for the batch of each state
+    for (auto * wstate : wstates) {
+        auto & kv_self = wstate->kv_self;
+
+        if (!whisper_kv_cache_find_slot(kv_self, wstate->batch)) {
+            return false;
+        }
+
+        const uint32_t pad = whisper_kv_cache_get_padding(wctx);
+        kv_self.n = std::min(kv_self.size, std::max(pad, GGML_PAD(whisper_kv_cache_cell_max(kv_self), pad)));
+    }
+
+    auto & sched = dsched.sched.sched;
+
+    ggml_cgraph * gf = whisper_build_graph_decoder_multi(wctx, dsched);
+
+    if (!ggml_backend_sched_alloc_graph(sched, gf)) {
+        return false;
+    }
+
+    // set the inputs
+    {
+        dsched.inp_embd.clear();
+        dsched.inp_pos.clear();
+        dsched.inp_out_ids.clear();
+
+        for (auto * wstate : wstates) {
+            const auto & batch = wstate->batch;
+
+            dsched.inp_embd.insert(dsched.inp_embd.end(), batch.token, batch.token + batch.n_tokens);
+            dsched.inp_pos .insert(dsched.inp_pos .end(), batch.pos,   batch.pos   + batch.n_tokens);
+
+            dsched.inp_out_ids.push_back(dsched.inp_embd.size() - 1);
+        }
+
+        struct ggml_tensor * embd = ggml_graph_get_tensor(gf, "embd");
+        ggml_backend_tensor_set(embd, dsched.inp_embd.data(), 0, ggml_nbytes(embd));
+
+        struct ggml_tensor * position = ggml_graph_get_tensor(gf, "position");
+        ggml_backend_tensor_set(position, dsched.inp_pos.data(), 0, ggml_nbytes(position));
+
+        struct ggml_tensor * out_ids = ggml_graph_get_tensor(gf, "out_ids");
+        ggml_backend_tensor_set(out_ids, dsched.inp_out_ids.data(), 0, ggml_nbytes(out_ids));
+    }
+
+    for (int s = 0; s < n_seq; ++s) {
+        struct ggml_tensor * KQ_mask = ggml_graph_get_tensor(gf, format("KQ_mask_%d", s).c_str());
+
+        dsched.inp_mask.resize(ggml_nelements(KQ_mask));
+
+        whisper_kv_cache_fill_mask(wstates[s]->kv_self, wstates[s]->batch, dsched.inp_mask.data());
+
+        ggml_backend_tensor_set(KQ_mask, dsched.inp_mask.data(), 0, ggml_nbytes(KQ_mask));
+    }
+
+    struct ggml_tensor * logits = ggml_graph_node(gf, -1);
+
+    if (!ggml_graph_compute_helper(sched, gf, n_threads, dsched.threadpool)) {
+        return false;
+    }
+
+    // split the time evenly between the states
+    const int64_t t_decode_us = (ggml_time_us() - t_start_us)/n_seq;
+
+    for (int s = 0; s < n_seq; ++s) {
+        auto & wstate = *wstates[s];
+
+        const int n_tokens = wstate.batch.n_tokens;
+
+        wstate.logits.resize(n_tokens*n_vocab);
+        ggml_backend_tensor_get(logits, wstate.logits.data() + n_vocab*(n_tokens - 1), sizeof(float)*n_vocab*s, sizeof(float)*n_vocab);
+
+        if (n_tokens == 1) {
+            wstate.t_decode_us += t_decode_us;
+            wstate.n_decode++;
+        } else if (n_tokens < 16) {
+            wstate.t_batchd_us += t_decode_us;
+            wstate.n_batchd += n_tokens;
+        } else {
+            wstate.t_prompt_us += t_decode_us;
+            wstate.n_prompt += n_tokens;
+        }
+    }
+
+    return true;
+}
+
+//  500 -> 00:05.000
+// 6000 -> 01:00.000
+static std::string to_timestamp(int64_t t, bool comma = false) {
+    int64_t msec = t * 10;
+    int64_t hr = msec / (1000 * 60 * 60);
+    msec = msec - hr * (1000 * 60 * 60);
+    int64_t min = msec / (1000 * 60);
     msec = msec - min * (1000 * 60);
     int64_t sec = msec / 1000;
     msec = msec - sec * 1000;
 
-    char buf[32];
-    snprintf(buf, sizeof(buf), "%02d:%02d:%02d%s%03d", (int) hr, (int) min, (int) sec, comma ? "," : ".", (int) msec);
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%02d:%02d:%02d%s%03d", (int) hr, (int) min, (int) sec, comma ? "," : ".", (int) msec);
+
+    return std::string(buf);
+}
+
+static_assert(WHISPER_RFFT_N == WHISPER_N_FFT, "the FFT size of the log mel spectrogram must match whisper-fft.h");
+
+namespace {
+struct whisper_global_cache {
+    // Hann window (Use cosf to eliminate difference)
+    // ref: https://pytorch.org/docs/stable/generated/torch.hann_window.html
+    // ref: https://github.com/openai/whisper/blob/main/whisper/audio.py#L147
+    float hann_window[WHISPER_N_FFT];
+
+    whisper_rfft_plan rfft;
+
+    whisper_global_cache() {
+        fill_hann_window(sizeof(hann_window)/sizeof(hann_window[0]), true, hann_window);
+    }
+
+    void fill_hann_window(int length, bool periodic, float * output) {
+        int offset = -1;
+        if (periodic) {
+            offset = 0;
+        }
+        for (int i = 0; i < length; i++) {
+            output[i] = 0.5 * (1.0 - cosf((2.0 * M_PI * i) / (length + offset)));
+        }
+    }
+} global_cache;
+}
+
+// log10 mel energies of one frame of frame_size samples x, of which only the first n_x are available (the rest is zero)
+// the energy of band j is written to out[j*stride]
+static void log_mel_frame(const float * hann, const float * x, int n_x, int frame_size, const whisper_filters & filters,
+                          float * fft_in, float * fft_out, float * fft_work, float * out, int stride) {
+    n_x = std::min(n_x, frame_size);
+
+    // apply Hann window (~10% faster)
+    for (int j = 0; j < n_x; j++) {
+        fft_in[j] = hann[j] * x[j];
+    }
+
+    // fill the rest with zeros
+    std::fill(fft_in + n_x, fft_in + frame_size, 0.0f);
+
+    // FFT + modulus^2 of the complex bins
+    whisper_rfft_power(global_cache.rfft, fft_in, fft_out, fft_work);
+
+    // mel spectrogram, using only the nonzero span of each filter
+    for (int j = 0; j < filters.n_mel; j++) {
+        const float * p = fft_out + filters.beg[j];
+        const float * w = filters.sparse.data() + filters.off[j];
+
+        const int n = filters.len[j];
+
+        // 4 independent partial sums, so that the loop vectorizes
+        float sum4[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+
+        int k = 0;
+        for (; k + 3 < n; k += 4) {
+            sum4[0] += p[k + 0]*w[k + 0];
+            sum4[1] += p[k + 1]*w[k + 1];
+            sum4[2] += p[k + 2]*w[k + 2];
+            sum4[3] += p[k + 3]*w[k + 3];
+        }
+        for (; k < n; k++) {
+            sum4[0] += p[k]*w[k];
+        }
+
+        const double sum = (double) ((sum4[0] + sum4[1]) + (sum4[2] + sum4[3]));
+
+        out[j*stride] = log10(std::max(sum, 1e-10));
+    }
+}
+
+static void log_mel_spectrogram_worker_thread(int ith, const float * hann, const std::vector<float> & samples,
+                                              int n_samples, int frame_size, int frame_step, int n_threads,
+                                              const whisper_filters & filters, whisper_mel & mel) {
+    std::vector<float> fft_in(frame_size, 0.0);
+    std::vector<float> fft_out(frame_size);
+    std::vector<float> fft_work(frame_size * 2);
+
+    int i = ith;
+
+    // make sure n_fft == 1 + (WHISPER_N_FFT / 2), bin_0 to bin_nyquist
+    assert(filters.n_fft == 1 + (frame_size / 2));
+
+    // calculate FFT only when fft_in are not all zero
+    for (; i < std::min(n_samples / frame_step + 1, mel.n_len); i += n_threads) {
+        const int offset = i * frame_step;
+
+        log_mel_frame(hann, samples.data() + offset, n_samples - offset, frame_size, filters,
+                fft_in.data(), fft_out.data(), fft_work.data(), mel.data.data() + i, mel.n_len);
+    }
+
+    // Otherwise fft_out are all zero
+    double sum = log10(1e-10);
+    for (; i < mel.n_len; i += n_threads) {
+        for (int j = 0; j < mel.n_mel; j++) {
+            mel.data[j * mel.n_len + i] = sum;
+        }
+    }
+}
+
+// ref: https://github.com/openai/whisper/blob/main/whisper/audio.py#L110-L157
+static bool log_mel_spectrogram(
+              whisper_state & wstate,
+              const float * samples,
+              const int   n_samples,
+              const int   /*sample_rate*/,
+              const int   frame_size,
+              const int   frame_step,
+              const int   n_mel,
+              const int   n_threads,
+              const whisper_filters & filters,
+              const bool   debug,
+              whisper_mel & mel) {
+    const int64_t t_start_us = ggml_time_us();
+
+    // Hann window
+    WHISPER_ASSERT(frame_size == WHISPER_N_FFT && "Unsupported frame_size");
+    const float * hann = global_cache.hann_window;
+
+    // Calculate the length of padding
+    int64_t stage_1_pad = WHISPER_SAMPLE_RATE * 30;
+    int64_t stage_2_pad = frame_size / 2;
+
+    // Initialize a vector and copy data from C array to it.
+    std::vector<float> samples_padded;
+    samples_padded.resize(n_samples + stage_1_pad + stage_2_pad * 2);
+    std::copy(samples, samples + n_samples, samples_padded.begin() + stage_2_pad);
+
+    // pad 30 seconds of zeros at the end of audio (480,000 samples) + reflective pad 200 samples at the end of audio
+    std::fill(samples_padded.begin() + n_samples + stage_2_pad, samples_padded.begin() + n_samples + stage_1_pad + 2 * stage_2_pad, 0);
+
+    // reflective pad 200 samples at the beginning of audio
+    std::reverse_copy(samples + 1, samples + 1 + stage_2_pad, samples_padded.begin());
+
+    mel.n_mel     = n_mel;
+    mel.stream    = false;
+    mel.lazy      = false;
+    // https://github.com/pytorch/pytorch/blob/main/aten/src/ATen/native/SpectralOps.cpp#L936
+    // Calculate number of frames + remove the last frame
+    mel.n_len     = (samples_padded.size() - frame_size) / frame_step;
+    // Calculate semi-padded sample length to ensure compatibility
+    mel.n_len_org = 1 + (n_samples + stage_2_pad - frame_size) / frame_step;
+    mel.data.resize(mel.n_mel * mel.n_len);
+
+    whisper_worker_pool_run(wstate.workers, n_threads, [&](int ith) {
+        log_mel_spectrogram_worker_thread(ith, hann, samples_padded, n_samples + stage_2_pad, frame_size, frame_step, n_threads, filters, mel);
+    });
+
+    // clamping and normalization
+    double mmax = -1e20;
+    for (int i = 0; i < mel.n_mel*mel.n_len; i++) {
+        if (mel.data[i] > mmax) {
+            mmax = mel.data[i];
+        }
+    }
+
+    mmax -= 8.0;
+
+    for (int i = 0; i < mel.n_mel*mel.n_len; i++) {
+        if (mel.data[i] < mmax) {
+            mel.data[i] = mmax;
+        }
+
+        mel.data[i] = (mel.data[i] + 4.0)/4.0;
+    }
+
+    wstate.t_mel_us += ggml_time_us() - t_start_us;
+
+    // Dump log_mel_spectrogram
+    if (debug) {
+        std::ofstream outFile("log_mel_spectrogram.json");
+        outFile << "[";
+        for (uint64_t i = 0; i < mel.data.size() - 1; i++) {
+            outFile << mel.data[i] << ", ";
+        }
+        outFile << mel.data[mel.data.size() - 1] << "]";
+        outFile.close();
+    }
+
+    return true;
+}
+
+// split text into tokens
+//
+// ref: https://github.com/openai/gpt-2/blob/a74da5d99abaaba920de8131d64da2862a8f213b/src/encoder.py#L53
+//
+// Regex (Python):
+// r"""'s|'t|'re|'ve|'m|'ll|'d| ?\p{L}+| ?\p{N}+| ?[^\s\p{L}\p{N}]+|\s+(?!\S)|\s+"""
+//
+// Regex (C++):
+// R"('s|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+|\s+(?!\S)|\s+)"
+//
+static std::vector<whisper_vocab::id> tokenize(const whisper_vocab & vocab, const std::string & text) {
+    std::vector<std::string> words;
+
+    // first split the text into words
+    {
+        std::string str = text;
+        std::string pat = R"('s|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+|\s+(?!\S)|\s+)";
+
+        std::regex re(pat);
+        std::smatch m;
+
+        while (std::regex_search(str, m, re)) {
+            for (auto x : m) {
+                words.push_back(x);
+            }
+            str = m.suffix();
+        }
+    }
+
+    // find the longest tokens that form the words:
+    std::vector<whisper_vocab::id> tokens;
+    for (const auto & word : words) {
+        if (word.empty()) continue;
+
+        int i = 0;
+        int n = word.size();
+        while (i < n) {
+            int j = n;
+            bool found = false;
+            while (j > i) {
+                auto sub = word.substr(i, j-i);
+                auto it = vocab.token_to_id.find(sub);
+                if (it != vocab.token_to_id.end()) {
+                    tokens.push_back(it->second);
+                    i = j;
+                    found = true;
+                    break;
+                }
+                --j;
+            }
+            if (!found) {
+                WHISPER_LOG_ERROR("unknown token\n");
+                ++i;
+            }
+        }
+    }
+
+    return tokens;
+}
+
+//
+// interface implementation
+//
+
+#ifdef WHISPER_USE_COREML
+// replace .bin with -encoder.mlmodelc
+static std::string whisper_get_coreml_path_encoder(std::string path_bin) {
+    auto pos = path_bin.rfind('.');
+    if (pos != std::string::npos) {
+        path_bin = path_bin.substr(0, pos);
+    }
+
+    // match "-qx_x"
+    pos = path_bin.rfind('-');
+    if (pos != std::string::npos) {
+        auto sub = path_bin.substr(pos);
+        if (sub.size() == 5 && sub[1] == 'q' && sub[3] == '_') {
+            path_bin = path_bin.substr(0, pos);
+        }
+    }
+
+    path_bin += "-encoder.mlmodelc";
+
+    return path_bin;
+}
+#endif
+
+#ifdef WHISPER_USE_OPENVINO
+// replace .bin with-encoder-openvino.xml
+static std::string whisper_openvino_get_path_encoder(std::string path_bin) {
+    auto pos = path_bin.rfind('.');
+    if (pos != std::string::npos) {
+        path_bin = path_bin.substr(0, pos);
+    }
+
+    path_bin += "-encoder-openvino.xml";
+
+    return path_bin;
+}
+
+static std::string whisper_openvino_get_path_cache(std::string path_bin) {
+    auto pos = path_bin.rfind('.');
+    if (pos != std::string::npos) {
+        path_bin = path_bin.substr(0, pos);
+    }
+
+    path_bin += "-encoder-openvino-cache";
+
+    return path_bin;
+}
+#endif
+
+// measure the compute buffer of a graph of a new state, unless it was measured for another state of the context already
+// in that case only the scheduler is created - measuring builds and allocates the worst-case graph, while the buffers
+// of the scheduler are allocated anyway when its first graph is computed
+static bool whisper_sched_graph_init_cached(
+        whisper_context & ctx,
+          whisper_state & state,
+          whisper_sched & allocr,
+             const char * name,
+                 size_t & size,
+        std::function<struct ggml_cgraph *()> && get_graph) {
+    const auto key = std::make_pair(std::string(name), whisper_encode_external(state));
+
+    {
+        std::lock_guard<std::mutex> lock(ctx.sched_sizes.mutex);
+
+        auto it = ctx.sched_sizes.size.find(key);
+        if (it != ctx.sched_sizes.size.end()) {
+            whisper_sched_init(allocr, state.backends);
+            size = it->second;
+
+            return true;
+        }
+    }
+
+    if (!whisper_sched_graph_init(allocr, state.backends, std::move(get_graph))) {
+        return false;
+    }
+
+    size = whisper_sched_size(allocr);
+
+    std::lock_guard<std::mutex> lock(ctx.sched_sizes.mutex);
+    ctx.sched_sizes.size[key] = size;
+
+    return true;
+}
+
+struct whisper_state * whisper_init_state(whisper_context * ctx) {
+    whisper_state * state = new whisper_state;
+
+    state->backends = whisper_backend_init(ctx->params);
+    if (state->backends.empty()) {
+        WHISPER_LOG_ERROR("%s: whisper_backend_init() failed\n", __func__);
+        whisper_free_state(state);
+        return nullptr;
+    }
+
+    whisper_threadpool_init(state->threadpool, state->backends, ctx->cpu_mask, ctx->params.cpu_strict, ctx->params.cpu_poll);
+
+    ggml_type type_k_self;
+    ggml_type type_v_self;
+    ggml_type type_k_cross;
+    ggml_type type_v_cross;
+
+    if (!whisper_kv_cache_types(*ctx, ctx->params.type_kv_self,  type_k_self,  type_v_self) ||
+        !whisper_kv_cache_types(*ctx, ctx->params.type_kv_cross, type_k_cross, type_v_cross)) {
+        whisper_free_state(state);
+        return nullptr;
+    }
+
+    if (type_v_self != ctx->params.type_kv_self || type_v_cross != ctx->params.type_kv_cross) {
+        WHISPER_LOG_WARN("%s: quantized V cache requires flash attention - using F16 for V\n", __func__);
+    }
+
+    // at this point, we don't know yet how many decoders will be used
+    // later during decoding, if more decoders are used, we will recreate the KV cache respectively
+    state->kv_self_n_dec = 1;
+    if (!whisper_kv_cache_init(state->kv_self, state->backends[0], type_k_self, type_v_self,
+                ctx->model.hparams.n_text_state,
+                ctx->model.hparams.n_text_layer,
+                GGML_PAD(ctx->model.hparams.n_text_ctx, 256))) {
+        WHISPER_LOG_ERROR("%s: whisper_kv_cache_init() failed for self-attention cache\n", __func__);
+        whisper_free_state(state);
+        return nullptr;
+    }
+
+    {
+        const size_t memory_size = ggml_nbytes(state->kv_self.k) + ggml_nbytes(state->kv_self.v);
+        WHISPER_LOG_INFO("%s: kv self size  = %7.2f MB\n", __func__, memory_size / 1e6);
+    }
+
+    if (!whisper_kv_cache_init(state->kv_cross, state->backends[0], type_k_cross, type_v_cross,
+                ctx->model.hparams.n_text_state,
+                ctx->model.hparams.n_text_layer,
+                GGML_PAD(ctx->model.hparams.n_audio_ctx, 256))) {
+        WHISPER_LOG_ERROR("%s: whisper_kv_cache_init() failed for cross-attention cache\n", __func__);
+        whisper_free_state(state);
+        return nullptr;
+    }
+
+    {
+        const size_t memory_size = ggml_nbytes(state->kv_cross.k) + ggml_nbytes(state->kv_cross.v);
+        WHISPER_LOG_INFO("%s: kv cross size = %7.2f MB\n", __func__, memory_size / 1e6);
+    }
+
+    if (!whisper_kv_cache_init(state->kv_pad, state->backends[0], ctx->itype, ctx->itype,
+                ctx->model.hparams.n_audio_state,
+                1,
+                GGML_PAD(ctx->model.hparams.n_audio_ctx, 256))) {
+        WHISPER_LOG_ERROR("%s: whisper_kv_cache_init() failed for self-attention cache\n", __func__);
+        whisper_free_state(state);
+        return nullptr;
+    }
+
+    {
+        const size_t memory_size = ggml_nbytes(state->kv_pad.k) + ggml_nbytes(state->kv_pad.v);
+        WHISPER_LOG_INFO("%s: kv pad  size  = %7.2f MB\n", __func__, memory_size / 1e6);
+    }
+
+    // [EXPERIMENTAL] Token-level timestamps with DTW
+    if (ctx->params.dtw_token_timestamps) {
+        if (!aheads_masks_init(ctx->params, ctx->model.hparams, state->aheads_masks, state->backends[0])) {
+            WHISPER_LOG_ERROR("%s: aheads_masks_init() failed for alignment heads masks\n", __func__);
+            whisper_free_state(state);
+            return nullptr;
+        }
+        const size_t memory_size = aheads_masks_nbytes(state->aheads_masks);
+        WHISPER_LOG_INFO("%s: alignment heads masks size = %ld B\n", __func__, memory_size);
+    }
+
+#ifdef WHISPER_USE_COREML
+    const auto path_coreml = whisper_get_coreml_path_encoder(ctx->path_model);
+
+    WHISPER_LOG_INFO("%s: loading Core ML model from '%s'\n", __func__, path_coreml.c_str());
+    WHISPER_LOG_INFO("%s: first run on a device may take a while ...\n", __func__);
+
+    state->ctx_coreml = whisper_coreml_init(path_coreml.c_str());
+    if (!state->ctx_coreml) {
+        WHISPER_LOG_ERROR("%s: failed to load Core ML model from '%s'\n", __func__, path_coreml.c_str());
+#ifndef WHISPER_COREML_ALLOW_FALLBACK
+        whisper_free_state(state);
+        return nullptr;
+#endif
+    } else {
+        WHISPER_LOG_INFO("%s: Core ML model loaded\n", __func__);
+    }
+#endif
+
+    state->logits.reserve(ctx->vocab.n_vocab * ctx->model.hparams.n_text_ctx);
+
+    state->batch = whisper_batch_init(ctx->model.hparams.n_text_ctx, WHISPER_MAX_DECODERS);
+
+    // TAGS: WHISPER_DECODER_INIT
+    state->decoders[0].sequence.tokens.reserve(ctx->model.hparams.n_text_ctx);
+
+    state->decoders[0].probs.reserve    (ctx->vocab.n_vocab);
+    state->decoders[0].logits.reserve   (ctx->vocab.n_vocab);
+    state->decoders[0].logprobs.reserve (ctx->vocab.n_vocab);
+    state->decoders[0].logits_id.reserve(ctx->model.hparams.n_vocab);
+
+    state->decoders[0].rng = std::mt19937(0);
+
+    // conv allocator
+    {
+        size_t size = 0;
+
+        bool ok = whisper_sched_graph_init_cached(*ctx, *state, state->sched_conv, "conv", size,
+                [&]() {
+                    return whisper_build_graph_conv(*ctx, *state);
+                });
+
+        if (!ok) {
+            WHISPER_LOG_ERROR("%s: failed to init conv allocator\n", __func__);
+            whisper_free_state(state);
+            return nullptr;
+        }
+
+        WHISPER_LOG_INFO("%s: compute buffer (conv)   = %7.2f MB\n", __func__, size / 1e6);
+    }
+
+    // encoder allocator
+    if (!whisper_encode_external(*state)) {
+        size_t size = 0;
+
+        bool ok = whisper_sched_graph_init_cached(*ctx, *state, state->sched_encode, "encode", size,
+                [&]() {
+                    return whisper_build_graph_encoder(*ctx, *state);
+                });
+
+        if (!ok) {
+            WHISPER_LOG_ERROR("%s: failed to init encoder allocator\n", __func__);
+            whisper_free_state(state);
+            return nullptr;
+        }
+
+        WHISPER_LOG_INFO("%s: compute buffer (encode) = %7.2f MB\n", __func__, size / 1e6);
+    }
+
+    // cross allocator
+    {
+        size_t size = 0;
+
+        bool ok = whisper_sched_graph_init_cached(*ctx, *state, state->sched_cross, "cross", size,
+                [&]() {
+                    return whisper_build_graph_cross(*ctx, *state);
+                });
+
+        if (!ok) {
+            WHISPER_LOG_ERROR("%s: failed to init cross allocator\n", __func__);
+            whisper_free_state(state);
+            return nullptr;
+        }
+
+        WHISPER_LOG_INFO("%s: compute buffer (cross)  = %7.2f MB\n", __func__, size / 1e6);
+    }
+
+    // decoder allocator
+    {
+        size_t size = 0;
+
+        bool ok = whisper_sched_graph_init_cached(*ctx, *state, state->sched_decode, "decode", size,
+                [&]() {
+                    const auto & hparams = ctx->model.hparams;
+
+                    // TODO: make sure this is the worst-case scenario
+                    const int n_tokens = hparams.n_text_ctx;
+                    const int n_past   = 0;
+
+                    whisper_batch_prep_legacy(state->batch, nullptr, n_tokens, n_past, 0);
+
+                    return whisper_build_graph_decoder(*ctx, *state, state->batch, ctx->params.dtw_token_timestamps, true);
+                });
+
+        if (!ok) {
+            WHISPER_LOG_ERROR("%s: failed to init decoder allocator\n", __func__);
+            whisper_free_state(state);
+            return nullptr;
+        }
+
+        WHISPER_LOG_INFO("%s: compute buffer (decode) = %7.2f MB\n", __func__, size / 1e6);
+    }
+
+    return state;
+}
+
+int whisper_ctx_init_openvino_encoder_with_state(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+                    const char * model_path,
+                    const char * device,
+                    const char * cache_dir) {
+#ifndef WHISPER_USE_OPENVINO
+    (void)(ctx);
+    (void)(state);
+    (void)(model_path);
+    (void)(device);
+    (void)(cache_dir);
+
+    return 1;
+#else
+    if (!model_path && ctx->path_model.empty()) {
+        WHISPER_LOG_ERROR("%s: model_path is nullptr, and ctx has no model_path set.\n", __func__);
+        return 1;
+    }
+
+    std::string path_encoder;
+    if (!model_path) {
+        //if model_path is not set, attempt to find it in the same directory as ggml-<model>.bin model
+        path_encoder = whisper_openvino_get_path_encoder(ctx->path_model);
+    } else {
+        path_encoder = model_path;
+    }
+
+    std::string path_cache;
+    if (!cache_dir) {
+        //if cache_dir is not set, set it as a dir residing next to ggml-<model>.bin
+        path_cache = whisper_openvino_get_path_cache(ctx->path_model);
+    } else {
+        path_cache = cache_dir;
+    }
 
-    return std::string(buf);
+    WHISPER_LOG_INFO("%s: loading OpenVINO model from '%s'\n", __func__, path_encoder.c_str());
+    WHISPER_LOG_INFO("%s: first run on a device may take a while ...\n", __func__);
+
+    state->ctx_openvino = whisper_openvino_init(path_encoder.c_str(), device, path_cache.c_str());
+    if (!state->ctx_openvino) {
+        WHISPER_LOG_ERROR("%s: failed to init OpenVINO encoder from '%s'\n", __func__, path_encoder.c_str());
+        return 1;
+    } else {
+        WHISPER_LOG_INFO("%s: OpenVINO model loaded\n", __func__);
+    }
+
+    return 0;
+#endif
 }
 
-#define SIN_COS_N_COUNT WHISPER_N_FFT
-namespace {
-struct whisper_global_cache {
-    // In FFT, we frequently use sine and cosine operations with the same values.
-    // We can use precalculated values to speed up the process.
-    float sin_vals[SIN_COS_N_COUNT];
-    float cos_vals[SIN_COS_N_COUNT];
+int whisper_ctx_init_openvino_encoder(
+        struct whisper_context * ctx,
+                    const char * model_path,
+                    const char * device,
+                    const char * cache_dir) {
+    return whisper_ctx_init_openvino_encoder_with_state(ctx, ctx->state, model_path, device, cache_dir);
+}
 
-    // Hann window (Use cosf to eliminate difference)
-    // ref: https://pytorch.org/docs/stable/generated/torch.hann_window.html
-    // ref: https://github.com/openai/whisper/blob/main/whisper/audio.py#L147
-    float hann_window[WHISPER_N_FFT];
+struct whisper_context_params whisper_context_default_params() {
+    struct whisper_context_params result = {
+        /*.use_gpu              =*/ true,
+        /*.flash_attn           =*/ false,
+        /*.gpu_device           =*/ 0,
 
-    whisper_global_cache() {
-        fill_sin_cos_table();
-        fill_hann_window(sizeof(hann_window)/sizeof(hann_window[0]), true, hann_window);
+        /*.dtw_token_timestamps =*/ false,
+        /*.dtw_aheads_preset    =*/ WHISPER_AHEADS_NONE,
+        /*.dtw_n_top            =*/ -1,
+        /*.dtw_aheads           =*/ {
+            /*.n_heads          =*/ 0,
+            /*.heads            =*/ NULL,
+        },
+        /*.dtw_mem_size         =*/ 1024*1024*128,
+
+        /*.type_kv_self         =*/ GGML_TYPE_F16,
+        /*.type_kv_cross        =*/ GGML_TYPE_F16,
+
+        /*.use_mmap             =*/ true,
+
+        /*.cpu_mask             =*/ nullptr,
+        /*.cpu_strict           =*/ false,
+        /*.cpu_poll             =*/ 50,
+    };
+    return result;
+}
+
+static struct whisper_context * whisper_init_with_params_no_state_impl(struct whisper_model_loader * loader, struct whisper_context_params params, const char * path_model, std::unique_ptr<whisper_mmap> mapping);
+
+struct whisper_context * whisper_init_from_file_with_params_no_state(const char * path_model, struct whisper_context_params params) {
+    WHISPER_LOG_INFO("%s: loading model from '%s'\n", __func__, path_model);
+
+    if (params.use_mmap && whisper_mmap::SUPPORTED) {
+        std::unique_ptr<whisper_mmap> mapping(new whisper_mmap());
+
+        if (whisper_mmap_open(*mapping, path_model)) {
+            whisper_model_loader loader = {};
+
+            loader.context = mapping.get();
+
+            loader.read = [](void * ctx, void * output, size_t read_size) {
+                whisper_mmap * mapping = (whisper_mmap *) ctx;
+
+                const size_t size_to_copy = std::min(read_size, mapping->size - mapping->pos);
+
+                memcpy(output, (const char *) mapping->addr + mapping->pos, size_to_copy);
+                mapping->pos += size_to_copy;
+
+                return size_to_copy;
+            };
+
+            loader.eof = [](void * ctx) {
+                whisper_mmap * mapping = (whisper_mmap *) ctx;
+                return mapping->pos >= mapping->size;
+            };
+
+            loader.close = [](void * /*ctx*/) { };
+
+            return whisper_init_with_params_no_state_impl(&loader, params, path_model, std::move(mapping));
+        }
+
+        WHISPER_LOG_WARN("%s: failed to mmap '%s' - reading it instead\n", __func__, path_model);
+    }
+
+#ifdef _MSC_VER
+    // Convert UTF-8 path to wide string (UTF-16) for Windows, resolving character encoding issues.
+    std::wstring_convert<std::codecvt_utf8<wchar_t>> converter;
+    std::wstring path_model_wide = converter.from_bytes(path_model);
+    auto fin = std::ifstream(path_model_wide, std::ios::binary);
+#else
+    auto fin = std::ifstream(path_model, std::ios::binary);
+#endif
+    if (!fin) {
+        WHISPER_LOG_ERROR("%s: failed to open '%s'\n", __func__, path_model);
+        return nullptr;
+    }
+
+    whisper_model_loader loader = {};
+
+    loader.context = &fin;
+
+    loader.read = [](void * ctx, void * output, size_t read_size) {
+        std::ifstream * fin = (std::ifstream*)ctx;
+        fin->read((char *)output, read_size);
+        return read_size;
+    };
+
+    loader.eof = [](void * ctx) {
+        std::ifstream * fin = (std::ifstream*)ctx;
+        return fin->eof();
+    };
+
+    loader.close = [](void * ctx) {
+        std::ifstream * fin = (std::ifstream*)ctx;
+        fin->close();
+    };
+
+    return whisper_init_with_params_no_state_impl(&loader, params, path_model, nullptr);
+}
+
+struct whisper_context * whisper_init_from_buffer_with_params_no_state(void * buffer, size_t buffer_size, struct whisper_context_params params) {
+    struct buf_context {
+        uint8_t* buffer;
+        size_t size;
+        size_t current_offset;
+    };
+
+    buf_context ctx = { reinterpret_cast<uint8_t*>(buffer), buffer_size, 0 };
+
+    WHISPER_LOG_INFO("%s: loading model from buffer\n", __func__);
+
+    whisper_model_loader loader = {};
+
+    loader.context = &ctx;
+
+    loader.read = [](void * ctx, void * output, size_t read_size) {
+        buf_context * buf = reinterpret_cast<buf_context *>(ctx);
+
+        size_t size_to_copy = buf->current_offset + read_size < buf->size ? read_size : buf->size - buf->current_offset;
+
+        memcpy(output, buf->buffer + buf->current_offset, size_to_copy);
+        buf->current_offset += size_to_copy;
+
+        return size_to_copy;
+    };
+
+    loader.eof = [](void * ctx) {
+        buf_context * buf = reinterpret_cast<buf_context *>(ctx);
+
+        return buf->current_offset >= buf->size;
+    };
+
+    loader.close = [](void * /*ctx*/) { };
+
+    return whisper_init_with_params_no_state(&loader, params);
+}
+
+struct whisper_context * whisper_init_with_params_no_state(struct whisper_model_loader * loader, struct whisper_context_params params) {
+    return whisper_init_with_params_no_state_impl(loader, params, nullptr, nullptr);
+}
+
+// parse a hex mask of CPUs such as "0xff" (CPUs 0-7) into mask, by CPU. NULL or "" is the default affinity (empty mask)
+static bool whisper_parse_cpu_mask(const char * str, std::vector<bool> & mask) {
+    mask.clear();
+
+    if (str == nullptr || str[0] == '\0') {
+        return true;
+    }
+
+    std::string hex = str;
+    if (hex.size() > 2 && hex[0] == '0' && (hex[1] == 'x' || hex[1] == 'X')) {
+        hex = hex.substr(2);
     }
 
-    void fill_sin_cos_table() {
-        for (int i = 0; i < SIN_COS_N_COUNT; i++) {
-            double theta = (2 * M_PI * i) / SIN_COS_N_COUNT;
-            sin_vals[i] = sinf(theta);
-            cos_vals[i] = cosf(theta);
+    // the last digit has the CPUs 0-3
+    for (auto it = hex.rbegin(); it != hex.rend(); ++it) {
+        const char c = *it;
+
+        int v = 0;
+        if (c >= '0' && c <= '9') {
+            v = c - '0';
+        } else if (c >= 'a' && c <= 'f') {
+            v = c - 'a' + 10;
+        } else if (c >= 'A' && c <= 'F') {
+            v = c - 'A' + 10;
+        } else {
+            return false;
+        }
+
+        for (int i = 0; i < 4; ++i) {
+            mask.push_back((v >> i) & 1);
         }
     }
 
-    void fill_hann_window(int length, bool periodic, float * output) {
-        int offset = -1;
-        if (periodic) {
-            offset = 0;
+    return true;
+}
+
+static struct whisper_context * whisper_init_with_params_no_state_impl(struct whisper_model_loader * loader, struct whisper_context_params params, const char * path_model, std::unique_ptr<whisper_mmap> mapping) {
+    ggml_time_init();
+
+    if (params.flash_attn && params.dtw_token_timestamps) {
+        WHISPER_LOG_WARN("%s: dtw_token_timestamps is not supported with flash_attn - disabling\n", __func__);
+        params.dtw_token_timestamps = false;
+    }
+
+    WHISPER_LOG_INFO("%s: use gpu    = %d\n", __func__, params.use_gpu);
+    WHISPER_LOG_INFO("%s: flash attn = %d\n", __func__, params.flash_attn);
+    WHISPER_LOG_INFO("%s: mmap       = %d\n", __func__, mapping != nullptr);
+    WHISPER_LOG_INFO("%s: gpu_device = %d\n", __func__, params.gpu_device);
+    WHISPER_LOG_INFO("%s: dtw        = %d\n", __func__, params.dtw_token_timestamps);
+    WHISPER_LOG_INFO("%s: kv types   = %s (self), %s (cross)\n", __func__, ggml_type_name(params.type_kv_self), ggml_type_name(params.type_kv_cross));
+    WHISPER_LOG_INFO("%s: devices    = %zu\n", __func__, ggml_backend_dev_count());
+    WHISPER_LOG_INFO("%s: backends   = %zu\n", __func__, ggml_backend_reg_count());
+
+    std::vector<bool> cpu_mask;
+    if (!whisper_parse_cpu_mask(params.cpu_mask, cpu_mask)) {
+        WHISPER_LOG_ERROR("%s: invalid cpu_mask '%s', expected a hex mask such as 0xff\n", __func__, params.cpu_mask);
+        loader->close(loader->context);
+        return nullptr;
+    }
+
+    whisper_context * ctx = new whisper_context;
+    ctx->params   = params;
+    ctx->cpu_mask = std::move(cpu_mask);
+    ctx->mapping  = std::move(mapping);
+
+    if (path_model) {
+        ctx->path_model = path_model;
+    }
+
+    if (!whisper_model_load(loader, *ctx)) {
+        loader->close(loader->context);
+        WHISPER_LOG_ERROR("%s: failed to load model\n", __func__);
+        delete ctx;
+        return nullptr;
+    }
+
+    loader->close(loader->context);
+
+    return ctx;
+}
+
+int whisper_model_convert_gguf(const char * fname_inp, const char * fname_out) {
+#if defined(WHISPER_BIG_ENDIAN)
+    WHISPER_LOG_ERROR("%s: GGUF models are not supported on big-endian hosts\n", __func__);
+    return -1;
+#endif
+
+    std::ifstream fin;
+    whisper_model_file_open(fin, fname_inp, std::ios::binary);
+    if (!fin) {
+        WHISPER_LOG_ERROR("%s: failed to open '%s' for reading\n", __func__, fname_inp);
+        return -1;
+    }
+
+    gguf_context_ptr gguf(gguf_init_empty());
+
+    gguf_set_val_str(gguf.get(), ASR_KV_NAMES.at(ASR_KV_GENERAL_ARCHITECTURE), "whisper");
+
+    // hparams, in the order of the legacy format
+    {
+        uint32_t magic = 0;
+        fin.read((char *) &magic, sizeof(magic));
+        if (magic != GGML_FILE_MAGIC) {
+            WHISPER_LOG_ERROR("%s: invalid model file '%s' (bad magic)\n", __func__, fname_inp);
+            return -1;
         }
-        for (int i = 0; i < length; i++) {
-            output[i] = 0.5 * (1.0 - cosf((2.0 * M_PI * i) / (length + offset)));
+
+        const asr_kv keys[] = {
+            ASR_KV_N_VOCAB, ASR_KV_N_AUDIO_CTX, ASR_KV_N_AUDIO_STATE, ASR_KV_N_AUDIO_HEAD, ASR_KV_N_AUDIO_LAYER,
+            ASR_KV_N_TEXT_CTX, ASR_KV_N_TEXT_STATE, ASR_KV_N_TEXT_HEAD, ASR_KV_N_TEXT_LAYER, ASR_KV_N_MELS, ASR_KV_FTYPE,
+        };
+
+        for (asr_kv key : keys) {
+            int32_t val = 0;
+            fin.read((char *) &val, sizeof(val));
+            gguf_set_val_i32(gguf.get(), ASR_KV_NAMES.at(key), val);
+        }
+    }
+
+    // mel filters
+    {
+        int32_t n_mel = 0;
+        int32_t n_fft = 0;
+        fin.read((char *) &n_mel, sizeof(n_mel));
+        fin.read((char *) &n_fft, sizeof(n_fft));
+
+        if (!fin || n_mel <= 0 || n_fft <= 0) {
+            WHISPER_LOG_ERROR("%s: invalid mel filters in '%s'\n", __func__, fname_inp);
+            return -1;
+        }
+
+        std::vector<float> data((size_t) n_mel*n_fft);
+        fin.read((char *) data.data(), data.size()*sizeof(float));
+
+        gguf_set_val_i32 (gguf.get(), ASR_KV_NAMES.at(ASR_KV_MEL_FILTERS_N_MEL), n_mel);
+        gguf_set_val_i32 (gguf.get(), ASR_KV_NAMES.at(ASR_KV_MEL_FILTERS_N_FFT), n_fft);
+        gguf_set_arr_data(gguf.get(), ASR_KV_NAMES.at(ASR_KV_MEL_FILTERS_DATA), GGUF_TYPE_FLOAT32, data.data(), data.size());
+    }
+
+    // vocab
+    {
+        int32_t n_vocab = 0;
+        fin.read((char *) &n_vocab, sizeof(n_vocab));
+
+        std::vector<uint32_t> len(std::max(0, n_vocab));
+        std::vector<uint8_t>  data;
+
+        for (int i = 0; i < n_vocab && fin; i++) {
+            fin.read((char *) &len[i], sizeof(len[i]));
+
+            data.resize(data.size() + len[i]);
+            fin.read((char *) data.data() + data.size() - len[i], len[i]);
+        }
+
+        if (!fin) {
+            WHISPER_LOG_ERROR("%s: invalid vocab in '%s'\n", __func__, fname_inp);
+            return -1;
+        }
+
+        gguf_set_arr_data(gguf.get(), ASR_KV_NAMES.at(ASR_KV_VOCAB_LEN),  GGUF_TYPE_UINT32, len.data(),  len.size());
+        gguf_set_arr_data(gguf.get(), ASR_KV_NAMES.at(ASR_KV_VOCAB_DATA), GGUF_TYPE_UINT8,  data.data(), data.size());
+    }
+
+    // tensor headers, the data is copied below
+    struct tensor_info {
+        std::string name;
+        ggml_type   type;
+        int32_t     n_dims;
+        int64_t     ne[4];
+        size_t      offs;
+        size_t      nbytes;
+    };
+
+    std::vector<tensor_info> infos;
+
+    while (true) {
+        int32_t hdr[3]; // n_dims, length, ttype
+        fin.read((char *) hdr, sizeof(hdr));
+
+        if (fin.eof()) {
+            break;
+        }
+
+        tensor_info info;
+        info.n_dims = hdr[0];
+        info.type   = ggml_type(hdr[2]);
+
+        if (info.n_dims < 1 || info.n_dims > 4 || hdr[1] <= 0 || hdr[1] >= GGML_MAX_NAME || hdr[2] < 0 || hdr[2] >= GGML_TYPE_COUNT || ggml_type_size(info.type) == 0) {
+            WHISPER_LOG_ERROR("%s: invalid tensor header in '%s'\n", __func__, fname_inp);
+            return -1;
+        }
+
+        int64_t nelements = 1;
+        for (int i = 0; i < 4; ++i) {
+            int32_t ne = 1;
+            if (i < info.n_dims) {
+                fin.read((char *) &ne, sizeof(ne));
+            }
+            info.ne[i] = ne;
+            nelements *= ne;
         }
-    }
-} global_cache;
-}
 
-// naive Discrete Fourier Transform
-// input is real-valued
-// output is complex-valued
-static void dft(const float* in, int N, float* out) {
-    const int sin_cos_step = SIN_COS_N_COUNT / N;
+        info.name.resize(hdr[1]);
+        fin.read(&info.name[0], hdr[1]);
 
-    for (int k = 0; k < N; k++) {
-        float re = 0;
-        float im = 0;
+        info.offs   = fin.tellg();
+        info.nbytes = (nelements*ggml_type_size(info.type))/ggml_blck_size(info.type);
 
-        for (int n = 0; n < N; n++) {
-            int idx = (k * n * sin_cos_step) % (SIN_COS_N_COUNT); // t = 2*M_PI*k*n/N
-            re += in[n]*global_cache.cos_vals[idx]; // cos(t)
-            im -= in[n]*global_cache.sin_vals[idx]; // sin(t)
+        fin.seekg(info.nbytes, std::ios::cur);
+
+        if (!fin) {
+            WHISPER_LOG_ERROR("%s: tensor '%s' is truncated in '%s'\n", __func__, info.name.c_str(), fname_inp);
+            return -1;
         }
 
-        out[k*2 + 0] = re;
-        out[k*2 + 1] = im;
+        infos.push_back(std::move(info));
     }
-}
 
-// Cooley-Tukey FFT
-// poor man's implementation - use something better
-// input is real-valued
-// output is complex-valued
-static void fft(float* in, int N, float* out) {
-    if (N == 1) {
-        out[0] = in[0];
-        out[1] = 0;
-        return;
-    }
+    ggml_init_params params = {
+        /*.mem_size   =*/ (infos.size() + 1)*ggml_tensor_overhead(),
+        /*.mem_buffer =*/ nullptr,
+        /*.no_alloc   =*/ true,
+    };
 
-    const int half_N = N / 2;
-    if (N - half_N*2 == 1) {
-        dft(in, N, out);
-        return;
+    ggml_context_ptr ctx(ggml_init(params));
+
+    for (const auto & info : infos) {
+        ggml_tensor * t = ggml_new_tensor(ctx.get(), info.type, info.n_dims, info.ne);
+        ggml_set_name(t, info.name.c_str());
+
+        gguf_add_tensor(gguf.get(), t);
     }
 
-    float* even = in + N;
-    for (int i = 0; i < half_N; ++i) {
-        even[i]= in[2*i];
+    auto fout = std::ofstream(fname_out, std::ios::binary);
+    if (!fout) {
+        WHISPER_LOG_ERROR("%s: failed to open '%s' for writing\n", __func__, fname_out);
+        return -1;
     }
-    float* even_fft = out + 2 * N;
-    fft(even, half_N, even_fft);
 
-    float* odd = even;
-    for (int i = 0; i < half_N; ++i) {
-        odd[i] = in[2*i + 1];
+    // the header is padded to the alignment, and so is the data of each tensor
+    {
+        std::vector<uint8_t> meta(gguf_get_meta_size(gguf.get()));
+        gguf_get_meta_data(gguf.get(), meta.data());
+
+        fout.write((const char *) meta.data(), meta.size());
     }
-    float* odd_fft = even_fft + N;
-    fft(odd, half_N, odd_fft);
 
-    const int sin_cos_step = SIN_COS_N_COUNT / N;
-    for (int k = 0; k < half_N; k++) {
-        int idx = k * sin_cos_step; // t = 2*M_PI*k/N
-        float re = global_cache.cos_vals[idx]; // cos(t)
-        float im = -global_cache.sin_vals[idx]; // sin(t)
+    fin.clear();
+
+    std::vector<char> buf;
+
+    size_t total_size = 0;
+
+    for (const auto & info : infos) {
+        buf.resize(GGML_PAD(info.nbytes, gguf_get_alignment(gguf.get())));
+        std::fill(buf.begin() + info.nbytes, buf.end(), 0);
 
-        float re_odd = odd_fft[2*k + 0];
-        float im_odd = odd_fft[2*k + 1];
+        fin.seekg(info.offs);
+        fin.read(buf.data(), info.nbytes);
 
-        out[2*k + 0] = even_fft[2*k + 0] + re*re_odd - im*im_odd;
-        out[2*k + 1] = even_fft[2*k + 1] + re*im_odd + im*re_odd;
+        fout.write(buf.data(), buf.size());
 
-        out[2*(k + half_N) + 0] = even_fft[2*k + 0] - re*re_odd + im*im_odd;
-        out[2*(k + half_N) + 1] = even_fft[2*k + 1] - re*im_odd - im*re_odd;
+        total_size += info.nbytes;
     }
-}
 
-static void log_mel_spectrogram_worker_thread(int ith, const float * hann, const std::vector<float> & samples,
-                                              int n_samples, int frame_size, int frame_step, int n_threads,
-                                              const whisper_filters & filters, whisper_mel & mel) {
-    std::vector<float> fft_in(frame_size * 2, 0.0);
-    std::vector<float> fft_out(frame_size * 2 * 2 * 2);
+    if (!fin || !fout) {
+        WHISPER_LOG_ERROR("%s: failed to convert '%s'\n", __func__, fname_inp);
+        return -1;
+    }
 
-    int n_fft = filters.n_fft;
-    int i = ith;
+    WHISPER_LOG_INFO("%s: converted '%s' to '%s' (%zu tensors, %.2f MB)\n", __func__, fname_inp, fname_out, infos.size(), total_size/1e6);
 
-    // make sure n_fft == 1 + (WHISPER_N_FFT / 2), bin_0 to bin_nyquist
-    assert(n_fft == 1 + (frame_size / 2));
+    return 0;
+}
 
-    // calculate FFT only when fft_in are not all zero
-    for (; i < std::min(n_samples / frame_step + 1, mel.n_len); i += n_threads) {
-        const int offset = i * frame_step;
+struct whisper_context * whisper_init_from_file_with_params(const char * path_model, struct whisper_context_params params) {
+    whisper_context * ctx = whisper_init_from_file_with_params_no_state(path_model, params);
+    if (!ctx) {
+        return nullptr;
+    }
 
-        // apply Hann window (~10% faster)
-        for (int j = 0; j < std::min(frame_size, n_samples - offset); j++) {
-            fft_in[j] = hann[j] * samples[offset + j];
-        }
+    ctx->state = whisper_init_state(ctx);
+    if (!ctx->state) {
+        whisper_free(ctx);
+        return nullptr;
+    }
 
-        // fill the rest with zeros
-        if (n_samples - offset < frame_size) {
-            std::fill(fft_in.begin() + (n_samples - offset), fft_in.end(), 0.0);
-        }
+    return ctx;
+}
+
+struct whisper_context * whisper_init_from_buffer_with_params(void * buffer, size_t buffer_size, struct whisper_context_params params) {
+    whisper_context * ctx = whisper_init_from_buffer_with_params_no_state(buffer, buffer_size, params);
+    if (!ctx) {
+        return nullptr;
+    }
 
-        // FFT
-        fft(fft_in.data(), frame_size, fft_out.data());
+    ctx->state = whisper_init_state(ctx);
+    if (!ctx->state) {
+        whisper_free(ctx);
+        return nullptr;
+    }
 
-        // Calculate modulus^2 of complex numbers
-        // Use pow(fft_out[2 * j + 0], 2) + pow(fft_out[2 * j + 1], 2) causes inference quality problem? Interesting.
-        for (int j = 0; j < n_fft; j++) {
-            fft_out[j] = (fft_out[2 * j + 0] * fft_out[2 * j + 0] + fft_out[2 * j + 1] * fft_out[2 * j + 1]);
-        }
+    return ctx;
+}
 
-        // mel spectrogram
-        for (int j = 0; j < mel.n_mel; j++) {
-            double sum = 0.0;
-            // unroll loop (suggested by GH user @lunixbochs)
-            int k = 0;
-            for (k = 0; k < n_fft - 3; k += 4) {
-                sum +=
-                        fft_out[k + 0] * filters.data[j * n_fft + k + 0] +
-                        fft_out[k + 1] * filters.data[j * n_fft + k + 1] +
-                        fft_out[k + 2] * filters.data[j * n_fft + k + 2] +
-                        fft_out[k + 3] * filters.data[j * n_fft + k + 3];
-            }
-            // handle n_fft remainder
-            for (; k < n_fft; k++) {
-                sum += fft_out[k] * filters.data[j * n_fft + k];
-            }
-            sum = log10(std::max(sum, 1e-10));
-            mel.data[j * mel.n_len + i] = sum;
-        }
+struct whisper_context * whisper_init_with_params(struct whisper_model_loader * loader, struct whisper_context_params params) {
+    whisper_context * ctx = whisper_init_with_params_no_state(loader, params);
+    if (!ctx) {
+        return nullptr;
     }
 
-    // Otherwise fft_out are all zero
-    double sum = log10(1e-10);
-    for (; i < mel.n_len; i += n_threads) {
-        for (int j = 0; j < mel.n_mel; j++) {
-            mel.data[j * mel.n_len + i] = sum;
-        }
+    ctx->state = whisper_init_state(ctx);
+    if (!ctx->state) {
+        whisper_free(ctx);
+        return nullptr;
     }
+
+    return ctx;
 }
 
-// ref: https://github.com/openai/whisper/blob/main/whisper/audio.py#L110-L157
-static bool log_mel_spectrogram(
-              whisper_state & wstate,
-              const float * samples,
-              const int   n_samples,
-              const int   /*sample_rate*/,
-              const int   frame_size,
-              const int   frame_step,
-              const int   n_mel,
-              const int   n_threads,
-              const whisper_filters & filters,
-              const bool   debug,
-              whisper_mel & mel) {
-    const int64_t t_start_us = ggml_time_us();
+struct whisper_context * whisper_init_from_file(const char * path_model) {
+    return whisper_init_from_file_with_params(path_model, whisper_context_default_params());
+}
 
-    // Hann window
-    WHISPER_ASSERT(frame_size == WHISPER_N_FFT && "Unsupported frame_size");
-    const float * hann = global_cache.hann_window;
+struct whisper_context * whisper_init_from_buffer(void * buffer, size_t buffer_size) {
+    return whisper_init_from_buffer_with_params(buffer, buffer_size, whisper_context_default_params());
+}
 
-    // Calculate the length of padding
-    int64_t stage_1_pad = WHISPER_SAMPLE_RATE * 30;
-    int64_t stage_2_pad = frame_size / 2;
+struct whisper_context * whisper_init(struct whisper_model_loader * loader) {
+    return whisper_init_with_params(loader, whisper_context_default_params());
+}
 
-    // Initialize a vector and copy data from C array to it.
-    std::vector<float> samples_padded;
-    samples_padded.resize(n_samples + stage_1_pad + stage_2_pad * 2);
-    std::copy(samples, samples + n_samples, samples_padded.begin() + stage_2_pad);
+struct whisper_context * whisper_init_from_file_no_state(const char * path_model) {
+    return whisper_init_from_file_with_params_no_state(path_model, whisper_context_default_params());
+}
 
-    // pad 30 seconds of zeros at the end of audio (480,000 samples) + reflective pad 200 samples at the end of audio
-    std::fill(samples_padded.begin() + n_samples + stage_2_pad, samples_padded.begin() + n_samples + stage_1_pad + 2 * stage_2_pad, 0);
+struct whisper_context * whisper_init_from_buffer_no_state(void * buffer, size_t buffer_size) {
+    return whisper_init_from_buffer_with_params_no_state(buffer, buffer_size, whisper_context_default_params());
+}
 
-    // reflective pad 200 samples at the beginning of audio
-    std::reverse_copy(samples + 1, samples + 1 + stage_2_pad, samples_padded.begin());
+struct whisper_context * whisper_init_no_state(struct whisper_model_loader * loader) {
+    return whisper_init_with_params_no_state(loader, whisper_context_default_params());
+}
 
-    mel.n_mel     = n_mel;
-    // https://github.com/pytorch/pytorch/blob/main/aten/src/ATen/native/SpectralOps.cpp#L936
-    // Calculate number of frames + remove the last frame
-    mel.n_len     = (samples_padded.size() - frame_size) / frame_step;
-    // Calculate semi-padded sample length to ensure compatibility
-    mel.n_len_org = 1 + (n_samples + stage_2_pad - frame_size) / frame_step;
-    mel.data.resize(mel.n_mel * mel.n_len);
+void whisper_free_state(struct whisper_state * state) {
+    if (state) {
+        whisper_kv_cache_free(state->kv_self);
+        whisper_kv_cache_free(state->kv_cross);
+        whisper_kv_cache_free(state->kv_pad);
 
-    {
-        std::vector<std::thread> workers(n_threads - 1);
-        for (int iw = 0; iw < n_threads - 1; ++iw) {
-            workers[iw] = std::thread(
-                    log_mel_spectrogram_worker_thread, iw + 1, hann, std::cref(samples_padded),
-                    n_samples + stage_2_pad, frame_size, frame_step, n_threads,
-                    std::cref(filters), std::ref(mel));
+#ifdef WHISPER_USE_COREML
+        if (state->ctx_coreml != nullptr) {
+            whisper_coreml_free(state->ctx_coreml);
+            state->ctx_coreml = nullptr;
+        }
+#endif
+
+#ifdef WHISPER_USE_OPENVINO
+        if (state->ctx_openvino != nullptr) {
+            whisper_openvino_free(state->ctx_openvino);
+            state->ctx_openvino = nullptr;
         }
+#endif
+
+        whisper_batch_free(state->batch);
 
-        // main thread
-        log_mel_spectrogram_worker_thread(0, hann, samples_padded, n_samples + stage_2_pad, frame_size, frame_step, n_threads, filters, mel);
+        ggml_backend_sched_free(state->sched_conv.sched);
+        ggml_backend_sched_free(state->sched_encode.sched);
+        ggml_backend_sched_free(state->sched_cross.sched);
+        ggml_backend_sched_free(state->sched_decode.sched);
 
-        for (int iw = 0; iw < n_threads - 1; ++iw) {
-            workers[iw].join();
+        for (auto & it : state->sched_encode_auto) {
+            ggml_backend_sched_free(it.second.sched);
         }
-    }
 
-    // clamping and normalization
-    double mmax = -1e20;
-    for (int i = 0; i < mel.n_mel*mel.n_len; i++) {
-        if (mel.data[i] > mmax) {
-            mmax = mel.data[i];
+        for (auto & backend : state->backends) {
+            ggml_backend_free(backend);
         }
-    }
 
-    mmax -= 8.0;
+        // [EXPERIMENTAL] Token-level timestamps with DTW
+        aheads_masks_free(state->aheads_masks);
 
-    for (int i = 0; i < mel.n_mel*mel.n_len; i++) {
-        if (mel.data[i] < mmax) {
-            mel.data[i] = mmax;
-        }
+        whisper_free_state(state->draft_state);
 
-        mel.data[i] = (mel.data[i] + 4.0)/4.0;
+        delete state;
     }
+}
 
-    wstate.t_mel_us += ggml_time_us() - t_start_us;
+void whisper_free(struct whisper_context * ctx) {
+    if (ctx) {
+        for (ggml_context * context : ctx->model.ctxs) {
+            ggml_free(context);
+        }
 
-    // Dump log_mel_spectrogram
-    if (debug) {
-        std::ofstream outFile("log_mel_spectrogram.json");
-        outFile << "[";
-        for (uint64_t i = 0; i < mel.data.size() - 1; i++) {
-            outFile << mel.data[i] << ", ";
+        for (ggml_backend_buffer_t buf : ctx->model.buffers) {
+            ggml_backend_buffer_free(buf);
         }
-        outFile << mel.data[mel.data.size() - 1] << "]";
-        outFile.close();
-    }
 
-    return true;
+        whisper_state_pool_free(ctx->state_pool);
+        whisper_free_state(ctx->state);
+
+        delete ctx;
+    }
 }
 
-// split text into tokens
-//
-// ref: https://github.com/openai/gpt-2/blob/a74da5d99abaaba920de8131d64da2862a8f213b/src/encoder.py#L53
-//
-// Regex (Python):
-// r"""'s|'t|'re|'ve|'m|'ll|'d| ?\p{L}+| ?\p{N}+| ?[^\s\p{L}\p{N}]+|\s+(?!\S)|\s+"""
-//
-// Regex (C++):
-// R"('s|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+|\s+(?!\S)|\s+)"
-//
-static std::vector<whisper_vocab::id> tokenize(const whisper_vocab & vocab, const std::string & text) {
-    std::vector<std::string> words;
+struct whisper_state_pool {
+    whisper_context * ctx;
 
-    // first split the text into words
-    {
-        std::string str = text;
-        std::string pat = R"('s|'t|'re|'ve|'m|'ll|'d| ?[[:alpha:]]+| ?[[:digit:]]+| ?[^\s[:alpha:][:digit:]]+|\s+(?!\S)|\s+)";
+    std::mutex mutex;
 
-        std::regex re(pat);
-        std::smatch m;
+    std::vector<whisper_state *> idle;
+};
 
-        while (std::regex_search(str, m, re)) {
-            for (auto x : m) {
-                words.push_back(x);
-            }
-            str = m.suffix();
+struct whisper_state_pool * whisper_state_pool_init(struct whisper_context * ctx, int n_states) {
+    whisper_state_pool * pool = new whisper_state_pool;
+
+    pool->ctx = ctx;
+
+    for (int i = 0; i < n_states; ++i) {
+        whisper_state * state = whisper_init_state(ctx);
+        if (!state) {
+            WHISPER_LOG_ERROR("%s: failed to initialize state %d\n", __func__, i);
+            whisper_state_pool_free(pool);
+            return nullptr;
         }
+
+        pool->idle.push_back(state);
     }
 
-    // find the longest tokens that form the words:
-    std::vector<whisper_vocab::id> tokens;
-    for (const auto & word : words) {
-        if (word.empty()) continue;
+    return pool;
+}
 
-        int i = 0;
-        int n = word.size();
-        while (i < n) {
-            int j = n;
-            bool found = false;
-            while (j > i) {
-                auto sub = word.substr(i, j-i);
-                auto it = vocab.token_to_id.find(sub);
-                if (it != vocab.token_to_id.end()) {
-                    tokens.push_back(it->second);
-                    i = j;
-                    found = true;
-                    break;
-                }
-                --j;
-            }
-            if (!found) {
-                WHISPER_LOG_ERROR("unknown token\n");
-                ++i;
-            }
+void whisper_state_pool_free(struct whisper_state_pool * pool) {
+    if (pool) {
+        for (whisper_state * state : pool->idle) {
+            whisper_free_state(state);
+        }
+
+        delete pool;
+    }
+}
+
+struct whisper_state * whisper_state_pool_acquire(struct whisper_state_pool * pool) {
+    {
+        std::lock_guard<std::mutex> lock(pool->mutex);
+
+        if (!pool->idle.empty()) {
+            whisper_state * state = pool->idle.back();
+            pool->idle.pop_back();
+
+            return state;
         }
     }
 
-    return tokens;
+    // all states are in use - the new state joins the pool when it is released
+    return whisper_init_state(pool->ctx);
 }
 
-//
-// interface implementation
-//
-
-#ifdef WHISPER_USE_COREML
-// replace .bin with -encoder.mlmodelc
-static std::string whisper_get_coreml_path_encoder(std::string path_bin) {
-    auto pos = path_bin.rfind('.');
-    if (pos != std::string::npos) {
-        path_bin = path_bin.substr(0, pos);
+void whisper_state_pool_release(struct whisper_state_pool * pool, struct whisper_state * state) {
+    if (!state) {
+        return;
     }
 
-    // match "-qx_x"
-    pos = path_bin.rfind('-');
-    if (pos != std::string::npos) {
-        auto sub = path_bin.substr(pos);
-        if (sub.size() == 5 && sub[1] == 'q' && sub[3] == '_') {
-            path_bin = path_bin.substr(0, pos);
-        }
-    }
+    whisper_reset_state(pool->ctx, state);
 
-    path_bin += "-encoder.mlmodelc";
+    std::lock_guard<std::mutex> lock(pool->mutex);
 
-    return path_bin;
+    pool->idle.push_back(state);
 }
-#endif
 
-#ifdef WHISPER_USE_OPENVINO
-// replace .bin with-encoder-openvino.xml
-static std::string whisper_openvino_get_path_encoder(std::string path_bin) {
-    auto pos = path_bin.rfind('.');
-    if (pos != std::string::npos) {
-        path_bin = path_bin.substr(0, pos);
+void whisper_free_context_params(struct whisper_context_params * params) {
+    if (params) {
+        delete params;
     }
+}
 
-    path_bin += "-encoder-openvino.xml";
+void whisper_free_params(struct whisper_full_params * params) {
+    if (params) {
+        delete params;
+    }
+}
 
-    return path_bin;
+static void whisper_mel_stream_clear(whisper_state & state) {
+    auto & stream = state.mel_stream;
+
+    stream.pcm.clear();
+    stream.started  = false;
+    stream.n_frames = 0;
+    stream.max.clear();
 }
 
-static std::string whisper_openvino_get_path_cache(std::string path_bin) {
-    auto pos = path_bin.rfind('.');
-    if (pos != std::string::npos) {
-        path_bin = path_bin.substr(0, pos);
+int whisper_pcm_to_mel_with_state(struct whisper_context * ctx, struct whisper_state * state, const float * samples, int n_samples, int n_threads) {
+    state->enc_mel_offset = -1;
+
+    whisper_mel_stream_clear(*state);
+
+    if (!log_mel_spectrogram(*state, samples, n_samples, WHISPER_SAMPLE_RATE, WHISPER_N_FFT, WHISPER_HOP_LENGTH, ctx->model.filters.n_mel, n_threads, ctx->model.filters, false, state->mel)) {
+        WHISPER_LOG_ERROR("%s: failed to compute mel spectrogram\n", __func__);
+        return -1;
     }
 
-    path_bin += "-encoder-openvino-cache";
+    return 0;
+}
 
-    return path_bin;
+int whisper_pcm_to_mel(struct whisper_context * ctx, const float * samples, int n_samples, int n_threads) {
+    return whisper_pcm_to_mel_with_state(ctx, ctx->state, samples, n_samples, n_threads);
 }
-#endif
 
-struct whisper_state * whisper_init_state(whisper_context * ctx) {
-    whisper_state * state = new whisper_state;
+int whisper_pcm_to_mel_stream_with_state(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+                   const float * samples,
+                           int   n_samples,
+                           int   n_window_ms,
+                           int   n_threads) {
+    const int64_t t_start_us = ggml_time_us();
 
-    state->backends = whisper_backend_init(ctx->params);
-    if (state->backends.empty()) {
-        WHISPER_LOG_ERROR("%s: whisper_backend_init() failed\n", __func__);
-        whisper_free_state(state);
-        return nullptr;
-    }
+    const auto & filters = ctx->model.filters;
 
-    // at this point, we don't know yet how many decoders will be used
-    // later during decoding, if more decoders are used, we will recreate the KV cache respectively
-    state->kv_self_n_dec = 1;
-    if (!whisper_kv_cache_init(state->kv_self, state->backends[0], ctx->itype,
-                ctx->model.hparams.n_text_state,
-                ctx->model.hparams.n_text_layer,
-                GGML_PAD(ctx->model.hparams.n_text_ctx, 256))) {
-        WHISPER_LOG_ERROR("%s: whisper_kv_cache_init() failed for self-attention cache\n", __func__);
-        whisper_free_state(state);
-        return nullptr;
-    }
+    const int frame_size = WHISPER_N_FFT;
+    const int frame_step = WHISPER_HOP_LENGTH;
+    const int n_mel      = filters.n_mel;
 
-    {
-        const size_t memory_size = ggml_nbytes(state->kv_self.k) + ggml_nbytes(state->kv_self.v);
-        WHISPER_LOG_INFO("%s: kv self size  = %7.2f MB\n", __func__, memory_size / 1e6);
-    }
+    auto & stream = state->mel_stream;
+    auto & mel    = state->mel;
 
-    if (!whisper_kv_cache_init(state->kv_cross, state->backends[0], ctx->itype,
-                ctx->model.hparams.n_text_state,
-                ctx->model.hparams.n_text_layer,
-                GGML_PAD(ctx->model.hparams.n_audio_ctx, 256))) {
-        WHISPER_LOG_ERROR("%s: whisper_kv_cache_init() failed for cross-attention cache\n", __func__);
-        whisper_free_state(state);
-        return nullptr;
-    }
+    if (!mel.stream) {
+        // start a new stream
+        whisper_mel_stream_clear(*state);
 
-    {
-        const size_t memory_size = ggml_nbytes(state->kv_cross.k) + ggml_nbytes(state->kv_cross.v);
-        WHISPER_LOG_INFO("%s: kv cross size = %7.2f MB\n", __func__, memory_size / 1e6);
+        mel.n_mel     = n_mel;
+        mel.n_len     = 0;
+        mel.n_len_org = 0;
+        mel.stream    = true;
+        mel.lazy      = false;
+        mel.n_stride  = 0;
+        mel.i_beg     = 0;
+        mel.i_first   = 0;
+        mel.n_held    = 0;
+        mel.norm_max  = 0.0f;
+        mel.data.clear();
     }
 
-    if (!whisper_kv_cache_init(state->kv_pad, state->backends[0], ctx->itype,
-                ctx->model.hparams.n_audio_state,
-                1,
-                GGML_PAD(ctx->model.hparams.n_audio_ctx, 256))) {
-        WHISPER_LOG_ERROR("%s: whisper_kv_cache_init() failed for self-attention cache\n", __func__);
-        whisper_free_state(state);
-        return nullptr;
-    }
+    state->enc_mel_offset = -1;
 
-    {
-        const size_t memory_size = ggml_nbytes(state->kv_pad.k) + ggml_nbytes(state->kv_pad.v);
-        WHISPER_LOG_INFO("%s: kv pad  size  = %7.2f MB\n", __func__, memory_size / 1e6);
-    }
+    const int n_window = std::max(1, (n_window_ms > 0 ? n_window_ms : 1000*WHISPER_CHUNK_SIZE)/10);
 
-    // [EXPERIMENTAL] Token-level timestamps with DTW
-    if (ctx->params.dtw_token_timestamps) {
-        if (!aheads_masks_init(ctx->params, ctx->model.hparams, state->aheads_masks, state->backends[0])) {
-            WHISPER_LOG_ERROR("%s: aheads_masks_init() failed for alignment heads masks\n", __func__);
-            whisper_free_state(state);
-            return nullptr;
+    stream.pcm.insert(stream.pcm.end(), samples, samples + n_samples);
+
+    // reflective padding of frame_size/2 samples at the start, as in log_mel_spectrogram()
+    if (!stream.started) {
+        const int pad = frame_size/2;
+
+        if ((int) stream.pcm.size() <= pad) {
+            return 0;
         }
-        const size_t memory_size = aheads_masks_nbytes(state->aheads_masks);
-        WHISPER_LOG_INFO("%s: alignment heads masks size = %ld B\n", __func__, memory_size);
-    }
 
-#ifdef WHISPER_USE_COREML
-    const auto path_coreml = whisper_get_coreml_path_encoder(ctx->path_model);
+        std::vector<float> padded(pad);
+        std::reverse_copy(stream.pcm.begin() + 1, stream.pcm.begin() + 1 + pad, padded.begin());
 
-    WHISPER_LOG_INFO("%s: loading Core ML model from '%s'\n", __func__, path_coreml.c_str());
-    WHISPER_LOG_INFO("%s: first run on a device may take a while ...\n", __func__);
+        stream.pcm.insert(stream.pcm.begin(), padded.begin(), padded.end());
+        stream.started = true;
+    }
 
-    state->ctx_coreml = whisper_coreml_init(path_coreml.c_str());
-    if (!state->ctx_coreml) {
-        WHISPER_LOG_ERROR("%s: failed to load Core ML model from '%s'\n", __func__, path_coreml.c_str());
-#ifndef WHISPER_COREML_ALLOW_FALLBACK
-        whisper_free_state(state);
-        return nullptr;
-#endif
-    } else {
-        WHISPER_LOG_INFO("%s: Core ML model loaded\n", __func__);
+    // the new frames are the ones that are complete with the samples received so far
+    const int n_pcm = stream.pcm.size();
+    const int n_new = n_pcm < frame_size ? 0 : (n_pcm - frame_size)/frame_step + 1;
+
+    if (n_new == 0) {
+        return 0;
     }
-#endif
 
-    state->logits.reserve(ctx->vocab.n_vocab * ctx->model.hparams.n_text_ctx);
+    stream.frames.resize((size_t) n_new*n_mel);
 
-    state->batch = whisper_batch_init(ctx->model.hparams.n_text_ctx, WHISPER_MAX_DECODERS);
+    {
+        const float * hann = global_cache.hann_window;
 
-    // TAGS: WHISPER_DECODER_INIT
-    state->decoders[0].sequence.tokens.reserve(ctx->model.hparams.n_text_ctx);
+        whisper_worker_pool_run(state->workers, std::min(n_threads, n_new), [&](int ith) {
+            const int nth = std::min(n_threads, n_new);
 
-    state->decoders[0].probs.reserve    (ctx->vocab.n_vocab);
-    state->decoders[0].logits.reserve   (ctx->vocab.n_vocab);
-    state->decoders[0].logprobs.reserve (ctx->vocab.n_vocab);
-    state->decoders[0].logits_id.reserve(ctx->model.hparams.n_vocab);
+            std::vector<float> fft_in(frame_size);
+            std::vector<float> fft_out(frame_size);
+            std::vector<float> fft_work(frame_size * 2);
 
-    state->decoders[0].rng = std::mt19937(0);
+            for (int i = ith; i < n_new; i += nth) {
+                log_mel_frame(hann, stream.pcm.data() + i*frame_step, frame_size, frame_size, filters,
+                        fft_in.data(), fft_out.data(), fft_work.data(), stream.frames.data() + (size_t) i*n_mel, 1);
+            }
+        });
+    }
 
-    // conv allocator
-    {
-        bool ok = whisper_sched_graph_init(state->sched_conv, state->backends,
-                [&]() {
-                    return whisper_build_graph_conv(*ctx, *state);
-                });
+    stream.pcm.erase(stream.pcm.begin(), stream.pcm.begin() + (size_t) n_new*frame_step);
 
-        if (!ok) {
-            WHISPER_LOG_ERROR("%s: failed to init conv allocator\n", __func__);
-            whisper_free_state(state);
-            return nullptr;
-        }
+    // slide the window: drop the oldest frames, so that the new ones fit in n_window
+    const int n_keep = std::min(n_new, n_window);
+    const int n_old  = std::min(mel.n_len, n_window - n_keep);
 
-        WHISPER_LOG_INFO("%s: compute buffer (conv)   = %7.2f MB\n", __func__, whisper_sched_size(state->sched_conv) / 1e6);
-    }
+    mel.i_beg += mel.n_len - n_old;
+    mel.n_len  = n_old;
 
-    // encoder allocator
-    if (!whisper_encode_external(*state)) {
-        bool ok = whisper_sched_graph_init(state->sched_encode, state->backends,
-                [&]() {
-                    return whisper_build_graph_encoder(*ctx, *state);
-                });
+    // the buffer holds up to 2*n_window frames per band, so that the frames are moved to the front only once
+    // every n_window new frames
+    if (mel.n_stride < n_window || mel.i_beg + mel.n_len + n_keep > mel.n_stride) {
+        const int n_stride = std::max(mel.n_stride, 2*n_window);
 
-        if (!ok) {
-            WHISPER_LOG_ERROR("%s: failed to init encoder allocator\n", __func__);
-            whisper_free_state(state);
-            return nullptr;
+        std::vector<float> data((size_t) n_mel*n_stride);
+        for (int j = 0; j < n_mel && mel.n_len > 0; ++j) {
+            memcpy(data.data() + (size_t) j*n_stride, mel.data.data() + (size_t) j*mel.n_stride + mel.i_beg, mel.n_len*sizeof(float));
         }
 
-        WHISPER_LOG_INFO("%s: compute buffer (encode) = %7.2f MB\n", __func__, whisper_sched_size(state->sched_encode) / 1e6);
+        mel.data.swap(data);
+        mel.n_stride = n_stride;
+        mel.i_beg    = 0;
     }
 
-    // cross allocator
-    {
-        bool ok = whisper_sched_graph_init(state->sched_cross, state->backends,
-                [&]() {
-                    return whisper_build_graph_cross(*ctx, *state);
-                });
+    for (int i = n_new - n_keep; i < n_new; ++i) {
+        const float * frame = stream.frames.data() + (size_t) i*n_mel;
 
-        if (!ok) {
-            WHISPER_LOG_ERROR("%s: failed to init cross allocator\n", __func__);
-            whisper_free_state(state);
-            return nullptr;
+        float fmax = frame[0];
+        for (int j = 0; j < n_mel; ++j) {
+            mel.data[(size_t) j*mel.n_stride + mel.i_beg + mel.n_len] = frame[j];
+            fmax = std::max(fmax, frame[j]);
         }
 
-        WHISPER_LOG_INFO("%s: compute buffer (cross)  = %7.2f MB\n", __func__, whisper_sched_size(state->sched_cross) / 1e6);
+        mel.n_len++;
+
+        const int64_t id = stream.n_frames + i;
+        while (!stream.max.empty() && stream.max.back().second <= fmax) {
+            stream.max.pop_back();
+        }
+        stream.max.emplace_back(id, fmax);
     }
 
-    // decoder allocator
-    {
-        bool ok = whisper_sched_graph_init(state->sched_decode, state->backends,
-                [&]() {
-                    const auto & hparams = ctx->model.hparams;
+    stream.n_frames += n_new;
 
-                    // TODO: make sure this is the worst-case scenario
-                    const int n_tokens = hparams.n_text_ctx;
-                    const int n_past   = 0;
+    // the maximum over the frames in the window
+    while (stream.max.front().first < stream.n_frames - mel.n_len) {
+        stream.max.pop_front();
+    }
 
-                    whisper_batch_prep_legacy(state->batch, nullptr, n_tokens, n_past, 0);
+    mel.n_len_org = mel.n_len;
+    mel.n_held    = mel.n_len;
+    mel.norm_max  = stream.max.front().second;
 
-                    return whisper_build_graph_decoder(*ctx, *state, state->batch, ctx->params.dtw_token_timestamps, true);
-                });
+    state->t_mel_us += ggml_time_us() - t_start_us;
 
-        if (!ok) {
-            WHISPER_LOG_ERROR("%s: failed to init decoder allocator\n", __func__);
-            whisper_free_state(state);
-            return nullptr;
-        }
+    return 0;
+}
 
-        WHISPER_LOG_INFO("%s: compute buffer (decode) = %7.2f MB\n", __func__, whisper_sched_size(state->sched_decode) / 1e6);
-    }
+int whisper_pcm_to_mel_stream(struct whisper_context * ctx, const float * samples, int n_samples, int n_window_ms, int n_threads) {
+    return whisper_pcm_to_mel_stream_with_state(ctx, ctx->state, samples, n_samples, n_window_ms, n_threads);
+}
 
-    return state;
+void whisper_pcm_to_mel_stream_reset_with_state(struct whisper_context * ctx, struct whisper_state * state) {
+    whisper_mel_stream_clear(*state);
+
+    state->enc_mel_offset = -1;
+
+    state->mel.n_mel     = ctx->model.filters.n_mel;
+    state->mel.n_len     = 0;
+    state->mel.n_len_org = 0;
+    state->mel.stream    = false;
+    state->mel.lazy      = false;
+    state->mel.data.clear();
 }
 
-int whisper_ctx_init_openvino_encoder_with_state(
-        struct whisper_context * ctx,
-          struct whisper_state * state,
-                    const char * model_path,
-                    const char * device,
-                    const char * cache_dir) {
-#ifndef WHISPER_USE_OPENVINO
-    (void)(ctx);
-    (void)(state);
-    (void)(model_path);
-    (void)(device);
-    (void)(cache_dir);
+void whisper_pcm_to_mel_stream_reset(struct whisper_context * ctx) {
+    whisper_pcm_to_mel_stream_reset_with_state(ctx, ctx->state);
+}
 
-    return 1;
-#else
-    if (!model_path && ctx->path_model.empty()) {
-        WHISPER_LOG_ERROR("%s: model_path is nullptr, and ctx has no model_path set.\n", __func__);
-        return 1;
-    }
+// raw log10 energies of the frames [f0, f0 + n) of the lazy spectrogram, computed by thread ith of nth, into out [n][n_mel]
+// the frames are the same as the ones of log_mel_spectrogram()
+static void whisper_mel_lazy_frames(const whisper_mel_lazy & lazy, const whisper_filters & filters, int f0, int n, float * out, int ith, int nth) {
+    const int frame_size = WHISPER_N_FFT;
+    const int frame_step = WHISPER_HOP_LENGTH;
+    const int pad        = frame_size/2;
 
-    std::string path_encoder;
-    if (!model_path) {
-        //if model_path is not set, attempt to find it in the same directory as ggml-<model>.bin model
-        path_encoder = whisper_openvino_get_path_encoder(ctx->path_model);
-    } else {
-        path_encoder = model_path;
-    }
+    const float * samples   = lazy.samples;
+    const int     n_samples = lazy.n_samples;
 
-    std::string path_cache;
-    if (!cache_dir) {
-        //if cache_dir is not set, set it as a dir residing next to ggml-<model>.bin
-        path_cache = whisper_openvino_get_path_cache(ctx->path_model);
-    } else {
-        path_cache = cache_dir;
+    std::vector<float> x(frame_size);
+    std::vector<float> fft_in(frame_size);
+    std::vector<float> fft_out(frame_size);
+    std::vector<float> fft_work(frame_size * 2);
+
+    for (int i = ith; i < n; i += nth) {
+        // the frame starts at sample (f0 + i)*frame_step - pad, with the reflective padding at the start of the audio
+        // and the zero padding at the end
+        const int64_t offset = (int64_t) (f0 + i)*frame_step - pad;
+
+        if (offset >= n_samples) {
+            for (int j = 0; j < filters.n_mel; j++) {
+                out[(size_t) i*filters.n_mel + j] = log10(1e-10);
+            }
+            continue;
+        }
+
+        for (int k = 0; k < frame_size; k++) {
+            const int64_t is = offset + k;
+
+            x[k] = is < 0 ? (-is < n_samples ? samples[-is] : 0.0f) : (is < n_samples ? samples[is] : 0.0f);
+        }
+
+        log_mel_frame(global_cache.hann_window, x.data(), frame_size, frame_size, filters,
+                fft_in.data(), fft_out.data(), fft_work.data(), out + (size_t) i*filters.n_mel, 1);
     }
+}
 
-    WHISPER_LOG_INFO("%s: loading OpenVINO model from '%s'\n", __func__, path_encoder.c_str());
-    WHISPER_LOG_INFO("%s: first run on a device may take a while ...\n", __func__);
+// start a lazy spectrogram of the given samples, which must stay valid until whisper_mel_lazy_end()
+static void whisper_mel_lazy_begin(whisper_context & wctx, whisper_state & wstate, const float * samples, int n_samples, int n_threads) {
+    auto & lazy = wstate.mel_lazy;
+    auto & mel  = wstate.mel;
 
-    state->ctx_openvino = whisper_openvino_init(path_encoder.c_str(), device, path_cache.c_str());
-    if (!state->ctx_openvino) {
-        WHISPER_LOG_ERROR("%s: failed to init OpenVINO encoder from '%s'\n", __func__, path_encoder.c_str());
-        return 1;
-    } else {
-        WHISPER_LOG_INFO("%s: OpenVINO model loaded\n", __func__);
+    if (lazy.worker.joinable()) {
+        lazy.worker.join();
     }
 
-    return 0;
-#endif
-}
+    whisper_mel_stream_clear(wstate);
+
+    lazy.samples   = samples;
+    lazy.n_samples = n_samples;
+    lazy.n_threads = n_threads;
+    lazy.f_beg     = 0;
+    lazy.f_end     = 0;
+    lazy.n_next    = 0;
+    lazy.frames.clear();
 
-int whisper_ctx_init_openvino_encoder(
-        struct whisper_context * ctx,
-                    const char * model_path,
-                    const char * device,
-                    const char * cache_dir) {
-    return whisper_ctx_init_openvino_encoder_with_state(ctx, ctx->state, model_path, device, cache_dir);
+    // same lengths as log_mel_spectrogram(), i.e. with 30 s of zero padding at the end
+    mel.n_mel     = wctx.model.filters.n_mel;
+    mel.n_len     = (int) (((int64_t) n_samples + WHISPER_SAMPLE_RATE*WHISPER_CHUNK_SIZE)/WHISPER_HOP_LENGTH);
+    mel.n_len_org = 1 + (n_samples + WHISPER_N_FFT/2 - WHISPER_N_FFT)/WHISPER_HOP_LENGTH;
+    mel.stream    = false;
+    mel.lazy      = true;
+    mel.n_stride  = 0;
+    mel.i_beg     = 0;
+    mel.i_first   = 0;
+    mel.n_held    = 0;
+    mel.norm_max  = 0.0f;
+    mel.data.clear();
+
+    wstate.enc_mel_offset = -1;
 }
 
-struct whisper_context_params whisper_context_default_params() {
-    struct whisper_context_params result = {
-        /*.use_gpu              =*/ true,
-        /*.flash_attn           =*/ false,
-        /*.gpu_device           =*/ 0,
+// stop using the samples. the last window stays in the spectrogram, the rest of the audio reads as silence
+static void whisper_mel_lazy_end(whisper_state & wstate) {
+    auto & lazy = wstate.mel_lazy;
 
-        /*.dtw_token_timestamps =*/ false,
-        /*.dtw_aheads_preset    =*/ WHISPER_AHEADS_NONE,
-        /*.dtw_n_top            =*/ -1,
-        /*.dtw_aheads           =*/ {
-            /*.n_heads          =*/ 0,
-            /*.heads            =*/ NULL,
-        },
-        /*.dtw_mem_size         =*/ 1024*1024*128,
-    };
-    return result;
+    if (lazy.worker.joinable()) {
+        lazy.worker.join();
+    }
+
+    lazy.samples   = nullptr;
+    lazy.n_samples = 0;
+    lazy.n_next    = 0;
+    lazy.frames.clear();
+    lazy.frames.shrink_to_fit();
+    lazy.next.clear();
+    lazy.next.shrink_to_fit();
 }
 
-struct whisper_context * whisper_init_from_file_with_params_no_state(const char * path_model, struct whisper_context_params params) {
-    WHISPER_LOG_INFO("%s: loading model from '%s'\n", __func__, path_model);
-#ifdef _MSC_VER
-    // Convert UTF-8 path to wide string (UTF-16) for Windows, resolving character encoding issues.
-    std::wstring_convert<std::codecvt_utf8<wchar_t>> converter;
-    std::wstring path_model_wide = converter.from_bytes(path_model);
-    auto fin = std::ifstream(path_model_wide, std::ios::binary);
-#else
-    auto fin = std::ifstream(path_model, std::ios::binary);
-#endif
-    if (!fin) {
-        WHISPER_LOG_ERROR("%s: failed to open '%s'\n", __func__, path_model);
-        return nullptr;
+// make the frames [i0, i0 + n) of the lazy spectrogram available to whisper_mel_copy(), normalized with their max
+// the frames that are not computed yet in the background are computed with n_threads, then the background thread
+// starts on the next window, i.e. up to i0 + 2*n, which covers the next seek of whisper_full()
+static void whisper_mel_lazy_window(whisper_context & wctx, whisper_state & wstate, int i0, int n, int n_threads) {
+    auto & lazy = wstate.mel_lazy;
+    auto & mel  = wstate.mel;
+
+    if (!mel.lazy || lazy.samples == nullptr) {
+        return;
     }
 
-    whisper_model_loader loader = {};
+    const int i1 = std::min(i0 + n, mel.n_len);
 
-    loader.context = &fin;
+    i0 = std::min(i0, i1);
 
-    loader.read = [](void * ctx, void * output, size_t read_size) {
-        std::ifstream * fin = (std::ifstream*)ctx;
-        fin->read((char *)output, read_size);
-        return read_size;
-    };
+    if (mel.i_first == i0 && mel.n_held == i1 - i0 && !mel.data.empty()) {
+        return;
+    }
 
-    loader.eof = [](void * ctx) {
-        std::ifstream * fin = (std::ifstream*)ctx;
-        return fin->eof();
-    };
+    const int64_t t_start_us = ggml_time_us();
 
-    loader.close = [](void * ctx) {
-        std::ifstream * fin = (std::ifstream*)ctx;
-        fin->close();
-    };
+    const auto & filters = wctx.model.filters;
+    const int    n_mel   = filters.n_mel;
 
-    auto ctx = whisper_init_with_params_no_state(&loader, params);
+    if (lazy.worker.joinable()) {
+        lazy.worker.join();
 
-    if (ctx) {
-        ctx->path_model = path_model;
+        wstate.t_mel_us += lazy.t_next_us;
     }
 
-    return ctx;
-}
+    lazy.frames.insert(lazy.frames.end(), lazy.next.begin(), lazy.next.begin() + (size_t) lazy.n_next*n_mel);
+    lazy.f_end += lazy.n_next;
+    lazy.n_next = 0;
 
-struct whisper_context * whisper_init_from_buffer_with_params_no_state(void * buffer, size_t buffer_size, struct whisper_context_params params) {
-    struct buf_context {
-        uint8_t* buffer;
-        size_t size;
-        size_t current_offset;
-    };
+    // drop the frames before the window. the windows move forward, so anything else starts over
+    if (i0 < lazy.f_beg || i0 > lazy.f_end) {
+        lazy.frames.clear();
+        lazy.f_beg = i0;
+        lazy.f_end = i0;
+    } else if (i0 > lazy.f_beg) {
+        lazy.frames.erase(lazy.frames.begin(), lazy.frames.begin() + (size_t) (i0 - lazy.f_beg)*n_mel);
+        lazy.f_beg = i0;
+    }
 
-    buf_context ctx = { reinterpret_cast<uint8_t*>(buffer), buffer_size, 0 };
+    // the frames of the window that the background thread did not get to
+    if (lazy.f_end < i1) {
+        const int n_new = i1 - lazy.f_end;
 
-    WHISPER_LOG_INFO("%s: loading model from buffer\n", __func__);
+        lazy.frames.resize((size_t) (i1 - lazy.f_beg)*n_mel);
 
-    whisper_model_loader loader = {};
+        float * out = lazy.frames.data() + (size_t) (lazy.f_end - lazy.f_beg)*n_mel;
 
-    loader.context = &ctx;
+        const int f0  = lazy.f_end;
+        const int nth = std::max(1, std::min(lazy.n_threads > 0 ? lazy.n_threads : n_threads, n_new));
 
-    loader.read = [](void * ctx, void * output, size_t read_size) {
-        buf_context * buf = reinterpret_cast<buf_context *>(ctx);
+        whisper_worker_pool_run(wstate.workers, nth, [&](int ith) {
+            whisper_mel_lazy_frames(lazy, filters, f0, n_new, out, ith, nth);
+        });
 
-        size_t size_to_copy = buf->current_offset + read_size < buf->size ? read_size : buf->size - buf->current_offset;
+        lazy.f_end = i1;
+    }
 
-        memcpy(output, buf->buffer + buf->current_offset, size_to_copy);
-        buf->current_offset += size_to_copy;
+    // transpose the window into the spectrogram, and find its max for the normalization
+    mel.i_first  = i0;
+    mel.n_held   = i1 - i0;
+    mel.n_stride = std::max(1, i1 - i0);
+    mel.i_beg    = 0;
+    mel.data.resize((size_t) n_mel*mel.n_stride);
 
-        return size_to_copy;
-    };
+    float mmax = log10(1e-10);
+    for (int i = 0; i < mel.n_held; ++i) {
+        const float * frame = lazy.frames.data() + (size_t) i*n_mel;
 
-    loader.eof = [](void * ctx) {
-        buf_context * buf = reinterpret_cast<buf_context *>(ctx);
+        for (int j = 0; j < n_mel; ++j) {
+            mel.data[(size_t) j*mel.n_stride + i] = frame[j];
+            mmax = std::max(mmax, frame[j]);
+        }
+    }
 
-        return buf->current_offset >= buf->size;
-    };
+    mel.norm_max = mmax;
 
-    loader.close = [](void * /*ctx*/) { };
+    // compute the next window in the background
+    const int n_next = std::min(i0 + 2*n, mel.n_len) - lazy.f_end;
+    if (n_next > 0) {
+        lazy.n_next = n_next;
+        lazy.next.resize((size_t) n_next*n_mel);
 
-    return whisper_init_with_params_no_state(&loader, params);
-}
+        const int f0 = lazy.f_end;
 
-struct whisper_context * whisper_init_with_params_no_state(struct whisper_model_loader * loader, struct whisper_context_params params) {
-    ggml_time_init();
+        lazy.worker = std::thread([&lazy, &filters, f0, n_next]() {
+            const int64_t t_start_us = ggml_time_us();
 
-    if (params.flash_attn && params.dtw_token_timestamps) {
-        WHISPER_LOG_WARN("%s: dtw_token_timestamps is not supported with flash_attn - disabling\n", __func__);
-        params.dtw_token_timestamps = false;
-    }
+            whisper_mel_lazy_frames(lazy, filters, f0, n_next, lazy.next.data(), 0, 1);
 
-    WHISPER_LOG_INFO("%s: use gpu    = %d\n", __func__, params.use_gpu);
-    WHISPER_LOG_INFO("%s: flash attn = %d\n", __func__, params.flash_attn);
-    WHISPER_LOG_INFO("%s: gpu_device = %d\n", __func__, params.gpu_device);
-    WHISPER_LOG_INFO("%s: dtw        = %d\n", __func__, params.dtw_token_timestamps);
-    WHISPER_LOG_INFO("%s: devices    = %zu\n", __func__, ggml_backend_dev_count());
-    WHISPER_LOG_INFO("%s: backends   = %zu\n", __func__, ggml_backend_reg_count());
+            lazy.t_next_us = ggml_time_us() - t_start_us;
+        });
+    }
 
-    whisper_context * ctx = new whisper_context;
-    ctx->params = params;
+    wstate.t_mel_us += ggml_time_us() - t_start_us;
+}
 
-    if (!whisper_model_load(loader, *ctx)) {
-        loader->close(loader->context);
-        WHISPER_LOG_ERROR("%s: failed to load model\n", __func__);
-        delete ctx;
-        return nullptr;
+int whisper_set_mel_with_state(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+                   const float * data,
+                           int   n_len,
+                           int   n_mel) {
+    if (n_mel != ctx->model.filters.n_mel) {
+        WHISPER_LOG_ERROR("%s: invalid number of mel bands: %d (expected %d)\n", __func__, n_mel, ctx->model.filters.n_mel);
+        return -1;
     }
 
-    loader->close(loader->context);
+    state->enc_mel_offset = -1;
 
-    return ctx;
+    whisper_mel_stream_clear(*state);
+
+    state->mel.n_len     = n_len;
+    state->mel.n_len_org = n_len;
+    state->mel.n_mel     = n_mel;
+    state->mel.stream    = false;
+    state->mel.lazy      = false;
+
+    state->mel.data.resize(n_len*n_mel);
+    memcpy(state->mel.data.data(), data, n_len*n_mel*sizeof(float));
+
+    return 0;
 }
 
-struct whisper_context * whisper_init_from_file_with_params(const char * path_model, struct whisper_context_params params) {
-    whisper_context * ctx = whisper_init_from_file_with_params_no_state(path_model, params);
-    if (!ctx) {
-        return nullptr;
-    }
+int whisper_set_mel(
+        struct whisper_context * ctx,
+        const float * data,
+        int n_len,
+        int n_mel) {
+    return whisper_set_mel_with_state(ctx, ctx->state, data, n_len, n_mel);
+}
 
-    ctx->state = whisper_init_state(ctx);
-    if (!ctx->state) {
-        whisper_free(ctx);
-        return nullptr;
+int whisper_encode_with_state(struct whisper_context * ctx, struct whisper_state * state, int offset, int n_threads) {
+    if (!whisper_encode_internal(*ctx, *state, offset, n_threads, nullptr, nullptr)) {
+        WHISPER_LOG_ERROR("%s: failed to eval\n", __func__);
+        return -1;
     }
 
-    return ctx;
+    return 0;
 }
 
-struct whisper_context * whisper_init_from_buffer_with_params(void * buffer, size_t buffer_size, struct whisper_context_params params) {
-    whisper_context * ctx = whisper_init_from_buffer_with_params_no_state(buffer, buffer_size, params);
-    if (!ctx) {
-        return nullptr;
+int whisper_encode_batch(struct whisper_context * ctx, struct whisper_state ** states, int n_states, const int * offsets, int n_threads) {
+    if (n_states <= 0) {
+        WHISPER_LOG_ERROR("%s: invalid number of states %d\n", __func__, n_states);
+        return -1;
     }
 
-    ctx->state = whisper_init_state(ctx);
-    if (!ctx->state) {
-        whisper_free(ctx);
-        return nullptr;
+    for (int i = 0; i < n_states; ++i) {
+        if (states[i] == nullptr) {
+            WHISPER_LOG_ERROR("%s: state %d is NULL\n", __func__, i);
+            return -1;
+        }
+
+        if (states[i]->exp_n_audio_ctx != states[0]->exp_n_audio_ctx) {
+            WHISPER_LOG_ERROR("%s: all states must use the same audio context (%d != %d)\n", __func__,
+                    states[i]->exp_n_audio_ctx, states[0]->exp_n_audio_ctx);
+            return -1;
+        }
     }
 
-    return ctx;
-}
+    // the external encoders process a single window at a time
+    if (n_states == 1 || whisper_encode_external(*states[0])) {
+        for (int i = 0; i < n_states; ++i) {
+            if (whisper_encode_with_state(ctx, states[i], offsets ? offsets[i] : 0, n_threads) != 0) {
+                return -1;
+            }
+        }
 
-struct whisper_context * whisper_init_with_params(struct whisper_model_loader * loader, struct whisper_context_params params) {
-    whisper_context * ctx = whisper_init_with_params_no_state(loader, params);
-    if (!ctx) {
-        return nullptr;
+        return 0;
     }
 
-    ctx->state = whisper_init_state(ctx);
-    if (!ctx->state) {
-        whisper_free(ctx);
-        return nullptr;
+    // the cross graph copies the memory of each window separately - keep the number of nodes in check
+    const int n_batch_max = std::max(1, (WHISPER_MAX_NODES/(2*ctx->model.hparams.n_text_layer) - 4)/8);
+
+    std::vector<int> offsets_zero;
+    if (offsets == nullptr) {
+        offsets_zero.resize(n_states, 0);
+        offsets = offsets_zero.data();
     }
 
-    return ctx;
-}
+    for (int i0 = 0; i0 < n_states; i0 += n_batch_max) {
+        const int n_batch = std::min(n_batch_max, n_states - i0);
 
-struct whisper_context * whisper_init_from_file(const char * path_model) {
-    return whisper_init_from_file_with_params(path_model, whisper_context_default_params());
-}
+        if (!whisper_encode_batch_internal(*ctx, states + i0, offsets + i0, n_batch, n_threads)) {
+            WHISPER_LOG_ERROR("%s: failed to eval\n", __func__);
+            return -1;
+        }
+    }
 
-struct whisper_context * whisper_init_from_buffer(void * buffer, size_t buffer_size) {
-    return whisper_init_from_buffer_with_params(buffer, buffer_size, whisper_context_default_params());
+    return 0;
 }
 
-struct whisper_context * whisper_init(struct whisper_model_loader * loader) {
-    return whisper_init_with_params(loader, whisper_context_default_params());
-}
+int whisper_encode(struct whisper_context * ctx, int offset, int n_threads) {
+    if (!whisper_encode_internal(*ctx, *ctx->state, offset, n_threads, nullptr, nullptr)) {
+        WHISPER_LOG_ERROR("%s: failed to eval\n", __func__);
+        return -1;
+    }
 
-struct whisper_context * whisper_init_from_file_no_state(const char * path_model) {
-    return whisper_init_from_file_with_params_no_state(path_model, whisper_context_default_params());
+    return 0;
 }
 
-struct whisper_context * whisper_init_from_buffer_no_state(void * buffer, size_t buffer_size) {
-    return whisper_init_from_buffer_with_params_no_state(buffer, buffer_size, whisper_context_default_params());
-}
+int whisper_decode_with_state(struct whisper_context * ctx, struct whisper_state * state, const whisper_token * tokens, int n_tokens, int n_past, int n_threads) {
+    whisper_batch_prep_legacy(state->batch, tokens, n_tokens, n_past, 0);
 
-struct whisper_context * whisper_init_no_state(struct whisper_model_loader * loader) {
-    return whisper_init_with_params_no_state(loader, whisper_context_default_params());
-}
+    whisper_kv_cache_seq_rm(state->kv_self, 0, n_past, -1);
+    state->kv_self_prompt.clear();
 
-void whisper_free_state(struct whisper_state * state) {
-    if (state) {
-        whisper_kv_cache_free(state->kv_self);
-        whisper_kv_cache_free(state->kv_cross);
-        whisper_kv_cache_free(state->kv_pad);
+    if (!whisper_decode_internal(*ctx, *state, state->batch, n_threads, false, nullptr, nullptr)) {
+        WHISPER_LOG_ERROR("%s: failed to eval\n", __func__);
+        return 1;
+    }
 
-#ifdef WHISPER_USE_COREML
-        if (state->ctx_coreml != nullptr) {
-            whisper_coreml_free(state->ctx_coreml);
-            state->ctx_coreml = nullptr;
-        }
-#endif
+    return 0;
+}
 
-#ifdef WHISPER_USE_OPENVINO
-        if (state->ctx_openvino != nullptr) {
-            whisper_openvino_free(state->ctx_openvino);
-            state->ctx_openvino = nullptr;
-        }
-#endif
+int whisper_decode(struct whisper_context * ctx, const whisper_token * tokens, int n_tokens, int n_past, int n_threads) {
+    if (ctx->state == nullptr) {
+        WHISPER_LOG_ERROR("%s: ERROR state was not loaded.\n", __func__);
+        return -1;
+    }
 
-        whisper_batch_free(state->batch);
+    return whisper_decode_with_state(ctx, ctx->state, tokens, n_tokens, n_past, n_threads);
+}
 
-        ggml_backend_sched_free(state->sched_conv.sched);
-        ggml_backend_sched_free(state->sched_encode.sched);
-        ggml_backend_sched_free(state->sched_cross.sched);
-        ggml_backend_sched_free(state->sched_decode.sched);
+struct whisper_decode_sched * whisper_decode_sched_init(struct whisper_context * ctx, int n_states_max) {
+    if (n_states_max <= 0) {
+        WHISPER_LOG_ERROR("%s: invalid number of states %d\n", __func__, n_states_max);
+        return nullptr;
+    }
 
-        for (auto & backend : state->backends) {
-            ggml_backend_free(backend);
-        }
+    whisper_decode_sched * dsched = new whisper_decode_sched;
 
-        // [EXPERIMENTAL] Token-level timestamps with DTW
-        aheads_masks_free(state->aheads_masks);
+    dsched->ctx          = ctx;
+    dsched->n_states_max = n_states_max;
+
+    // each state adds its own attention nodes to every layer of the graph
+    dsched->graph_size = WHISPER_MAX_NODES + n_states_max*(32*ctx->model.hparams.n_text_layer + 4);
 
-        delete state;
+    dsched->backends = whisper_backend_init(ctx->params);
+    if (dsched->backends.empty()) {
+        WHISPER_LOG_ERROR("%s: whisper_backend_init() failed\n", __func__);
+        whisper_decode_sched_free(dsched);
+        return nullptr;
     }
+
+    whisper_threadpool_init(dsched->threadpool, dsched->backends, ctx->cpu_mask, ctx->params.cpu_strict, ctx->params.cpu_poll);
+
+    // the compute buffers are allocated on the first step and grow with the number of queued tokens
+    dsched->sched.sched = ggml_backend_sched_new(dsched->backends.data(), nullptr, dsched->backends.size(), dsched->graph_size, false);
+    dsched->sched.meta.resize(ggml_tensor_overhead()*dsched->graph_size + ggml_graph_overhead_custom(dsched->graph_size, false));
+
+    return dsched;
 }
 
-void whisper_free(struct whisper_context * ctx) {
-    if (ctx) {
-        for (ggml_context * context : ctx->model.ctxs) {
-            ggml_free(context);
-        }
+void whisper_decode_sched_free(struct whisper_decode_sched * dsched) {
+    if (dsched) {
+        ggml_backend_sched_free(dsched->sched.sched);
 
-        for (ggml_backend_buffer_t buf : ctx->model.buffers) {
-            ggml_backend_buffer_free(buf);
+        for (auto & backend : dsched->backends) {
+            ggml_backend_free(backend);
         }
 
-        whisper_free_state(ctx->state);
-
-        delete ctx;
+        delete dsched;
     }
 }
 
-void whisper_free_context_params(struct whisper_context_params * params) {
-    if (params) {
-        delete params;
-    }
-}
+int whisper_decode_sched_add(struct whisper_decode_sched * dsched, struct whisper_state * state) {
+    auto & states = dsched->states;
 
-void whisper_free_params(struct whisper_full_params * params) {
-    if (params) {
-        delete params;
+    if (std::find(states.begin(), states.end(), state) != states.end()) {
+        return 0;
     }
-}
 
-int whisper_pcm_to_mel_with_state(struct whisper_context * ctx, struct whisper_state * state, const float * samples, int n_samples, int n_threads) {
-    if (!log_mel_spectrogram(*state, samples, n_samples, WHISPER_SAMPLE_RATE, WHISPER_N_FFT, WHISPER_HOP_LENGTH, ctx->model.filters.n_mel, n_threads, ctx->model.filters, false, state->mel)) {
-        WHISPER_LOG_ERROR("%s: failed to compute mel spectrogram\n", __func__);
+    if ((int) states.size() >= dsched->n_states_max) {
+        WHISPER_LOG_ERROR("%s: too many states (max %d)\n", __func__, dsched->n_states_max);
         return -1;
     }
 
+    states.push_back(state);
+
     return 0;
 }
 
-int whisper_pcm_to_mel(struct whisper_context * ctx, const float * samples, int n_samples, int n_threads) {
-    return whisper_pcm_to_mel_with_state(ctx, ctx->state, samples, n_samples, n_threads);
-}
+int whisper_decode_sched_remove(struct whisper_decode_sched * dsched, struct whisper_state * state) {
+    auto & states = dsched->states;
+    auto & queued = dsched->queued;
 
-int whisper_set_mel_with_state(
-        struct whisper_context * ctx,
-          struct whisper_state * state,
-                   const float * data,
-                           int   n_len,
-                           int   n_mel) {
-    if (n_mel != ctx->model.filters.n_mel) {
-        WHISPER_LOG_ERROR("%s: invalid number of mel bands: %d (expected %d)\n", __func__, n_mel, ctx->model.filters.n_mel);
+    auto it = std::find(states.begin(), states.end(), state);
+    if (it == states.end()) {
+        WHISPER_LOG_ERROR("%s: state was not added to the scheduler\n", __func__);
         return -1;
     }
 
-    state->mel.n_len     = n_len;
-    state->mel.n_len_org = n_len;
-    state->mel.n_mel     = n_mel;
-
-    state->mel.data.resize(n_len*n_mel);
-    memcpy(state->mel.data.data(), data, n_len*n_mel*sizeof(float));
+    states.erase(it);
+    queued.erase(std::remove(queued.begin(), queued.end(), state), queued.end());
 
     return 0;
 }
 
-int whisper_set_mel(
-        struct whisper_context * ctx,
-        const float * data,
-        int n_len,
-        int n_mel) {
-    return whisper_set_mel_with_state(ctx, ctx->state, data, n_len, n_mel);
-}
+int whisper_decode_sched_push(struct whisper_decode_sched * dsched, struct whisper_state * state, const whisper_token * tokens, int n_tokens, int n_past) {
+    const auto & states = dsched->states;
 
-int whisper_encode_with_state(struct whisper_context * ctx, struct whisper_state * state, int offset, int n_threads) {
-    if (!whisper_encode_internal(*ctx, *state, offset, n_threads, nullptr, nullptr)) {
-        WHISPER_LOG_ERROR("%s: failed to eval\n", __func__);
+    if (std::find(states.begin(), states.end(), state) == states.end()) {
+        WHISPER_LOG_ERROR("%s: state was not added to the scheduler\n", __func__);
         return -1;
     }
 
-    return 0;
-}
-
-int whisper_encode(struct whisper_context * ctx, int offset, int n_threads) {
-    if (!whisper_encode_internal(*ctx, *ctx->state, offset, n_threads, nullptr, nullptr)) {
-        WHISPER_LOG_ERROR("%s: failed to eval\n", __func__);
+    if (n_tokens <= 0 || n_past < 0 || n_past + n_tokens > dsched->ctx->model.hparams.n_text_ctx) {
+        WHISPER_LOG_ERROR("%s: invalid number of tokens %d (n_past = %d)\n", __func__, n_tokens, n_past);
         return -1;
     }
 
-    return 0;
-}
-
-int whisper_decode_with_state(struct whisper_context * ctx, struct whisper_state * state, const whisper_token * tokens, int n_tokens, int n_past, int n_threads) {
     whisper_batch_prep_legacy(state->batch, tokens, n_tokens, n_past, 0);
 
     whisper_kv_cache_seq_rm(state->kv_self, 0, n_past, -1);
+    state->kv_self_prompt.clear();
 
-    if (!whisper_decode_internal(*ctx, *state, state->batch, n_threads, false, nullptr, nullptr)) {
-        WHISPER_LOG_ERROR("%s: failed to eval\n", __func__);
-        return 1;
+    auto & queued = dsched->queued;
+    if (std::find(queued.begin(), queued.end(), state) == queued.end()) {
+        queued.push_back(state);
     }
 
     return 0;
 }
 
-int whisper_decode(struct whisper_context * ctx, const whisper_token * tokens, int n_tokens, int n_past, int n_threads) {
-    if (ctx->state == nullptr) {
-        WHISPER_LOG_ERROR("%s: ERROR state was not loaded.\n", __func__);
+int whisper_decode_sched_step(struct whisper_decode_sched * dsched, int n_threads) {
+    if (dsched->queued.empty()) {
+        return 0;
+    }
+
+    const bool ok = whisper_decode_sched_eval(*dsched, n_threads);
+
+    dsched->queued.clear();
+
+    if (!ok) {
+        WHISPER_LOG_ERROR("%s: failed to eval\n", __func__);
         return -1;
     }
 
-    return whisper_decode_with_state(ctx, ctx->state, tokens, n_tokens, n_past, n_threads);
+    return 0;
+}
+
+int whisper_decode_sched_n_states(struct whisper_decode_sched * dsched) {
+    return dsched->states.size();
 }
 
 int whisper_tokenize(struct whisper_context * ctx, const char * text, whisper_token * tokens, int n_max_tokens) {
@@ -4302,6 +7097,49 @@ void whisper_reset_timings(struct whisper_context * ctx) {
     }
 }
 
+void whisper_reset_state(struct whisper_context * ctx, struct whisper_state * state) {
+    whisper_mel_lazy_end(*state);
+    whisper_pcm_to_mel_stream_reset_with_state(ctx, state);
+
+    state->t_sample_us = 0;
+    state->t_encode_us = 0;
+    state->t_decode_us = 0;
+    state->t_batchd_us = 0;
+    state->t_prompt_us = 0;
+    state->t_mel_us    = 0;
+
+    state->n_sample = 0;
+    state->n_encode = 0;
+    state->n_decode = 0;
+    state->n_batchd = 0;
+    state->n_prompt = 0;
+    state->n_fail_p = 0;
+    state->n_fail_h = 0;
+
+    // the KV caches are not cleared - whisper_full() and whisper_decode() overwrite the cells that they use, and
+    // without a cached prompt or encoder output the old contents are never reused
+    state->kv_self_prompt.clear();
+    state->enc_n_audio_ctx = 0;
+
+    state->result_all.clear();
+    state->prompt_past.clear();
+    state->energy.clear();
+
+    state->lang_id        = 0;
+    state->no_speech_prob = 0.0f;
+
+    state->t_beg    = 0;
+    state->t_last   = 0;
+    state->tid_last = 0;
+
+    state->exp_n_audio_ctx      = 0;
+    state->exp_n_audio_ctx_auto = false;
+
+    if (state->draft_ctx && state->draft_state) {
+        whisper_reset_state(state->draft_ctx, state->draft_state);
+    }
+}
+
 static int whisper_has_coreml(void) {
 #ifdef WHISPER_USE_COREML
     return 1;
@@ -4689,7 +7527,10 @@ static struct whisper_grammar whisper_grammar_init(
         }
     } while (true);
 
-    return { std::move(vec_rules), std::move(stacks), {} };
+    // moving the rules keeps the buffers that the stacks point into
+    auto shared_rules = std::make_shared<const std::vector<std::vector<whisper_grammar_element>>>(std::move(vec_rules));
+
+    return { std::move(shared_rules), std::make_shared<const std::vector<std::vector<const whisper_grammar_element *>>>(std::move(stacks)), {} };
 }
 
 static void whisper_suppress_invalid_grammar(
@@ -4698,7 +7539,7 @@ static void whisper_suppress_invalid_grammar(
            std::vector<float> & logits,
     const     whisper_grammar & grammar) {
 
-    if (grammar.rules.empty() || grammar.stacks.empty()) {
+    if (!grammar.rules || grammar.rules->empty() || grammar.stacks->empty()) {
         return;
     }
 
@@ -4723,7 +7564,7 @@ static void whisper_suppress_invalid_grammar(
         }
     }
 
-    const auto rejects = whisper_grammar_reject_candidates(grammar.rules, grammar.stacks, candidates_grammar);
+    const auto rejects = whisper_grammar_reject_candidates(*grammar.rules, *grammar.stacks, candidates_grammar);
 
     for (const auto & reject : rejects) {
         logits[reject.id] -= params.grammar_penalty;
@@ -4737,7 +7578,7 @@ static void whisper_suppress_invalid_grammar(
 }
 
 static void whisper_grammar_accept_token(whisper_context & ctx, whisper_grammar & grammar, whisper_token token) {
-    if (grammar.rules.empty() || grammar.stacks.empty()) {
+    if (!grammar.rules || grammar.rules->empty() || grammar.stacks->empty()) {
         return;
     }
 
@@ -4755,7 +7596,8 @@ static void whisper_grammar_accept_token(whisper_context & ctx, whisper_grammar
     const auto   decoded     = decode_utf8(text.c_str(), grammar.partial_utf8);
     const auto & code_points = decoded.first;
     for (auto it = code_points.begin(), end = code_points.end() - 1; it != end; ++it) {
-        grammar.stacks = whisper_grammar_accept(grammar.rules, grammar.stacks, *it);
+        grammar.stacks = std::make_shared<const std::vector<std::vector<const whisper_grammar_element *>>>(
+                whisper_grammar_accept(*grammar.rules, *grammar.stacks, *it));
     }
     grammar.partial_utf8 = decoded.second;
 }
@@ -4862,6 +7704,20 @@ struct whisper_full_params whisper_full_default_params(enum whisper_sampling_str
         /*.n_grammar_rules =*/ 0,
         /*.i_start_rule    =*/ 0,
         /*.grammar_penalty =*/ 100.0f,
+
+        /*.draft_ctx       =*/ nullptr,
+        /*.n_draft         =*/ 8,
+
+        /*.n_fallback_parallel =*/ 0,
+
+        /*.audio_ctx_auto  =*/ false,
+
+        /*.mel_lazy        =*/ false,
+
+        /*.n_threads_mel    =*/ 0,
+        /*.n_threads_encode =*/ 0,
+        /*.n_threads_decode =*/ 0,
+        /*.n_threads_sample =*/ 0,
     };
 
     switch (strategy) {
@@ -4972,6 +7828,85 @@ static const std::vector<std::string> non_speech_tokens = {
     "♪♪♪","♩", "♪", "♫", "♬", "♭", "♮", "♯"
 };
 
+// the mask of the tokens suppressed by params.suppress_regex and params.suppress_nst, cached in the context
+// res is nullptr if no token is suppressed. returns false if the regex is invalid
+static bool whisper_suppress_mask_get(whisper_context & ctx, const whisper_full_params & params, std::shared_ptr<const std::vector<uint8_t>> & res) {
+    res = nullptr;
+
+    const std::string regex = params.suppress_regex != nullptr ? params.suppress_regex : "";
+
+    if (regex.empty() && !params.suppress_nst) {
+        return true;
+    }
+
+    auto & masks = ctx.suppress_masks;
+
+    std::lock_guard<std::mutex> lock(masks.mutex);
+
+    const auto key = std::make_pair(regex, params.suppress_nst);
+
+    for (auto it = masks.mask.begin(); it != masks.mask.end(); ++it) {
+        if (it->first == key) {
+            res = it->second;
+
+            masks.mask.erase(it);
+            masks.mask.emplace_front(key, res);
+
+            return true;
+        }
+    }
+
+    const auto & vocab = ctx.vocab;
+
+    std::vector<uint8_t> mask(vocab.n_vocab, 0);
+
+    // suppress any tokens matching a regular expression
+    // ref: https://github.com/openai/whisper/discussions/1041
+    if (!regex.empty()) {
+        try {
+            std::regex re(regex);
+            for (const auto & token_id : vocab.token_to_id) {
+                if (std::regex_match(token_id.first, re)) {
+                    mask[token_id.second] = 1;
+                }
+            }
+        } catch (const std::regex_error & e) {
+            WHISPER_LOG_ERROR("%s: invalid suppress_regex '%s': %s\n", __func__, regex.c_str(), e.what());
+            return false;
+        }
+    }
+
+    // suppress non-speech tokens
+    // ref: https://github.com/openai/whisper/blob/7858aa9c08d98f75575035ecd6481f462d66ca27/whisper/tokenizer.py#L224-L253
+    if (params.suppress_nst) {
+        for (const std::string & token : non_speech_tokens) {
+            const std::string suppress_tokens[] = {token, " " + token};
+            for (const std::string & suppress_token : suppress_tokens) {
+                if (vocab.token_to_id.find(suppress_token) != vocab.token_to_id.end()) {
+                    mask[vocab.token_to_id.at(suppress_token)] = 1;
+                }
+            }
+        }
+
+        // allow hyphens "-" and single quotes "'" between words, but not at the beginning of a word
+        if (vocab.token_to_id.find(" -") != vocab.token_to_id.end()) {
+            mask[vocab.token_to_id.at(" -")] = 1;
+        }
+        if (vocab.token_to_id.find(" '") != vocab.token_to_id.end()) {
+            mask[vocab.token_to_id.at(" '")] = 1;
+        }
+    }
+
+    res = std::make_shared<const std::vector<uint8_t>>(std::move(mask));
+
+    masks.mask.emplace_front(key, res);
+    if (masks.mask.size() > WHISPER_SUPPRESS_MASKS_MAX) {
+        masks.mask.pop_back();
+    }
+
+    return true;
+}
+
 static void whisper_compute_logprobs(
                 const std::vector<float> & logits,
                               const int    n_logits,
@@ -5026,6 +7961,10 @@ static void whisper_process_logits(
 
     WHISPER_ASSERT(n_logits == ctx.vocab.n_vocab);
 
+    // the tokens matching params.suppress_regex and the non-speech tokens (see whisper_suppress_mask_get)
+    // they are suppressed after the logits filter callback, or in the first pass over the logits if there is none
+    const uint8_t * suppress_mask = state.suppress_mask ? state.suppress_mask->data() : nullptr;
+
     // extract the logits for the last token
     // we will be mutating, and therefore we don't want to use the ctx.logits buffer directly
     auto & probs    = decoder.probs;
@@ -5033,19 +7972,17 @@ static void whisper_process_logits(
     auto & logprobs = decoder.logprobs;
     {
         logits.resize(n_logits);
-        memcpy(logits.data(), state.logits.data() + decoder.i_batch*n_logits, n_logits*sizeof(float));
 
-        if (temperature > 0.0f) {
-            for (int i = 0; i < n_logits; i++) {
-                logits[i] /= temperature;
-            }
-        }
+        whisper_logits_prep(logits.data(), state.logits.data() + decoder.i_batch*n_logits, n_logits, temperature,
+                params.logits_filter_callback ? nullptr : suppress_mask);
 
         // will be populated a bit later
         probs.resize(n_logits);
         logprobs.resize(n_logits);
     }
 
+    whisper_logits_stats stats;
+
     // apply logit filters here
     // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L480-L493
     {
@@ -5093,36 +8030,8 @@ static void whisper_process_logits(
             params.logits_filter_callback(&ctx, &state, tokens_cur.data(), tokens_cur.size(), logits.data(), params.logits_filter_callback_user_data);
         }
 
-        // suppress any tokens matching a regular expression
-        // ref: https://github.com/openai/whisper/discussions/1041
-        if (params.suppress_regex != nullptr) {
-            std::regex re(params.suppress_regex);
-            for (std::pair<whisper_vocab::token, whisper_vocab::id> token_id : vocab.token_to_id) {
-                if (std::regex_match(token_id.first, re)) {
-                    logits[token_id.second] = -INFINITY;
-                }
-            }
-        }
-
-        // suppress non-speech tokens
-        // ref: https://github.com/openai/whisper/blob/7858aa9c08d98f75575035ecd6481f462d66ca27/whisper/tokenizer.py#L224-L253
-        if (params.suppress_nst) {
-            for (const std::string & token : non_speech_tokens) {
-                const std::string suppress_tokens[] = {token, " " + token};
-                for (const std::string & suppress_token : suppress_tokens) {
-                    if (vocab.token_to_id.find(suppress_token) != vocab.token_to_id.end()) {
-                        logits[vocab.token_to_id.at(suppress_token)] = -INFINITY;
-                    }
-                }
-            }
-
-            // allow hyphens "-" and single quotes "'" between words, but not at the beginning of a word
-            if (vocab.token_to_id.find(" -") != vocab.token_to_id.end()) {
-                logits[vocab.token_to_id.at(" -")] = -INFINITY;
-            }
-            if (vocab.token_to_id.find(" '") != vocab.token_to_id.end()) {
-                logits[vocab.token_to_id.at(" '")] = -INFINITY;
-            }
+        if (params.logits_filter_callback && suppress_mask) {
+            whisper_logits_mask(logits.data(), n_logits, suppress_mask);
         }
 
         // timestamps have to appear in pairs, except directly before EOT; mask logits accordingly
@@ -5167,66 +8076,37 @@ static void whisper_process_logits(
             }
         }
 
-        // populate the logprobs array (log_softmax)
-        whisper_compute_logprobs(logits, n_logits, logprobs);
+        // the log softmax of the logits, with exp(x - max) in probs (see whisper-logits.h)
+        stats = whisper_logits_softmax_begin(logits.data(), n_logits, vocab.token_beg, probs.data());
 
         // if sum of probability over timestamps is above any other token, sample timestamp
         // ref: https://github.com/openai/whisper/blob/0b1ba3d46ebf7fe6f953acfd8cad62a4f851b49f/whisper/decoding.py#L431-L437
         {
             // logsumexp over timestamps
-            float timestamp_logprob = -INFINITY;
-            {
-                float logsumexp = 0.0f;
-                const float logprob_max = *std::max_element(logprobs.begin() + vocab.token_beg, logprobs.end());
-                for (int i = vocab.token_beg; i < n_logits; ++i) {
-                    if (logprobs[i] > -INFINITY) {
-                        logsumexp += expf(logprobs[i] - logprob_max);
-                    }
-                }
-                if (logsumexp > 0.0f) {
-                    timestamp_logprob = logf(logsumexp) + logprob_max;
-                }
-            }
+            const float lse = stats.lse();
 
-            const float max_text_token_logprob = *std::max_element(logprobs.begin(), logprobs.begin() + vocab.token_beg);
+            const float timestamp_logprob      = stats.sum_ts > 0.0f ? logf(stats.sum_ts) + stats.max - lse : -INFINITY;
+            const float max_text_token_logprob = stats.max_text - lse;
 
             //WHISPER_LOG_INFO("timestamp_logprob=%f max_text_token_logprob=%f\n", timestamp_logprob, max_text_token_logprob);
 
             if (timestamp_logprob > max_text_token_logprob) {
+                // the timestamp logprobs stay normalized over all the tokens
                 for (int i = 0; i < vocab.token_beg; ++i) {
-                    logits[i]   = -INFINITY;
-                    logprobs[i] = -INFINITY;
+                    logits[i] = -INFINITY;
                 }
             } else {
                 if (params.n_grammar_rules > 0) {
                     whisper_suppress_invalid_grammar(ctx, params, logits, decoder.grammar);
 
-                    // populate the logprobs array (log_softmax)
-                    {
-                        const float logit_max = *std::max_element(logits.begin(), logits.end());
-                        float logsumexp = 0.0f;
-                        for (int i = 0; i < n_logits; ++i) {
-                            if (logits[i] > -INFINITY) {
-                                logsumexp += expf(logits[i] - logit_max);
-                            }
-                        }
-                        logsumexp = logf(logsumexp) + logit_max;
-
-                        for (int i = 0; i < n_logits; ++i) {
-                            if (logits[i] > -INFINITY) {
-                                logprobs[i] = logits[i] - logsumexp;
-                            } else {
-                                logprobs[i] = -INFINITY;
-                            }
-                        }
-                    }
+                    stats = whisper_logits_softmax_begin(logits.data(), n_logits, vocab.token_beg, probs.data());
                 }
             }
         }
     }
 
-    // compute probs
-    whisper_compute_probs(logits, n_logits, logprobs, probs);
+    // compute logprobs and probs
+    whisper_logits_softmax_end(logits.data(), n_logits, stats, logprobs.data(), probs.data());
 
 #if 0
     // print first 100 logits - token string : logit
@@ -5331,12 +8211,12 @@ static whisper_token_data whisper_sample_token(
     }
 
     if (best) {
-        for (int i = 0; i < n_logits; ++i) {
-            if (result.p < probs[i]) {
-                result.id   = i;
-                result.p    = probs[i];
-                result.plog = logprobs[i];
-            }
+        const int id = whisper_logits_argmax(probs.data(), n_logits);
+
+        if (probs[id] > 0.0f) {
+            result.id   = id;
+            result.p    = probs[id];
+            result.plog = logprobs[id];
         }
     } else {
         std::discrete_distribution<> dist(probs.begin(), probs.end());
@@ -5458,24 +8338,234 @@ static void whisper_sequence_score(
     {
         const int n = 32;
 
-        int cnt = 0;
-        double entropy = 0.0f;
+        int cnt = 0;
+        double entropy = 0.0f;
+
+        std::map<whisper_token, int> token_counts;
+        for (int i = std::max(0, sequence.result_len - n); i < sequence.result_len; ++i) {
+            token_counts[sequence.tokens[i].id]++;
+            cnt++;
+        }
+
+        for (const auto & kv : token_counts) {
+            const auto p = kv.second/(double)cnt;
+            entropy -= p*log(p);
+
+            //WHISPER_LOG_DEBUG("entropy: %d %f %f, count %d\n", kv.first, p, log(p), kv.second);
+        }
+
+        sequence.entropy = entropy;
+    }
+}
+
+// [EXPERIMENTAL] speculative decoding
+//
+// prepare the state of the draft model: the draft state is owned by the main state and is reused between calls
+// the mel spectrogram is computed with the draft model's filters, since the two models can have a different n_mels
+//
+static whisper_state * whisper_draft_init(
+        struct whisper_context * ctx,
+          struct whisper_state * state,
+        struct whisper_context * dctx,
+                   const float * samples,
+                           int   n_samples,
+                           int   n_threads) {
+    if (dctx->vocab.n_vocab != ctx->vocab.n_vocab || dctx->vocab.token_eot != ctx->vocab.token_eot) {
+        WHISPER_LOG_WARN("%s: the draft model does not share the vocabulary of the main model - ignoring it\n", __func__);
+        return nullptr;
+    }
+
+    if (state->draft_state != nullptr && state->draft_ctx != dctx) {
+        whisper_free_state(state->draft_state);
+        state->draft_state = nullptr;
+    }
+
+    if (state->draft_state == nullptr) {
+        state->draft_state = whisper_init_state(dctx);
+        if (state->draft_state == nullptr) {
+            WHISPER_LOG_ERROR("%s: failed to init the draft state\n", __func__);
+            return nullptr;
+        }
+        state->draft_ctx = dctx;
+    }
+
+    auto * dstate = state->draft_state;
+
+    if (n_samples > 0) {
+        if (whisper_pcm_to_mel_with_state(dctx, dstate, samples, n_samples, n_threads) != 0) {
+            WHISPER_LOG_ERROR("%s: failed to compute the draft log mel spectrogram\n", __func__);
+            return nullptr;
+        }
+    } else if (dctx->model.hparams.n_mels == ctx->model.hparams.n_mels) {
+        dstate->mel = state->mel;
+        dstate->enc_mel_offset = -1;
+    } else {
+        WHISPER_LOG_WARN("%s: the draft model needs the raw audio samples (n_mels = %d vs %d) - ignoring it\n",
+                __func__, dctx->model.hparams.n_mels, ctx->model.hparams.n_mels);
+        return nullptr;
+    }
+
+    return dstate;
+}
+
+// the most likely draft token after the sequence tokens[n_prompt:] + draft
+// the static token rules of whisper_process_logits are applied first, so that the draft does not propose tokens that
+// the main model never samples. the rules that need the logits filter callback or the timestamp probabilities are not
+static whisper_token whisper_draft_argmax(
+                const struct whisper_vocab & vocab,
+           const struct whisper_full_params & params,
+                             const uint8_t * suppress_mask,
+                               const float * logits_src,
+            const std::vector<whisper_token> & tokens,
+                                         int   n_prompt,
+            const std::vector<whisper_token> & draft,
+                          std::vector<float> & logits) {
+    const int n_vocab = vocab.n_vocab;
+
+    logits.resize(n_vocab);
+
+    whisper_logits_prep(logits.data(), logits_src, n_vocab, 0.0f, suppress_mask);
+
+    const int n_seq = tokens.size() - n_prompt + draft.size();
+
+    // the i-th token of the sequence, i < n_seq
+    const auto seq = [&](int i) {
+        return i < (int) tokens.size() - n_prompt ? tokens[n_prompt + i] : draft[i - (tokens.size() - n_prompt)];
+    };
+
+    if (params.suppress_blank && n_seq == 0) {
+        logits[vocab.token_eot]           = -INFINITY;
+        logits[vocab.token_to_id.at(" ")] = -INFINITY;
+    }
+
+    logits[vocab.token_not] = -INFINITY;
+    if (params.no_timestamps) {
+        std::fill(logits.begin() + vocab.token_beg, logits.end(), -INFINITY);
+    }
+
+    logits[vocab.token_sot]        = -INFINITY;
+    logits[vocab.token_nosp]       = -INFINITY;
+    logits[vocab.token_translate]  = -INFINITY;
+    logits[vocab.token_transcribe] = -INFINITY;
+    logits[vocab.token_prev]       = -INFINITY;
+
+    if (params.tdrz_enable == false) {
+        logits[vocab.token_solm] = -INFINITY;
+    }
+
+    for (int i = vocab.token_sot + 1; i < vocab.token_sot + 1 + (int) g_lang.size(); ++i) {
+        logits[i] = -INFINITY;
+    }
+
+    // timestamps in pairs, except directly before EOT
+    {
+        const bool last_was_timestamp        = n_seq > 0 && seq(n_seq - 1) >= vocab.token_beg;
+        const bool penultimate_was_timestamp = n_seq < 2 || seq(n_seq - 2) >= vocab.token_beg;
+
+        if (last_was_timestamp) {
+            if (penultimate_was_timestamp) {
+                std::fill(logits.begin() + vocab.token_beg, logits.end(), -INFINITY);
+            } else {
+                std::fill(logits.begin(), logits.begin() + vocab.token_eot, -INFINITY);
+            }
+        }
+    }
+
+    return whisper_logits_argmax(logits.data(), n_vocab);
+}
+
+// greedily generate up to n_draft tokens with the draft model, continuing the given token sequence, of which the
+// first n_prompt tokens are the prompt
+// only the tokens that are not already in the KV cache of the draft model are evaluated
+static bool whisper_draft_propose(
+                      struct whisper_context & dctx,
+                        struct whisper_state & dstate,
+           const struct whisper_full_params & params,
+                             const uint8_t * suppress_mask,
+            const std::vector<whisper_token> & tokens,
+                                         int   n_prompt,
+                                         int   seek,
+                                         int   n_audio_ctx,
+                                         int   n_draft,
+                                         int   n_threads,
+                         ggml_abort_callback   abort_callback,
+                                        void * abort_callback_data,
+                  std::vector<whisper_token> & draft) {
+    draft.clear();
+
+    dstate.exp_n_audio_ctx = n_audio_ctx;
+
+    if (dstate.enc_mel_offset != seek || dstate.enc_n_audio_ctx != dstate.exp_n_audio_ctx) {
+        if (!whisper_encode_internal(dctx, dstate, seek, n_threads, abort_callback, abort_callback_data)) {
+            return false;
+        }
+    }
+
+    auto & tokens_kv = dstate.kv_self_prompt;
+
+    int n_past = 0;
+    while (n_past < (int) tokens.size() - 1 && n_past < (int) tokens_kv.size() && tokens_kv[n_past] == tokens[n_past]) {
+        n_past++;
+    }
+
+    whisper_kv_cache_seq_rm(dstate.kv_self, 0, n_past, -1);
+    tokens_kv.clear();
+
+    whisper_batch_prep_legacy(dstate.batch, tokens.data() + n_past, tokens.size() - n_past, n_past, 0);
+
+    if (!whisper_decode_internal(dctx, dstate, dstate.batch, n_threads, false, abort_callback, abort_callback_data)) {
+        return false;
+    }
+
+    tokens_kv = tokens;
+
+    const int n_vocab = dctx.vocab.n_vocab;
+
+    // the decoders of the draft state are not used, the logits of the first one hold the filtered logits
+    auto & logits_buf = dstate.decoders[0].logits;
+
+    while (true) {
+        const float * logits = dstate.logits.data() + (dstate.batch.n_tokens - 1)*n_vocab;
+
+        const whisper_token id = whisper_draft_argmax(dctx.vocab, params, suppress_mask, logits, tokens, n_prompt, draft, logits_buf);
+
+        draft.push_back(id);
 
-        std::map<whisper_token, int> token_counts;
-        for (int i = std::max(0, sequence.result_len - n); i < sequence.result_len; ++i) {
-            token_counts[sequence.tokens[i].id]++;
-            cnt++;
+        if ((int) draft.size() >= n_draft || id == dctx.vocab.token_eot) {
+            break;
         }
 
-        for (const auto & kv : token_counts) {
-            const auto p = kv.second/(double)cnt;
-            entropy -= p*log(p);
+        whisper_batch_prep_legacy(dstate.batch, &id, 1, tokens_kv.size(), 0);
 
-            //WHISPER_LOG_DEBUG("entropy: %d %f %f, count %d\n", kv.first, p, log(p), kv.second);
+        if (!whisper_decode_internal(dctx, dstate, dstate.batch, n_threads, false, abort_callback, abort_callback_data)) {
+            tokens_kv.clear();
+            return false;
         }
 
-        sequence.entropy = entropy;
+        tokens_kv.push_back(id);
     }
+
+    return true;
+}
+
+// [EXPERIMENTAL] the threads of each phase: the explicit count, else the tuned count up to params.n_threads
+static whisper_threads whisper_full_threads(const whisper_context & ctx, const whisper_full_params & params) {
+    const auto pick = [&](int n, int n_tuned) {
+        if (n > 0) {
+            return n;
+        }
+
+        return n_tuned > 0 ? std::min(n_tuned, params.n_threads) : params.n_threads;
+    };
+
+    whisper_threads res;
+
+    res.mel    = pick(params.n_threads_mel,    ctx.threads_tuned.mel);
+    res.encode = pick(params.n_threads_encode, ctx.threads_tuned.encode);
+    res.decode = pick(params.n_threads_decode, ctx.threads_tuned.decode);
+    res.sample = pick(params.n_threads_sample, ctx.threads_tuned.sample);
+
+    return res;
 }
 
 int whisper_full_with_state(
@@ -5489,19 +8579,57 @@ int whisper_full_with_state(
 
     result_all.clear();
 
-    if (n_samples > 0) {
+    const whisper_threads n_threads = whisper_full_threads(*ctx, params);
+
+    if (!whisper_suppress_mask_get(*ctx, params, state->suppress_mask)) {
+        return -10;
+    }
+
+    // [EXPERIMENTAL] the lazy spectrogram reads the samples, so it is stopped on every return
+    struct whisper_mel_lazy_guard {
+        whisper_state * state;
+        ~whisper_mel_lazy_guard() { whisper_mel_lazy_end(*state); }
+    } mel_lazy_guard = { state };
+
+    if (n_samples > 0 && params.mel_lazy) {
+        // the spectrogram of each window is computed when it is encoded
+        whisper_mel_lazy_begin(*ctx, *state, samples, n_samples, n_threads.mel);
+    } else if (n_samples > 0) {
         // compute log mel spectrogram
-        if (whisper_pcm_to_mel_with_state(ctx, state, samples, n_samples, params.n_threads) != 0) {
+        if (whisper_pcm_to_mel_with_state(ctx, state, samples, n_samples, n_threads.mel) != 0) {
             WHISPER_LOG_ERROR("%s: failed to compute log mel spectrogram\n", __func__);
             return -2;
         }
     }
 
+    // [EXPERIMENTAL] speculative decoding with a draft model
+    whisper_state * dstate = nullptr;
+    if (params.draft_ctx != nullptr && params.n_draft > 0) {
+        dstate = whisper_draft_init(ctx, state, params.draft_ctx, samples, n_samples, n_threads.encode);
+    }
+
+    // overwrite audio_ctx, max allowed is hparams.n_audio_ctx
+    if (params.audio_ctx > whisper_n_audio_ctx(ctx)) {
+        WHISPER_LOG_ERROR("%s: audio_ctx is larger than the maximum allowed (%d > %d)\n", __func__, params.audio_ctx, whisper_n_audio_ctx(ctx));
+        return -5;
+    }
+    state->exp_n_audio_ctx = params.audio_ctx;
+
+    // [EXPERIMENTAL] automatic audio context, not supported by the external encoders which have a fixed input size
+    const bool audio_ctx_auto = params.audio_ctx_auto && params.audio_ctx == 0 && !whisper_encode_external(*state);
+
+    state->exp_n_audio_ctx_auto = audio_ctx_auto;
+
+    if (audio_ctx_auto) {
+        // the language detection uses the first window, so that its encoder pass can be reused
+        state->exp_n_audio_ctx = whisper_audio_ctx_auto(*ctx, whisper_n_len_from_state(state));
+    }
+
     // auto-detect language if not specified
     if (params.language == nullptr || strlen(params.language) == 0 || strcmp(params.language, "auto") == 0 || params.detect_language) {
         std::vector<float> probs(whisper_lang_max_id() + 1, 0.0f);
 
-        const auto lang_id = whisper_lang_auto_detect_with_state(ctx, state, 0, params.n_threads, probs.data());
+        const auto lang_id = whisper_lang_auto_detect_with_state(ctx, state, 0, n_threads.encode, probs.data());
         if (lang_id < 0) {
             WHISPER_LOG_ERROR("%s: failed to auto-detect language\n", __func__);
             return -3;
@@ -5569,6 +8697,11 @@ int whisper_full_with_state(
         return -4;
     }
 
+    // the decoders of the parallel temperature fallback groups
+    if (params.strategy == WHISPER_SAMPLING_GREEDY && params.n_fallback_parallel > 0) {
+        n_decoders = std::min(WHISPER_MAX_DECODERS, n_decoders*(1 + params.n_fallback_parallel));
+    }
+
     // TAGS: WHISPER_DECODER_INIT
     for (int j = 1; j < n_decoders; j++) {
         auto & decoder = state->decoders[j];
@@ -5616,13 +8749,6 @@ int whisper_full_with_state(
         }
     }
 
-    // overwrite audio_ctx, max allowed is hparams.n_audio_ctx
-    if (params.audio_ctx > whisper_n_audio_ctx(ctx)) {
-        WHISPER_LOG_ERROR("%s: audio_ctx is larger than the maximum allowed (%d > %d)\n", __func__, params.audio_ctx, whisper_n_audio_ctx(ctx));
-        return -5;
-    }
-    state->exp_n_audio_ctx = params.audio_ctx;
-
     // these tokens determine the task that will be performed
     std::vector<whisper_token> prompt_init = { whisper_token_sot(ctx), };
 
@@ -5655,18 +8781,45 @@ int whisper_full_with_state(
     std::vector<whisper_token> prompt;
     prompt.reserve(whisper_n_text_ctx(ctx));
 
+    // a beam search candidate: the sequence of decoder decoder_idx extended with token
+    // only the selected candidates are materialized into the decoders, by copying the sequence of their parent
     struct beam_candidate {
         int decoder_idx;
-        int seek_delta;
+        int rank; // the rank of the token among the top-k of the decoder, to break the ties
+
+        whisper_token_data token;
+
+        double sum_logprobs_all;
+    };
+
+    // the order of the candidates, best first
+    const auto beam_candidate_less = [](const beam_candidate & a, const beam_candidate & b) {
+        if (a.sum_logprobs_all != b.sum_logprobs_all) {
+            return a.sum_logprobs_all < b.sum_logprobs_all;
+        }
+        if (a.decoder_idx != b.decoder_idx) {
+            return a.decoder_idx > b.decoder_idx;
+        }
+        return a.rank > b.rank;
+    };
+
+    std::vector<std::vector<beam_candidate>> bc_per_dec(n_decoders);
+    std::vector<beam_candidate> beam_candidates; // a max-heap, popped into beam_sorted as needed
+    std::vector<beam_candidate> beam_sorted;
+    std::vector<beam_candidate> beam_selected(n_decoders);
 
+    // the state of the parents of the selected candidates, the grammar is shared
+    struct beam_parent {
+        int  seek_delta;
         bool has_ts;
 
-        whisper_sequence sequence;
         whisper_grammar grammar;
     };
 
-    std::vector<std::vector<beam_candidate>> bc_per_dec(n_decoders);
-    std::vector<beam_candidate> beam_candidates;
+    std::vector<beam_parent> beam_parents(n_decoders);
+
+    // the sequences of the selected candidates, swapped with the ones of the decoders to reuse their memory
+    std::vector<whisper_sequence> beam_sequences(n_decoders);
 
     // main loop
     while (true) {
@@ -5689,8 +8842,15 @@ int whisper_full_with_state(
             }
         }
 
+        if (audio_ctx_auto) {
+            state->exp_n_audio_ctx = whisper_audio_ctx_auto(*ctx, seek_end - seek);
+        }
+
         // encode audio features starting at offset seek
-        if (!whisper_encode_internal(*ctx, *state, seek, params.n_threads, params.abort_callback, params.abort_callback_user_data)) {
+        // the window might have been encoded already during the language detection
+        if (state->enc_mel_offset == seek && state->enc_n_audio_ctx == state->exp_n_audio_ctx) {
+            WHISPER_LOG_DEBUG("%s: reusing the encoder output for seek = %d\n", __func__, seek);
+        } else if (!whisper_encode_internal(*ctx, *state, seek, n_threads.encode, params.abort_callback, params.abort_callback_user_data)) {
             WHISPER_LOG_ERROR("%s: failed to encode\n", __func__);
             return -6;
         }
@@ -5727,7 +8887,40 @@ int whisper_full_with_state(
 
             n_decoders_cur = std::max(1, n_decoders_cur);
 
-            WHISPER_LOG_DEBUG("\n%s: strategy = %d, decoding with %d decoders, temperature = %.2f\n", __func__, params.strategy, n_decoders_cur, t_cur);
+            // [EXPERIMENTAL] parallel temperature fallback
+            // the decoders of the next temperatures are added as extra groups to the same batch
+            // group g samples with temperatures[it + g] using the decoders [group_begin[g], group_begin[g + 1])
+            // only temperatures that use the same prompt can be grouped, since the prompt is shared in the KV cache
+            std::vector<int> group_begin = { 0, n_decoders_cur };
+
+            if (params.strategy == WHISPER_SAMPLING_GREEDY && params.n_fallback_parallel > 0) {
+                const auto use_past = [&](float t) {
+                    return !prompt_past.empty() && t < 0.5f && params.n_max_text_ctx > 0;
+                };
+
+                for (int g = 1; g <= params.n_fallback_parallel && it + g < (int) temperatures.size(); ++g) {
+                    const float t_next = temperatures[it + g];
+                    const int   n_next = t_next > 0.0f ? std::max(1, params.greedy.best_of) : 1;
+
+                    if (use_past(t_next) != use_past(t_cur) || group_begin.back() + n_next > WHISPER_MAX_DECODERS) {
+                        break;
+                    }
+
+                    group_begin.push_back(group_begin.back() + n_next);
+                }
+
+                n_decoders_cur = group_begin.back();
+            }
+
+            const int n_groups = group_begin.size() - 1;
+
+            // the temperature of each decoder
+            std::vector<float> t_dec(n_decoders_cur);
+            for (int g = 0; g < n_groups; ++g) {
+                std::fill(t_dec.begin() + group_begin[g], t_dec.begin() + group_begin[g + 1], temperatures[it + g]);
+            }
+
+            WHISPER_LOG_DEBUG("\n%s: strategy = %d, decoding with %d decoders, temperature = %.2f, groups = %d\n", __func__, params.strategy, n_decoders_cur, t_cur, n_groups);
 
             // TAGS: WHISPER_DECODER_INIT
             for (int j = 0; j < n_decoders_cur; ++j) {
@@ -5755,7 +8948,6 @@ int whisper_full_with_state(
             }
 
             // init prompt and kv cache for the current iteration
-            // TODO: do not recompute the prompt if it is the same as previous time
             {
                 prompt.clear();
 
@@ -5781,48 +8973,80 @@ int whisper_full_with_state(
                 if (state->kv_self_n_dec < n_decoders_cur) {
                     WHISPER_LOG_DEBUG("%s: recreating KV cache: n_decoders_cur = %d\n", __func__, n_decoders_cur);
 
+                    const ggml_type type_k = state->kv_self.k->type;
+                    const ggml_type type_v = state->kv_self.v->type;
+
                     whisper_kv_cache_free(state->kv_self);
 
-                    // overallocate to workaround KV cache fragmentation issues
-                    const int factor = n_decoders_cur > 1 ? n_decoders_cur + 2 : 1;
+                    // the decoders share the prompt cells and each generates at most n_text_ctx/2 tokens
+                    // fragmentation is not an issue, since whisper_kv_cache_find_slot can scatter a batch over the free cells
+                    const int n_text_ctx = ctx->model.hparams.n_text_ctx;
 
-                    if (!whisper_kv_cache_init(state->kv_self, state->backends[0], ctx->itype,
+                    if (!whisper_kv_cache_init(state->kv_self, state->backends[0], type_k, type_v,
                                 ctx->model.hparams.n_text_state,
                                 ctx->model.hparams.n_text_layer,
-                                GGML_PAD(ctx->model.hparams.n_text_ctx, 256)*factor)) {
+                                GGML_PAD(n_text_ctx + (n_decoders_cur - 1)*(n_text_ctx/2), 256))) {
                         WHISPER_LOG_ERROR("%s: whisper_kv_cache_init() failed for self-attention cache\n", __func__);
                         whisper_free_state(state);
                         return -7;
                     }
 
                     state->kv_self_n_dec = n_decoders_cur;
+
+                    state->kv_self_prompt.clear();
                 }
 
-                whisper_kv_cache_clear(state->kv_self);
+                // the SOT token is always decoded, because its logits are needed for the no_speech probability
+                const int i_sot = prompt.size() - prompt_init.size();
 
-                whisper_batch_prep_legacy(state->batch, prompt.data(), prompt.size(), 0, 0);
+                // keep the longest prefix of the previous prompt that is still in the KV cache
+                // this happens on temperature fallbacks, where only the sampling changes, while kv_cross stays the same
+                int n_past = 0;
+                {
+                    const auto & prompt_prev = state->kv_self_prompt;
+
+                    while (n_past < i_sot && n_past < (int) prompt_prev.size() && prompt_prev[n_past] == prompt[n_past]) {
+                        n_past++;
+                    }
+                }
+
+                if (n_past > 0) {
+                    WHISPER_LOG_DEBUG("%s: reusing %d prompt tokens from the KV cache\n", __func__, n_past);
+
+                    whisper_kv_cache_seq_keep_prefix(state->kv_self, 0, n_past);
+                } else {
+                    whisper_kv_cache_clear(state->kv_self);
+                }
 
-                if (!whisper_decode_internal(*ctx, *state, state->batch, params.n_threads, false, params.abort_callback, params.abort_callback_user_data)) {
+                state->kv_self_prompt.clear();
+
+                whisper_batch_prep_legacy(state->batch, prompt.data() + n_past, prompt.size() - n_past, n_past, 0);
+                state->batch.logits[i_sot - n_past] = 1;
+
+                if (!whisper_decode_internal(*ctx, *state, state->batch, n_threads.decode, false, params.abort_callback, params.abort_callback_user_data)) {
                     WHISPER_LOG_ERROR("%s: failed to decode\n", __func__);
                     return -8;
                 }
 
+                state->kv_self_prompt = prompt;
+
                 // Calculate no_speech probability after first decode.
                 // This has to be done before any logit filtering. Hence we cannot use the probs from the whisper_process_logits.
                 {
                     const int n_logits = ctx->vocab.id_to_token.size();
+                    std::vector<float> logits(state->logits.begin() + (i_sot - n_past)*n_logits, state->logits.begin() + (i_sot - n_past + 1)*n_logits);
                     std::vector<float> logprobs(n_logits);
                     std::vector<float> probs(n_logits);
 
-                    whisper_compute_logprobs(state->logits, n_logits, logprobs);
-                    whisper_compute_probs(state->logits, n_logits, logprobs, probs);
+                    whisper_compute_logprobs(logits, n_logits, logprobs);
+                    whisper_compute_probs(logits, n_logits, logprobs, probs);
                     state->no_speech_prob = probs[whisper_token_nosp(ctx)];
                 }
 
                 {
                     const int64_t t_start_sample_us = ggml_time_us();
 
-                    state->decoders[0].i_batch = prompt.size() - 1;
+                    state->decoders[0].i_batch = prompt.size() - n_past - 1;
 
                     whisper_process_logits(*ctx, *state, state->decoders[0], params, t_cur);
 
@@ -5831,15 +9055,33 @@ int whisper_full_with_state(
 
                         whisper_kv_cache_seq_cp(state->kv_self, 0, j, -1, -1);
 
-                        memcpy(decoder.probs.data(),    state->decoders[0].probs.data(),    decoder.probs.size()*sizeof(decoder.probs[0]));
-                        memcpy(decoder.logits.data(),   state->decoders[0].logits.data(),   decoder.logits.size()*sizeof(decoder.logits[0]));
-                        memcpy(decoder.logprobs.data(), state->decoders[0].logprobs.data(), decoder.logprobs.size()*sizeof(decoder.logprobs[0]));
+                        // the first decoder of a parallel fallback group processes the logits with its own temperature
+                        if (t_dec[j] != t_dec[j - 1]) {
+                            decoder.i_batch = state->decoders[0].i_batch;
+
+                            whisper_process_logits(*ctx, *state, decoder, params, t_dec[j]);
+
+                            continue;
+                        }
+
+                        const auto & decoder_src = state->decoders[j - 1];
+
+                        memcpy(decoder.probs.data(),    decoder_src.probs.data(),    decoder.probs.size()*sizeof(decoder.probs[0]));
+                        memcpy(decoder.logits.data(),   decoder_src.logits.data(),   decoder.logits.size()*sizeof(decoder.logits[0]));
+                        memcpy(decoder.logprobs.data(), decoder_src.logprobs.data(), decoder.logprobs.size()*sizeof(decoder.logprobs[0]));
                     }
 
                     state->t_sample_us += ggml_time_us() - t_start_sample_us;
                 }
             }
 
+            // the greedy decoder can evaluate the tokens proposed by the draft model in a single pass
+            // the draft tokens that are still in the batch and the KV cache, waiting to be accepted
+            const bool use_draft = dstate != nullptr && params.strategy == WHISPER_SAMPLING_GREEDY && n_decoders_cur == 1;
+
+            std::vector<whisper_token> draft;
+            std::vector<whisper_token> tokens_cur;
+
             for (int i = 0, n_max = whisper_n_text_ctx(ctx)/2 - 4; i < n_max; ++i) {
                 const int64_t t_start_sample_us = ggml_time_us();
 
@@ -5850,7 +9092,7 @@ int whisper_full_with_state(
                 }
 
                 // sampling
-                // TODO: avoid memory allocations, optimize, avoid threads?
+                // TODO: avoid memory allocations, optimize
                 {
                     std::atomic<int> j_cur(0);
 
@@ -5871,7 +9113,7 @@ int whisper_full_with_state(
                             switch (params.strategy) {
                                 case whisper_sampling_strategy::WHISPER_SAMPLING_GREEDY:
                                     {
-                                        if (t_cur < 1e-6f) {
+                                        if (t_dec[j] < 1e-6f) {
                                             decoder.sequence.tokens.push_back(whisper_sample_token(*ctx, decoder, true));
                                         } else {
                                             decoder.sequence.tokens.push_back(whisper_sample_token(*ctx, decoder, false));
@@ -5883,33 +9125,17 @@ int whisper_full_with_state(
                                     {
                                         const auto tokens_new = whisper_sample_token_topk(*ctx, decoder, params.beam_search.beam_size);
 
-                                        for (const auto & token : tokens_new) {
-                                            bc_per_dec[j].push_back({ j, decoder.seek_delta, decoder.has_ts, decoder.sequence, decoder.grammar, });
-                                            bc_per_dec[j].back().sequence.tokens.push_back(token);
-                                            bc_per_dec[j].back().sequence.sum_logprobs_all += token.plog;
+                                        for (int k = 0; k < (int) tokens_new.size(); ++k) {
+                                            const auto & token = tokens_new[k];
+
+                                            bc_per_dec[j].push_back({ j, k, token, decoder.sequence.sum_logprobs_all + token.plog, });
                                         }
                                     } break;
                             };
                         }
                     };
 
-                    const int n_threads = std::min(params.n_threads, n_decoders_cur);
-
-                    if (n_threads == 1) {
-                        process();
-                    } else {
-                        std::vector<std::thread> threads(n_threads - 1);
-
-                        for (int t = 0; t < n_threads - 1; ++t) {
-                            threads[t] = std::thread(process);
-                        }
-
-                        process();
-
-                        for (int t = 0; t < n_threads - 1; ++t) {
-                            threads[t].join();
-                        }
-                    }
+                    whisper_worker_pool_run(state->workers, std::min(n_threads.sample, n_decoders_cur), [&](int) { process(); });
                 }
 
                 beam_candidates.clear();
@@ -5922,40 +9148,90 @@ int whisper_full_with_state(
                 }
 
                 // for beam-search, choose the top candidates and update the KV caches
+                // the candidates are popped from a heap in order until each decoder has one
                 if (params.strategy == whisper_sampling_strategy::WHISPER_SAMPLING_BEAM_SEARCH) {
-                    std::sort(
-                            beam_candidates.begin(),
-                            beam_candidates.end(),
-                            [](const beam_candidate & a, const beam_candidate & b) {
-                        if (a.sequence.sum_logprobs_all != b.sequence.sum_logprobs_all) {
-                            return a.sequence.sum_logprobs_all > b.sequence.sum_logprobs_all;
+                    std::make_heap(beam_candidates.begin(), beam_candidates.end(), beam_candidate_less);
+
+                    beam_sorted.clear();
+
+                    // the candidate c in the order, false if there are fewer candidates
+                    const auto beam_sorted_get = [&](size_t c) {
+                        while (beam_sorted.size() <= c && !beam_candidates.empty()) {
+                            std::pop_heap(beam_candidates.begin(), beam_candidates.end(), beam_candidate_less);
+                            beam_sorted.push_back(beam_candidates.back());
+                            beam_candidates.pop_back();
                         }
-                        return a.decoder_idx < b.decoder_idx;
-                    });
 
-                    uint32_t cur_c = 0;
+                        return c < beam_sorted.size();
+                    };
+
+                    // the candidates extend the sequences of their parents, which are compared only if the tokens match
+                    const auto beam_candidate_equal = [&](const beam_candidate & a, const beam_candidate & b) {
+                        return a.token.id == b.token.id && (a.decoder_idx == b.decoder_idx ||
+                                whisper_sequence_tokens_equal(state->decoders[a.decoder_idx].sequence, state->decoders[b.decoder_idx].sequence));
+                    };
+
+                    size_t cur_c = 0;
 
                     for (int j = 0; j < n_decoders_cur; ++j) {
-                        auto & decoder = state->decoders[j];
+                        const auto & decoder = state->decoders[j];
 
                         if (decoder.completed || decoder.failed) {
                             continue;
                         }
 
-                        if (cur_c >= beam_candidates.size()) {
+                        if (!beam_sorted_get(cur_c)) {
                             cur_c = 0;
                         }
 
-                        auto & cur = beam_candidates[cur_c++];
+                        // the reference to beam_sorted is invalidated by beam_sorted_get()
+                        beam_selected[j] = beam_sorted[cur_c++];
 
-                        while (beam_candidates.size() > cur_c && whisper_sequence_tokens_equal(beam_candidates[cur_c].sequence, cur.sequence) && i > 0) {
+                        while (beam_sorted_get(cur_c) && beam_candidate_equal(beam_sorted[cur_c], beam_selected[j]) && i > 0) {
                             ++cur_c;
                         }
+                    }
+
+                    // materialize the selected candidates, from the parents before they are overwritten
+                    for (int j = 0; j < n_decoders_cur; ++j) {
+                        const auto & decoder = state->decoders[j];
+
+                        if (decoder.completed || decoder.failed) {
+                            continue;
+                        }
+
+                        const auto & cur    = beam_selected[j];
+                        const auto & parent = state->decoders[cur.decoder_idx];
+
+                        auto & sequence = beam_sequences[j];
+
+                        sequence.tokens.assign(parent.sequence.tokens.begin(), parent.sequence.tokens.end());
+                        sequence.tokens.push_back(cur.token);
+
+                        sequence.result_len       = parent.sequence.result_len;
+                        sequence.sum_logprobs_all = cur.sum_logprobs_all;
+                        sequence.sum_logprobs     = parent.sequence.sum_logprobs;
+                        sequence.avg_logprobs     = parent.sequence.avg_logprobs;
+                        sequence.entropy          = parent.sequence.entropy;
+                        sequence.score            = parent.sequence.score;
+
+                        beam_parents[j] = { parent.seek_delta, parent.has_ts, parent.grammar, };
+                    }
+
+                    for (int j = 0; j < n_decoders_cur; ++j) {
+                        auto & decoder = state->decoders[j];
+
+                        if (decoder.completed || decoder.failed) {
+                            continue;
+                        }
+
+                        const auto & cur = beam_selected[j];
 
-                        decoder.seek_delta = cur.seek_delta;
-                        decoder.has_ts     = cur.has_ts;
-                        decoder.sequence   = cur.sequence;
-                        decoder.grammar    = cur.grammar;
+                        decoder.seek_delta = beam_parents[j].seek_delta;
+                        decoder.has_ts     = beam_parents[j].has_ts;
+                        decoder.grammar    = std::move(beam_parents[j].grammar);
+
+                        std::swap(decoder.sequence, beam_sequences[j]);
 
                         whisper_kv_cache_seq_cp(state->kv_self, cur.decoder_idx, WHISPER_MAX_DECODERS + j, -1, -1);
 
@@ -6093,7 +9369,25 @@ int whisper_full_with_state(
 
                     const int n_past = prompt.size() + i;
 
-                    for (int j = 0; j < n_decoders_cur; ++j) {
+                    // if the sampled token is the next draft token, its logits are already in the last batch
+                    // otherwise, the rest of the draft is rejected and removed from the KV cache
+                    bool accepted = false;
+
+                    if (!draft.empty()) {
+                        auto & decoder = state->decoders[0];
+
+                        if (decoder.sequence.tokens.back().id == draft.front()) {
+                            draft.erase(draft.begin());
+                            decoder.i_batch++;
+
+                            accepted = true;
+                        } else {
+                            whisper_kv_cache_seq_rm(state->kv_self, 0, n_past, -1);
+                            draft.clear();
+                        }
+                    }
+
+                    for (int j = 0; j < n_decoders_cur && !accepted; ++j) {
                         auto & decoder = state->decoders[j];
 
                         if (decoder.failed || decoder.completed) {
@@ -6112,16 +9406,44 @@ int whisper_full_with_state(
                         batch.n_tokens++;
                     }
 
-                    assert(batch.n_tokens > 0);
+                    const int n_draft = std::min(params.n_draft, std::min(whisper_n_text_ctx(ctx) - n_past - 1, n_max - i - 1));
+
+                    if (use_draft && !accepted && batch.n_tokens == 1 && n_draft > 0) {
+                        const auto & decoder = state->decoders[0];
+
+                        tokens_cur = prompt;
+                        for (const auto & token : decoder.sequence.tokens) {
+                            tokens_cur.push_back(token.id);
+                        }
+
+                        const uint8_t * suppress_mask = state->suppress_mask ? state->suppress_mask->data() : nullptr;
+
+                        if (!whisper_draft_propose(*params.draft_ctx, *dstate, params, suppress_mask, tokens_cur, prompt.size(), seek, state->exp_n_audio_ctx, n_draft,
+                                    n_threads.decode, params.abort_callback, params.abort_callback_user_data, draft)) {
+                            WHISPER_LOG_ERROR("%s: failed to decode with the draft model\n", __func__);
+                            return -9;
+                        }
+
+                        for (int k = 0; k < (int) draft.size(); ++k) {
+                            batch.token   [batch.n_tokens]    = draft[k];
+                            batch.pos     [batch.n_tokens]    = n_past + k + 1;
+                            batch.n_seq_id[batch.n_tokens]    = 1;
+                            batch.seq_id  [batch.n_tokens][0] = 0;
+                            batch.logits  [batch.n_tokens]    = 1;
+                            batch.n_tokens++;
+                        }
+                    }
+
+                    assert(batch.n_tokens > 0 || accepted);
 
-                    if (!whisper_decode_internal(*ctx, *state, state->batch, params.n_threads, false, params.abort_callback, params.abort_callback_user_data)) {
+                    if (!accepted && !whisper_decode_internal(*ctx, *state, state->batch, n_threads.decode, false, params.abort_callback, params.abort_callback_user_data)) {
                         WHISPER_LOG_ERROR("%s: failed to decode\n", __func__);
                         return -9;
                     }
 
                     const int64_t t_start_sample_us = ggml_time_us();
 
-                    // TODO: avoid memory allocations, optimize, avoid threads?
+                    // TODO: avoid memory allocations, optimize
                     {
                         std::atomic<int> j_cur(0);
 
@@ -6139,38 +9461,26 @@ int whisper_full_with_state(
                                     continue;
                                 }
 
-                                whisper_process_logits(*ctx, *state, decoder, params, t_cur);
+                                whisper_process_logits(*ctx, *state, decoder, params, t_dec[j]);
                             }
                         };
 
-                        const int n_threads = std::min(params.n_threads, n_decoders_cur);
-
-                        if (n_threads == 1) {
-                            process();
-                        } else {
-                            std::vector<std::thread> threads(n_threads - 1);
-
-                            for (int t = 0; t < n_threads - 1; ++t) {
-                                threads[t] = std::thread(process);
-                            }
-
-                            process();
-
-                            for (int t = 0; t < n_threads - 1; ++t) {
-                                threads[t].join();
-                            }
-                        }
+                        whisper_worker_pool_run(state->workers, std::min(n_threads.sample, n_decoders_cur), [&](int) { process(); });
                     }
 
                     state->t_sample_us += ggml_time_us() - t_start_sample_us;
                 }
             }
 
-            // rank the resulting sequences and select the best one
-            {
+            // rank the resulting sequences and select the best one of each group
+            std::vector<int> best_per_group(n_groups);
+
+            for (int g = 0; g < n_groups; ++g) {
                 double best_score = -INFINITY;
 
-                for (int j = 0; j < n_decoders_cur; ++j) {
+                best_per_group[g] = g == 0 ? best_decoder_id : group_begin[g];
+
+                for (int j = group_begin[g]; j < group_begin[g + 1]; ++j) {
                     auto & decoder = state->decoders[j];
 
                     if (decoder.failed) {
@@ -6195,29 +9505,43 @@ int whisper_full_with_state(
 
                     if (best_score < decoder.sequence.score) {
                         best_score = decoder.sequence.score;
-                        best_decoder_id = j;
+                        best_per_group[g] = j;
                     }
                 }
 
-                WHISPER_LOG_DEBUG("%s: best decoder = %d\n", __func__, best_decoder_id);
+                WHISPER_LOG_DEBUG("%s: best decoder = %d (temperature = %.2f)\n", __func__, best_per_group[g], temperatures[it + g]);
             }
 
             bool success = true;
 
-            // was the decoding successful for the current temperature?
-            // do fallback only if:
-            // - we are not at the last temperature
-            if (it != (int) temperatures.size() - 1) {
-                const auto & decoder = state->decoders[best_decoder_id];
-
-                if (decoder.failed ||
-                    (decoder.sequence.avg_logprobs < params.logprob_thold && state->no_speech_prob < params.no_speech_thold)) {
-                    WHISPER_LOG_DEBUG("%s: failed due to avg_logprobs %8.5f < %8.5f and no_speech_prob %8.5f < %8.5f\n", __func__, decoder.sequence.avg_logprobs, params.logprob_thold, state->no_speech_prob, params.no_speech_thold);
-                    success = false;
-                    state->n_fail_p++;
+            // the groups are checked in order of increasing temperature, as if they were decoded one after another
+            for (int g = 0; g < n_groups; ++g) {
+                best_decoder_id = best_per_group[g];
+
+                success = true;
+
+                // was the decoding successful for the current temperature?
+                // do fallback only if:
+                // - we are not at the last temperature
+                if (it + g != (int) temperatures.size() - 1) {
+                    const auto & decoder = state->decoders[best_decoder_id];
+
+                    if (decoder.failed ||
+                        (decoder.sequence.avg_logprobs < params.logprob_thold && state->no_speech_prob < params.no_speech_thold)) {
+                        WHISPER_LOG_DEBUG("%s: failed due to avg_logprobs %8.5f < %8.5f and no_speech_prob %8.5f < %8.5f\n", __func__, decoder.sequence.avg_logprobs, params.logprob_thold, state->no_speech_prob, params.no_speech_thold);
+                        success = false;
+                        state->n_fail_p++;
+                    }
+                }
+
+                if (success) {
+                    break;
                 }
             }
 
+            // skip the temperatures that were already decoded in parallel
+            it += n_groups - 1;
+
             if (success) {
                 //for (auto & token : ctx->decoders[best_decoder_id].sequence.tokens) {
                 //    WHISPER_LOG_DEBUG("%s: token = %d, p = %6.3f, pt = %6.3f, ts = %s, str = %s\n", __func__, token.id, token.p, token.pt, ctx->vocab.id_to_token.at(token.tid).c_str(), ctx->vocab.id_to_token.at(token.id).c_str());
@@ -6368,7 +9692,7 @@ int whisper_full_with_state(
                 if (ctx->params.dtw_token_timestamps && n_segments) {
                     const int n_frames = std::min(std::min(WHISPER_CHUNK_SIZE * 100, seek_delta), seek_end - seek);
                     whisper_exp_compute_token_level_timestamps_dtw(
-                            ctx, state, params, result_all.size() - n_segments, n_segments, seek, n_frames, 7, params.n_threads);
+                            ctx, state, params, result_all.size() - n_segments, n_segments, seek, n_frames, 7, n_threads.decode);
                     if (params.new_segment_callback) {
                         for (int seg = (int) result_all.size() - n_segments; seg < n_segments; seg++) {
                             params.new_segment_callback(ctx, state, seg, params.new_segment_callback_user_data);
@@ -6415,9 +9739,27 @@ int whisper_full_parallel(
     }
     int ret = 0;
 
-    // prepare separate states for each thread
+    // prepare separate states for each thread - they are kept in the pool of the context for the next call
+    if (!ctx->state_pool) {
+        ctx->state_pool = whisper_state_pool_init(ctx, 0);
+    }
+
     std::vector<whisper_state*> states;
 
+    for (int i = 0; i < n_processors - 1; ++i) {
+        states.push_back(whisper_state_pool_acquire(ctx->state_pool));
+
+        if (!states.back()) {
+            WHISPER_LOG_ERROR("%s: failed to initialize the state of processor %d\n", __func__, i + 1);
+
+            for (whisper_state * state : states) {
+                whisper_state_pool_release(ctx->state_pool, state);
+            }
+
+            return -1;
+        }
+    }
+
     const int offset_samples = (WHISPER_SAMPLE_RATE*params.offset_ms)/1000;
     const int n_samples_per_processor = (n_samples - offset_samples)/n_processors;
 
@@ -6426,9 +9768,6 @@ int whisper_full_parallel(
 
     std::vector<std::thread> workers(n_processors - 1);
     for (int i = 0; i < n_processors - 1; ++i) {
-        // create a new state for each thread
-        states.push_back(whisper_init_state(ctx));
-
         const int start_samples = offset_samples + (i + 1)*n_samples_per_processor;
         const int n_samples_cur = (i == n_processors - 2) ? n_samples - start_samples : n_samples_per_processor;
 
@@ -6499,7 +9838,7 @@ int whisper_full_parallel(
         ctx->state->n_batchd += states[i]->n_batchd;
         ctx->state->n_prompt += states[i]->n_prompt;
 
-        whisper_free_state(states[i]);
+        whisper_state_pool_release(ctx->state_pool, states[i]);
     }
 
     // average the timings
@@ -6784,6 +10123,13 @@ WHISPER_API const char * whisper_bench_ggml_mul_mat_str(int n_threads) {
 
     ggml_time_init();
 
+    ggml_backend_ptr backend { ggml_backend_init_by_type(GGML_BACKEND_DEVICE_TYPE_CPU, nullptr) };
+
+    // the threads are started once, so that the runs measure only the matrix multiplications
+    whisper_threadpool threadpool;
+    whisper_threadpool_init(threadpool, { backend.get() }, {}, false, 50);
+    whisper_threadpool_reserve(threadpool, n_threads);
+
     const int n_max = 128;
 
     const std::vector<size_t> sizes = {
@@ -6853,12 +10199,12 @@ WHISPER_API const char * whisper_bench_ggml_mul_mat_str(int n_threads) {
             double tsum = 0.0;
 
             // heat-up
-            ggml_graph_compute_helper(gf, n_threads, nullptr, nullptr);
+            ggml_graph_compute_helper(backend.get(), gf, n_threads);
 
             for (int i = 0; i < n_max; ++i) {
                 const int64_t t0 = ggml_time_us();
 
-                ggml_graph_compute_helper(gf, n_threads, nullptr, nullptr);
+                ggml_graph_compute_helper(backend.get(), gf, n_threads);
 
                 const int64_t t1 = ggml_time_us();
 
@@ -6894,6 +10240,156 @@ WHISPER_API const char * whisper_bench_ggml_mul_mat_str(int n_threads) {
     return s.c_str();
 }
 
+// [EXPERIMENTAL] the thread count with which fn() is the fastest, among 1, 2, 3, 4, 6, 8, 12, ... up to n_threads_max
+// each count is timed with the min of 3 runs after a warm-up, and is only chosen over a lower one if it saves > 2%
+static int whisper_tune_threads_phase(const char * name, int n_threads_max, const std::function<bool(int)> & fn) {
+    std::vector<int> counts;
+    for (int n = 1; n < n_threads_max; n = n < 4 ? n + 1 : n + n/2) {
+        counts.push_back(n);
+    }
+    counts.push_back(n_threads_max);
+
+    std::string log;
+
+    int     n_best = 0;
+    int64_t t_best = 0;
+
+    for (const int n : counts) {
+        if (!fn(n)) {
+            return -1;
+        }
+
+        int64_t t_min = INT64_MAX;
+        for (int i = 0; i < 3; ++i) {
+            const int64_t t_start_us = ggml_time_us();
+
+            if (!fn(n)) {
+                return -1;
+            }
+
+            t_min = std::min(t_min, ggml_time_us() - t_start_us);
+        }
+
+        char buf[64];
+        snprintf(buf, sizeof(buf), " %d: %.2f ms", n, t_min/1000.0);
+        log += buf;
+
+        if (n_best == 0 || t_min < 0.98*t_best) {
+            n_best = n;
+            t_best = t_min;
+        }
+    }
+
+    WHISPER_LOG_INFO("%s: %-6s - %2d threads |%s\n", __func__, name, n_best, log.c_str());
+
+    return n_best;
+}
+
+int whisper_tune_threads(struct whisper_context * ctx, int n_threads_max) {
+    n_threads_max = std::max(1, std::min(n_threads_max, GGML_MAX_N_THREADS));
+
+    whisper_state * state = whisper_init_state(ctx);
+    if (!state) {
+        WHISPER_LOG_ERROR("%s: failed to create a state\n", __func__);
+        return -1;
+    }
+
+    // 30 s of noise, i.e. one full window of the encoder
+    std::vector<float> pcm(WHISPER_CHUNK_SIZE*WHISPER_SAMPLE_RATE);
+    {
+        std::mt19937 rng(0);
+        std::uniform_real_distribution<float> dist(-0.1f, 0.1f);
+
+        for (auto & v : pcm) {
+            v = dist(rng);
+        }
+    }
+
+    // the decoder steps are timed after a prompt of n_past tokens
+    const int n_past = 32;
+
+    std::vector<whisper_token> prompt(n_past);
+    for (int i = 0; i < n_past; ++i) {
+        prompt[i] = i;
+    }
+
+    const whisper_token token = whisper_token_sot(ctx);
+
+    // the sampling of the default best_of decoders, with temperature as in the fallbacks
+    const int n_decoders = std::min(5, WHISPER_MAX_DECODERS);
+
+    const auto params = whisper_full_default_params(WHISPER_SAMPLING_GREEDY);
+
+    whisper_threads res;
+
+    res.mel = whisper_tune_threads_phase("mel", n_threads_max, [&](int n) {
+        return whisper_pcm_to_mel_with_state(ctx, state, pcm.data(), pcm.size(), n) == 0;
+    });
+
+    if (res.mel > 0) {
+        res.encode = whisper_tune_threads_phase("encode", n_threads_max, [&](int n) {
+            return whisper_encode_with_state(ctx, state, 0, n) == 0;
+        });
+    }
+
+    if (res.encode > 0 && whisper_decode_with_state(ctx, state, prompt.data(), prompt.size(), 0, n_threads_max) == 0) {
+        res.decode = whisper_tune_threads_phase("decode", n_threads_max, [&](int n) {
+            return whisper_decode_with_state(ctx, state, &token, 1, n_past, n) == 0;
+        });
+    }
+
+    if (res.decode > 0) {
+        res.sample = whisper_tune_threads_phase("sample", std::min(n_threads_max, n_decoders), [&](int n) {
+            std::atomic<int> j_cur(0);
+
+            whisper_worker_pool_run(state->workers, n, [&](int) {
+                while (true) {
+                    const int j = j_cur.fetch_add(1);
+
+                    if (j >= n_decoders) {
+                        break;
+                    }
+
+                    auto & decoder = state->decoders[j];
+
+                    decoder.sequence.tokens.clear();
+                    decoder.i_batch = 0;
+
+                    whisper_process_logits(*ctx, *state, decoder, params, 0.2f);
+                    whisper_sample_token(*ctx, decoder, false);
+                }
+            });
+
+            return true;
+        });
+    }
+
+    whisper_free_state(state);
+
+    if (res.mel <= 0 || res.encode <= 0 || res.decode <= 0 || res.sample <= 0) {
+        WHISPER_LOG_ERROR("%s: failed to measure the phases\n", __func__);
+        return -2;
+    }
+
+    ctx->threads_tuned = res;
+
+    return 0;
+}
+
+void whisper_get_tuned_threads(struct whisper_context * ctx, int * n_mel, int * n_encode, int * n_decode, int * n_sample) {
+    *n_mel    = ctx->threads_tuned.mel;
+    *n_encode = ctx->threads_tuned.encode;
+    *n_decode = ctx->threads_tuned.decode;
+    *n_sample = ctx->threads_tuned.sample;
+}
+
+void whisper_set_tuned_threads(struct whisper_context * ctx, int n_mel, int n_encode, int n_decode, int n_sample) {
+    ctx->threads_tuned.mel    = std::max(0, n_mel);
+    ctx->threads_tuned.encode = std::max(0, n_encode);
+    ctx->threads_tuned.decode = std::max(0, n_decode);
+    ctx->threads_tuned.sample = std::max(0, n_sample);
+}
+
 // =================================================================================================
 
 // =================================================================================================
@@ -7404,6 +10900,7 @@ static void whisper_exp_compute_token_level_timestamps_dtw(
     // Decoder already returns only alignment head QKs, already concatenated in
     // one tensor.
     whisper_kv_cache_clear(state->kv_self);
+    state->kv_self_prompt.clear();
     whisper_batch_prep_legacy(state->batch, tokens.data(), tokens.size(), 0, 0);
     whisper_kv_cache_seq_rm(state->kv_self, 0, 0, -1);
     if (!whisper_decode_internal(*ctx, *state, state->batch, n_threads, true, nullptr, nullptr)) {
@@ -0,0 +1,149 @@
+// compare the real FFT of the log mel spectrogram (src/whisper-fft.h) against the
+// previous recursive implementation and a double precision DFT
+
+#include "whisper-fft.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+// reference: the recursive Cooley-Tukey FFT with the DFT fallback that was used before
+static float ref_sin_vals[WHISPER_RFFT_N];
+static float ref_cos_vals[WHISPER_RFFT_N];
+
+static void ref_dft(const float * in, int N, float * out) {
+    const int sin_cos_step = WHISPER_RFFT_N / N;
+
+    for (int k = 0; k < N; k++) {
+        float re = 0;
+        float im = 0;
+
+        for (int n = 0; n < N; n++) {
+            int idx = (k * n * sin_cos_step) % (WHISPER_RFFT_N);
+            re += in[n]*ref_cos_vals[idx];
+            im -= in[n]*ref_sin_vals[idx];
+        }
+
+        out[k*2 + 0] = re;
+        out[k*2 + 1] = im;
+    }
+}
+
+static void ref_fft(float * in, int N, float * out) {
+    if (N == 1) {
+        out[0] = in[0];
+        out[1] = 0;
+        return;
+    }
+
+    const int half_N = N / 2;
+    if (N - half_N*2 == 1) {
+        ref_dft(in, N, out);
+        return;
+    }
+
+    float * even = in + N;
+    for (int i = 0; i < half_N; ++i) {
+        even[i]= in[2*i];
+    }
+    float * even_fft = out + 2 * N;
+    ref_fft(even, half_N, even_fft);
+
+    float * odd = even;
+    for (int i = 0; i < half_N; ++i) {
+        odd[i] = in[2*i + 1];
+    }
+    float * odd_fft = even_fft + N;
+    ref_fft(odd, half_N, odd_fft);
+
+    const int sin_cos_step = WHISPER_RFFT_N / N;
+    for (int k = 0; k < half_N; k++) {
+        int idx = k * sin_cos_step;
+        float re = ref_cos_vals[idx];
+        float im = -ref_sin_vals[idx];
+
+        float re_odd = odd_fft[2*k + 0];
+        float im_odd = odd_fft[2*k + 1];
+
+        out[2*k + 0] = even_fft[2*k + 0] + re*re_odd - im*im_odd;
+        out[2*k + 1] = even_fft[2*k + 1] + re*im_odd + im*re_odd;
+
+        out[2*(k + half_N) + 0] = even_fft[2*k + 0] - re*re_odd + im*im_odd;
+        out[2*(k + half_N) + 1] = even_fft[2*k + 1] - re*im_odd - im*re_odd;
+    }
+}
+
+int main(void) {
+    const int N = WHISPER_RFFT_N;
+    const int n_bins = N/2 + 1;
+
+    for (int i = 0; i < N; i++) {
+        const double theta = (2 * M_PI * i) / N;
+        ref_sin_vals[i] = sinf(theta);
+        ref_cos_vals[i] = cosf(theta);
+    }
+
+    const whisper_rfft_plan plan;
+
+    std::vector<float> in(N);
+    std::vector<float> out(n_bins);
+    std::vector<float> work(2*N);
+
+    std::vector<float> ref_in(2*N);
+    std::vector<float> ref_out(8*N);
+
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+
+    double err_ref_max = 0.0;
+    double err_dft_max = 0.0;
+
+    const int n_frames = 64;
+
+    for (int f = 0; f < n_frames; ++f) {
+        // white noise, a pure tone, an impulse and silence
+        for (int i = 0; i < N; ++i) {
+            switch (f % 4) {
+                case 0: in[i] = dist(rng); break;
+                case 1: in[i] = 0.5f*sinf(2.0f*M_PI*(f + 1)*i/N + 0.1f*f); break;
+                case 2: in[i] = i == f ? 1.0f : 0.0f; break;
+                case 3: in[i] = 0.0f; break;
+            }
+        }
+
+        whisper_rfft_power(plan, in.data(), out.data(), work.data());
+
+        std::copy(in.begin(), in.end(), ref_in.begin());
+        ref_fft(ref_in.data(), N, ref_out.data());
+
+        double p_max = 1e-10;
+        for (int k = 0; k < n_bins; ++k) {
+            p_max = std::max(p_max, (double) out[k]);
+        }
+
+        for (int k = 0; k < n_bins; ++k) {
+            const double p_ref = ref_out[2*k + 0]*ref_out[2*k + 0] + ref_out[2*k + 1]*ref_out[2*k + 1];
+
+            double re = 0.0;
+            double im = 0.0;
+            for (int n = 0; n < N; ++n) {
+                re += in[n]*cos(2.0*M_PI*k*n/N);
+                im -= in[n]*sin(2.0*M_PI*k*n/N);
+            }
+            const double p_dft = re*re + im*im;
+
+            err_ref_max = std::max(err_ref_max, std::abs(out[k] - p_ref)/p_max);
+            err_dft_max = std::max(err_dft_max, std::abs(out[k] - p_dft)/p_max);
+        }
+    }
+
+    printf("%s: max relative error vs previous FFT = %e, vs double DFT = %e\n", __func__, err_ref_max, err_dft_max);
+
+    if (err_ref_max > 1e-4 || err_dft_max > 1e-4) {
+        fprintf(stderr, "%s: FAILED\n", __func__);
+        return 1;
+    }
+
+    return 0;
+}
@@ -0,0 +1,130 @@
+// store a batch in the KV cache (src/whisper-kv.h) scattered over several runs of cells, and compare the cells
+// with those of the same batch stored contiguously, with and without flash attention (transposed V)
+
+#include "whisper-kv.h"
+
+#include "ggml.h"
+#include "ggml-cpu.h"
+
+#include <cstdio>
+#include <utility>
+#include <vector>
+
+// the value of element j of token t in Kcur (Vcur is offset by 0.5)
+static float value(int t, int j) {
+    return 100.0f*t + j;
+}
+
+struct kv_result {
+    std::vector<float> k; // [n_ctx, n_state] per layer
+    std::vector<float> v; // [n_ctx, n_state] per layer, or [n_state, n_ctx] without flash attention
+};
+
+static kv_result store(int n_state, int n_ctx, int n_layer, int il, int n_tokens,
+        const std::vector<std::pair<uint32_t, uint32_t>> & runs, bool flash_attn) {
+    ggml_init_params params = {
+        /*.mem_size   =*/ 16*1024*1024,
+        /*.mem_buffer =*/ nullptr,
+        /*.no_alloc   =*/ false,
+    };
+
+    ggml_context * ctx0 = ggml_init(params);
+
+    ggml_tensor * k = ggml_new_tensor_1d(ctx0, GGML_TYPE_F32, n_state*n_ctx*n_layer);
+    ggml_tensor * v = ggml_new_tensor_1d(ctx0, GGML_TYPE_F32, n_state*n_ctx*n_layer);
+
+    ggml_set_f32(k, -1.0f);
+    ggml_set_f32(v, -1.0f);
+
+    ggml_tensor * Kcur = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, n_tokens);
+    ggml_tensor * Vcur = ggml_new_tensor_2d(ctx0, GGML_TYPE_F32, n_state, n_tokens);
+
+    for (int t = 0; t < n_tokens; ++t) {
+        for (int j = 0; j < n_state; ++j) {
+            ((float *) Kcur->data)[t*n_state + j] = value(t, j);
+            ((float *) Vcur->data)[t*n_state + j] = value(t, j) + 0.5f;
+        }
+    }
+
+    ggml_cgraph * gf = ggml_new_graph(ctx0);
+
+    whisper_kv_cache_store_runs(ctx0, gf, k, v, n_ctx, Kcur, Vcur, il, n_tokens, runs, flash_attn);
+
+    ggml_graph_compute_with_ctx(ctx0, gf, 1);
+
+    kv_result res;
+    res.k.assign((float *) k->data, (float *) k->data + ggml_nelements(k));
+    res.v.assign((float *) v->data, (float *) v->data + ggml_nelements(v));
+
+    ggml_free(ctx0);
+
+    return res;
+}
+
+int main(void) {
+    const int n_state  = 8;
+    const int n_ctx    = 16;
+    const int n_layer  = 2;
+    const int n_tokens = 6;
+
+    // cell of each token: 0 | 5 6 | 9 10 11
+    const std::vector<std::pair<uint32_t, uint32_t>> runs = { { 0, 1 }, { 5, 2 }, { 9, 3 } };
+    const std::vector<std::pair<uint32_t, uint32_t>> cont = { { 0, n_tokens } };
+
+    int n_fail = 0;
+
+    for (int fa = 0; fa < 2; ++fa) {
+        for (int il = 0; il < n_layer; ++il) {
+            const kv_result a = store(n_state, n_ctx, n_layer, il, n_tokens, runs, fa);
+            const kv_result b = store(n_state, n_ctx, n_layer, il, n_tokens, cont, fa);
+
+            // the offsets of element j of a cell in the k and v of layer il
+            auto idx_k = [&](int cell, int j) { return (il*n_ctx + cell)*n_state + j; };
+            auto idx_v = [&](int cell, int j) { return fa ? idx_k(cell, j) : il*n_ctx*n_state + j*n_ctx + cell; };
+
+            for (int t = 0, ir = 0, ic = 0; t < n_tokens; ++t) {
+                if (ic == (int) runs[ir].second) {
+                    ir++;
+                    ic = 0;
+                }
+
+                const int cell = runs[ir].first + ic++;
+
+                for (int j = 0; j < n_state; ++j) {
+                    const float ka = a.k[idx_k(cell, j)];
+                    const float va = a.v[idx_v(cell, j)];
+
+                    if (ka != b.k[idx_k(t, j)] || ka != value(t, j) ||
+                        va != b.v[idx_v(t, j)] || va != value(t, j) + 0.5f) {
+                        fprintf(stderr, "%s: flash_attn = %d, layer %d: token %d in cell %d, element %d: k = %g, v = %g (expected %g, %g)\n",
+                                __func__, fa, il, t, cell, j, ka, va, value(t, j), value(t, j) + 0.5f);
+                        n_fail++;
+                        break;
+                    }
+                }
+            }
+
+            // the cells outside of the runs are not written
+            int n_written = 0;
+            for (size_t i = 0; i < a.k.size(); ++i) {
+                n_written += a.k[i] != -1.0f;
+                n_written += a.v[i] != -1.0f;
+            }
+
+            if (n_written != 2*n_tokens*n_state) {
+                fprintf(stderr, "%s: flash_attn = %d, layer %d: %d elements written, expected %d\n",
+                        __func__, fa, il, n_written, 2*n_tokens*n_state);
+                n_fail++;
+            }
+        }
+    }
+
+    if (n_fail > 0) {
+        fprintf(stderr, "%s: FAILED\n", __func__);
+        return 1;
+    }
+
+    printf("%s: OK\n", __func__);
+
+    return 0;
+}
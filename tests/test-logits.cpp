@@ -0,0 +1,215 @@
+// compare the fused logits kernels (src/whisper-logits.h) against the previous scalar passes of
+// whisper_process_logits(), and time both on a vocab of the size of the multilingual models
+
+#include "whisper-logits.h"
+
+#include "ggml.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <random>
+#include <vector>
+
+// reference: the log softmax, the timestamp logsumexp and the probs as they were computed before
+struct ref_result {
+    float timestamp_logprob;
+    float max_text_token_logprob;
+};
+
+static ref_result ref_process(const std::vector<float> & logits, int n_text, std::vector<float> & logprobs, std::vector<float> & probs) {
+    const int n = logits.size();
+
+    const float logit_max = *std::max_element(logits.begin(), logits.end());
+    float logsumexp = 0.0f;
+    for (int i = 0; i < n; ++i) {
+        if (logits[i] > -INFINITY) {
+            logsumexp += expf(logits[i] - logit_max);
+        }
+    }
+    logsumexp = logf(logsumexp) + logit_max;
+
+    for (int i = 0; i < n; ++i) {
+        logprobs[i] = logits[i] > -INFINITY ? logits[i] - logsumexp : -INFINITY;
+    }
+
+    ref_result res;
+
+    res.timestamp_logprob = -INFINITY;
+    {
+        float sum = 0.0f;
+        const float logprob_max = *std::max_element(logprobs.begin() + n_text, logprobs.end());
+        for (int i = n_text; i < n; ++i) {
+            if (logprobs[i] > -INFINITY) {
+                sum += expf(logprobs[i] - logprob_max);
+            }
+        }
+        if (sum > 0.0f) {
+            res.timestamp_logprob = logf(sum) + logprob_max;
+        }
+    }
+
+    res.max_text_token_logprob = *std::max_element(logprobs.begin(), logprobs.begin() + n_text);
+
+    for (int i = 0; i < n; ++i) {
+        probs[i] = logits[i] == -INFINITY ? 0.0f : expf(logprobs[i]);
+    }
+
+    return res;
+}
+
+int main(void) {
+    const int n_vocab = 51865;
+    const int n_text  = 50364; // token_beg
+
+    std::mt19937 rng(42);
+    std::normal_distribution<float> dist(0.0f, 4.0f);
+
+    std::vector<float> src(n_vocab);
+    std::vector<uint8_t> mask(n_vocab);
+
+    std::vector<float> logits(n_vocab), logprobs(n_vocab), probs(n_vocab);
+    std::vector<float> ref_logprobs(n_vocab), ref_probs(n_vocab);
+
+    double err_logprob_max = 0.0;
+    double err_prob_max    = 0.0;
+    double err_lse_ref     = 0.0; // previous passes vs double precision
+    double err_lse_dbl     = 0.0; // fused kernels vs double precision
+    double err_ts_max      = 0.0;
+    int    n_argmax_diff   = 0;
+
+    // exp over its whole range, against expf()
+    double err_exp_max = 0.0;
+    for (float x = -100.0f; x <= 0.0f; x += 0.001f) {
+        const double e_ref = expf(x);
+        const double e     = whisper_logits_exp(x);
+
+        if (e_ref > 1e-37) {
+            err_exp_max = std::max(err_exp_max, std::abs(e - e_ref)/e_ref);
+        }
+    }
+
+    const int n_cases = 64;
+
+    for (int c = 0; c < n_cases; ++c) {
+        for (int i = 0; i < n_vocab; ++i) {
+            src[i]  = dist(rng) + (c % 4 == 1 && i >= n_text ? 12.0f : 0.0f);
+            mask[i] = (c % 3 == 0) && (i % 7 == 0);
+        }
+
+        // all the timestamps suppressed
+        if (c % 4 == 2) {
+            std::fill(mask.begin() + n_text, mask.end(), 1);
+        }
+
+        const float temperature = (c % 2)*0.2f*(c % 5);
+
+        // the mask in the first pass, or after it (as with a logits filter callback)
+        if (c % 8 < 4) {
+            whisper_logits_prep(logits.data(), src.data(), n_vocab, temperature, mask.data());
+        } else {
+            whisper_logits_prep(logits.data(), src.data(), n_vocab, temperature, nullptr);
+            whisper_logits_mask(logits.data(), n_vocab, mask.data());
+        }
+
+        const auto stats = whisper_logits_softmax_begin(logits.data(), n_vocab, n_text, probs.data());
+        whisper_logits_softmax_end(logits.data(), n_vocab, stats, logprobs.data(), probs.data());
+
+        const auto ref = ref_process(logits, n_text, ref_logprobs, ref_probs);
+
+        const float lse = stats.lse();
+
+        {
+            double x_max = -INFINITY;
+            for (int i = 0; i < n_vocab; ++i) {
+                x_max = std::max(x_max, (double) logits[i]);
+            }
+            double sum = 0.0;
+            for (int i = 0; i < n_vocab; ++i) {
+                sum += exp((double) logits[i] - x_max);
+            }
+            const double lse_dbl = log(sum) + x_max;
+
+            const int i_max = std::max_element(logits.begin(), logits.end()) - logits.begin();
+
+            err_lse_dbl = std::max(err_lse_dbl, std::abs(lse - lse_dbl));
+            err_lse_ref = std::max(err_lse_ref, std::abs(logits[i_max] - ref_logprobs[i_max] - lse_dbl));
+        }
+        const float timestamp_logprob = stats.sum_ts > 0.0f ? logf(stats.sum_ts) + stats.max - lse : -INFINITY;
+
+        if ((timestamp_logprob == -INFINITY) != (ref.timestamp_logprob == -INFINITY)) {
+            fprintf(stderr, "%s: case %d: timestamp logprob %f vs %f\n", __func__, c, timestamp_logprob, ref.timestamp_logprob);
+            return 1;
+        }
+        if (timestamp_logprob > -INFINITY) {
+            err_ts_max = std::max(err_ts_max, (double) std::abs(timestamp_logprob - ref.timestamp_logprob));
+        }
+        err_ts_max = std::max(err_ts_max, (double) std::abs(stats.max_text - lse - ref.max_text_token_logprob));
+
+        for (int i = 0; i < n_vocab; ++i) {
+            if ((logprobs[i] == -INFINITY) != (ref_logprobs[i] == -INFINITY)) {
+                fprintf(stderr, "%s: case %d: logprobs[%d] = %f vs %f\n", __func__, c, i, logprobs[i], ref_logprobs[i]);
+                return 1;
+            }
+            if (logprobs[i] > -INFINITY) {
+                err_logprob_max = std::max(err_logprob_max, (double) std::abs(logprobs[i] - ref_logprobs[i]));
+            }
+            err_prob_max = std::max(err_prob_max, (double) std::abs(probs[i] - ref_probs[i]));
+        }
+
+        const int id     = whisper_logits_argmax(probs.data(), n_vocab);
+        const int id_ref = std::max_element(ref_probs.begin(), ref_probs.end()) - ref_probs.begin();
+
+        n_argmax_diff += id != id_ref;
+    }
+
+    printf("%s: max error: exp (relative) = %e, logsumexp vs double = %e (previous passes %e)\n",
+            __func__, err_exp_max, err_lse_dbl, err_lse_ref);
+    printf("%s: max difference to the previous passes: logprobs = %e, probs = %e, timestamp rule = %e, argmax = %d\n",
+            __func__, err_logprob_max, err_prob_max, err_ts_max, n_argmax_diff);
+
+    // microbenchmark: one decoder step of whisper_process_logits() without the token rules
+    {
+        const int n_iter = 200;
+
+        ggml_time_init();
+
+        int64_t t_ref = 0;
+        int64_t t_new = 0;
+
+        float sink = 0.0f;
+
+        for (int it = 0; it < n_iter; ++it) {
+            {
+                const int64_t t0 = ggml_time_us();
+
+                for (int i = 0; i < n_vocab; ++i) {
+                    logits[i] = src[i]/0.4f;
+                }
+                const auto ref = ref_process(logits, n_text, ref_logprobs, ref_probs);
+
+                t_ref += ggml_time_us() - t0;
+                sink  += ref.timestamp_logprob + ref_probs[it];
+            }
+            {
+                const int64_t t0 = ggml_time_us();
+
+                whisper_logits_prep(logits.data(), src.data(), n_vocab, 0.4f, nullptr);
+                const auto stats = whisper_logits_softmax_begin(logits.data(), n_vocab, n_text, probs.data());
+                whisper_logits_softmax_end(logits.data(), n_vocab, stats, logprobs.data(), probs.data());
+
+                t_new += ggml_time_us() - t0;
+                sink  += stats.sum_ts + probs[it];
+            }
+        }
+
+        printf("%s: n_vocab = %d: scalar passes %.3f ms, fused kernels %.3f ms per step (%.1fx) [%g]\n",
+                __func__, n_vocab, t_ref/1000.0/n_iter, t_new/1000.0/n_iter, (double) t_ref/std::max<int64_t>(1, t_new), sink > 0.0f ? 0.0 : 1.0);
+    }
+
+    if (err_exp_max > 1e-6 || err_lse_dbl > 1e-5 || err_logprob_max > 1e-3 || err_prob_max > 1e-3 || err_ts_max > 1e-3 || n_argmax_diff > 0) {
+        fprintf(stderr, "%s: FAILED\n", __func__);
+        return 1;
+    }
+
+    return 0;
+}